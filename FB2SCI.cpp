@@ -15,26 +15,1624 @@
 #include <iostream>
 #include <vector>
 #include <iomanip>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <array>
+#include <map>
+#include <set>
+#include <deque>
+#include <functional>
+#include <ctime>
+#include <unordered_map>
+#include <cmath>
+#include <filesystem>
+#include <algorithm>
+#include <complex>
+#include <utility>
+#include <random>
+#include <cerrno>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
 float nVersion = 1.00;
 
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Bank dumps are described by layout types rather than by offsets spread through the      //
+//  code. A layout names the sysex header that identifies the dump and where its voice      //
+//  packets sit:                                                                            //
+//                                                                                          //
+//  $00 :           Header..............Sysex bytes identifying the dump                    //
+//  first_packet :  Packet data.........packet_size nibblized bytes (two per voice byte)    //
+//                  Checksum, then the next packet's 2-byte size, so packets repeat every   //
+//                  packet_stride bytes, packet_count times                                 //
+//                                                                                          //
+//  Everything is a compile-time constant, so the parsers below unroll into straight-line   //
+//  code per layout. Supporting another packet-based dump takes one more typedef.           //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+template <unsigned char... Bytes>
+struct SysexHeader {
+    static constexpr int header_size = sizeof...(Bytes);
+    static constexpr unsigned char header[sizeof...(Bytes)] = { Bytes... };
+};
+
+template <class Header, int FirstPacket, int PacketCount, int PacketStride, int PacketSize, int FileSize>
+struct PacketDumpLayout : Header {
+    static constexpr int first_packet = FirstPacket;
+    static constexpr int packet_count = PacketCount;
+    static constexpr int packet_stride = PacketStride;
+    static constexpr int packet_size = PacketSize;
+    static constexpr int file_size = FileSize;
+    static constexpr int record_size = PacketSize / 2;              // Bytes per voice once denibblized
+    static constexpr int packet_data_size = PacketCount * PacketSize;
+    static constexpr int voice_data_size = PacketCount * PacketSize / 2;
+
+    static_assert(PacketSize % 2 == 0, "packets hold whole nibble pairs");
+    static_assert(FirstPacket >= Header::header_size, "packets overlap the header");
+    static_assert(FirstPacket + (PacketCount - 1) * PacketStride + PacketSize <= FileSize, "packets run past the end of the dump");
+};
+
+// FB-01 "send Bank A/B" dumps: 48 voices of 128 nibbles, 131 bytes apart, 6363 bytes in all
+typedef PacketDumpLayout<SysexHeader<0xF0, 0x43, 0x75, 0x00, 0x00, 0x00, 0x00>, 0x4C, 48, 131, 128, 6363> Fb01BankALayout;
+typedef PacketDumpLayout<SysexHeader<0xF0, 0x43, 0x75, 0x00, 0x00, 0x00, 0x01>, 0x4C, 48, 131, 128, 6363> Fb01BankBLayout;
+
+template <class Layout, size_t... Index>
+inline bool header_matches(const char* raw, index_sequence<Index...>) {
+    return ((static_cast<unsigned char>(raw[Index]) == Layout::header[Index]) & ...);
+}
+
+// True if raw holds a whole dump of this layout
+template <class Layout>
+inline bool is_dump(const char* raw, size_t size) {
+    return size == static_cast<size_t>(Layout::file_size) && header_matches<Layout>(raw, make_index_sequence<Layout::header_size>());
+}
+
+template <class Layout, size_t... Packet>
+inline void gather_packets(const char* raw, char* packets, index_sequence<Packet...>) {
+    (memcpy(packets + Packet * Layout::packet_size, raw + Layout::first_packet + Packet * Layout::packet_stride, Layout::packet_size), ...);
+}
+
+// Copies the packet data of a dump, without the checksums and size bytes between packets,
+// into packets (Layout::packet_data_size bytes)
+template <class Layout>
+inline void gather_packets(const char* raw, char* packets) {
+    gather_packets<Layout>(raw, packets, make_index_sequence<Layout::packet_count>());
+}
+
+template <size_t... Byte>
+inline void denibble_record(const char* packet, char* record, index_sequence<Byte...>) {
+    // Each voice byte is sent low nibble first
+    ((record[Byte] = static_cast<char>(((packet[2 * Byte + 1] & 0x0F) << 4) | (packet[2 * Byte] & 0x0F))), ...);
+}
+
+template <class Layout, size_t... Packet>
+inline void denibble_packets(const char* packets, char* records, index_sequence<Packet...>) {
+    (denibble_record(packets + Packet * Layout::packet_size, records + Packet * Layout::record_size,
+                     make_index_sequence<Layout::record_size>()), ...);
+}
+
+// Merges the nibble pairs of gathered packet data into voice records (Layout::voice_data_size
+// bytes). records may be the packet buffer itself: every byte is read before it is overwritten.
+template <class Layout>
+inline void denibble_packets(const char* packets, char* records) {
+    denibble_packets<Layout>(packets, records, make_index_sequence<Layout::packet_count>());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Batch conversion runs as a three-stage pipeline:                                        //
+//                                                                                          //
+//      readers  ->  converters  ->  writers                                                //
+//                                                                                          //
+//  Readers load both bank files of a pair into memory, converters validate and denibble    //
+//  them, and writers flush the finished 6148-byte patch images. The stages are connected   //
+//  by bounded lock-free queues, so a slow disk only stalls the readers/writers while the   //
+//  converters keep working, and a full queue pushes back on the stage feeding it.          //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Stages a conversion can fail in, for reporting
+enum ConversionStep { STEP_READ, STEP_VALIDATE, STEP_CONVERT, STEP_WRITE };
+
+// Outcome of reading, converting or writing: every problem found, with the step it was found
+// in. A Result with no problems is a success. Results of later steps are merged into the job's
+// so nothing is lost along the pipeline.
+class Result {
+public:
+    bool ok() const { return problems.empty(); }
+
+    void fail(ConversionStep step, const string& message) {
+        problems.emplace_back(step, message);
+    }
+
+    void merge(const Result& other) {
+        problems.insert(problems.end(), other.problems.begin(), other.problems.end());
+    }
+
+    // One line per problem, such as "validate: bank.syx is not ..."
+    string describe(const string& indent = "") const {
+        static const char* step_names[] = { "read", "validate", "convert", "write" };
+        string text;
+        for (const auto& problem : problems) {
+            text += indent + step_names[problem.first] + ": " + problem.second + "\n";
+        }
+        return text;
+    }
+
+    vector<pair<ConversionStep, string>> problems;
+};
+
+// One bank pair making its way through the pipeline
+struct ConversionJob {
+    string input_filename1;
+    string input_filename2;
+    string output_filename;
+    vector<char> raw1, raw2;    // Complete bank files as loaded by the reader stage
+    vector<char> data1, data2;  // Instrument packets, denibbled in place by reorganize_data()
+    size_t index = 0;           // Position in the job list, so failures are reported in order
+    size_t outputs_pending = 0; // Outputs the committer hasn't settled yet, plus one while the writer stage still has the job
+    Result result;              // Problems found by any stage; later stages skip the work but pass the job along
+};
+
+// Append-only log of the outputs a batch run has committed, one filename per line, so a run that
+// gets killed can be resumed (--checkpoint file --resume). Records are handed to the OS as soon as
+// their outputs are renamed into place but never fsynced: losing the last few only means redoing
+// those jobs. A line torn by a crash has no newline and is ignored when the log is read back.
+class CheckpointLog {
+public:
+    bool open(const string& filename, bool resume) {
+        if (resume) {
+            ifstream in(filename, ios::binary);
+            string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            size_t start = 0;
+            for (size_t end = contents.find('\n'); end != string::npos; start = end + 1, end = contents.find('\n', start)) {
+                completed.insert(contents.substr(start, end - start));
+            }
+            // Start the next record on a fresh line if the last one was torn
+            torn = start < contents.size();
+        }
+        log.open(filename, resume ? ios::binary | ios::app : ios::binary | ios::trunc);
+        return log.good();
+    }
+
+    bool contains(const string& output) const {
+        return completed.count(output) > 0;
+    }
+
+    void record(const vector<string>& outputs) {
+        string records = torn ? "\n" : "";
+        for (const string& output : outputs) {
+            records += output + "\n";
+        }
+        lock_guard<mutex> guard(lock);
+        log.write(records.data(), records.size());
+        log.flush();
+        torn = false;
+    }
+
+private:
+    mutex lock;
+    ofstream log;
+    set<string> completed;
+    bool torn = false;
+};
+
+// Worker end of a --coordinate session: asks the coordinating process for ranges of job list
+// indices, and reports its totals once there are none left. Every message is one line of text:
+//   worker: NEXT                                coordinator: RANGE begin end  or  DONE
+//   worker: FAILED index problem (one per problem of each failed job), then STATS converted failed
+class CoordinatorClient {
+public:
+    CoordinatorClient() {}
+    ~CoordinatorClient();
+    CoordinatorClient(const CoordinatorClient&) = delete;
+    CoordinatorClient& operator=(const CoordinatorClient&) = delete;
+
+    bool connect(const string& address);
+    // False once the coordinator has nothing left (or has gone away)
+    bool next_range(size_t& begin, size_t& end);
+    void report(int converted, const vector<unique_ptr<ConversionJob>>& failures);
+
+private:
+    int fd = -1;
+    string buffer;   // Received bytes not yet split into lines
+};
+
+const size_t coordinator_range_size = 64;   // Jobs handed out at a time, unless --range says otherwise
+
+// Bounded multi-producer/multi-consumer queue (after Dmitry Vyukov's design). Each slot carries a
+// sequence number telling producers and consumers whose turn it is, so no locks are needed.
+// push() waits while the queue is full, which is what gives us backpressure. A waiting thread
+// yields for a few rounds, then sleeps on a condition variable until an item moves, so a stage
+// stuck behind slow storage doesn't burn a core. Only then do push() and pop() take the lock.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        // Round the capacity up to a power of two so the slot index is a simple mask
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots = vector<Slot>(size);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    void push(T item) {
+        int idle = 0;
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = std::move(item);
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    wake_sleepers();
+                    return;
+                }
+            }
+            else if (diff < 0) {
+                // Queue is full, wait for the next stage to catch up
+                wait(idle, [&]() {
+                    size_t next = enqueue_pos.load(memory_order_relaxed);
+                    return static_cast<intptr_t>(slots[next & mask].sequence.load(memory_order_acquire)) - static_cast<intptr_t>(next) >= 0;
+                });
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+            else {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    T pop() {
+        int idle = 0;
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    T item = std::move(slot.value);
+                    slot.sequence.store(pos + mask + 1, memory_order_release);
+                    wake_sleepers();
+                    return item;
+                }
+            }
+            else if (diff < 0) {
+                // Queue is empty, wait for the previous stage
+                wait(idle, [&]() {
+                    size_t next = dequeue_pos.load(memory_order_relaxed);
+                    return static_cast<intptr_t>(slots[next & mask].sequence.load(memory_order_acquire)) - static_cast<intptr_t>(next + 1) >= 0;
+                });
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+            else {
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    // Yields for the first queue_spin_rounds calls, then sleeps until ready() holds
+    template <typename Ready>
+    void wait(int& idle, const Ready& ready) {
+        if (idle++ < queue_spin_rounds) {
+            this_thread::yield();
+            return;
+        }
+        unique_lock<mutex> guard(sleep_lock);
+        // Announce the sleeper before checking ready(); wake_sleepers() publishes its change before
+        // looking for sleepers, so one of the two always sees the other
+        sleepers.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        wake.wait(guard, ready);
+        sleepers.fetch_sub(1);
+    }
+
+    void wake_sleepers() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleepers.load(memory_order_relaxed) > 0) {
+            lock_guard<mutex> guard(sleep_lock);
+            wake.notify_all();
+        }
+    }
+
+    static const int queue_spin_rounds = 64;
+
+    vector<Slot> slots;
+    size_t mask = 0;
+    alignas(64) atomic<size_t> enqueue_pos{ 0 };
+    alignas(64) atomic<size_t> dequeue_pos{ 0 };
+    alignas(64) atomic<int> sleepers{ 0 };
+    mutex sleep_lock;
+    condition_variable wake;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Archive mode reads bank files straight out of tar and zip archives and writes the       //
+//  patches into an output archive, so large collections never have to be extracted to     //
+//  disk. Zip entries are inflated on the fly from the archive stream.                      //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Receives each completed bank pair: Bank A name and data, Bank B name and data
+typedef function<void(const string&, vector<char>&, const string&, vector<char>&)> BankPairHandler;
+
+// Receives each archive entry of interest: entry name and its (decompressed) contents
+typedef function<void(const string&, vector<char>&)> ArchiveEntryHandler;
+
+// Receives each voice found in a source: where it came from, its slot (0-95) and the 64-byte record
+typedef function<void(const string&, int, const char*)> VoiceHandler;
+
+// Translates the voices of another synth's sysex dump file (name, contents) to FB-01 records,
+// appended to records. Returns false with an error message if the file holds none.
+typedef function<bool(const vector<char>&, const string&, vector<char>&, string&)> VoiceImporter;
+
+// Reads deflate data from a stream, least significant bit first
+class BitReader {
+public:
+    explicit BitReader(istream& in) : in(in) {}
+
+    int bits(int count) {
+        uint32_t value = bit_buffer;
+        while (bit_count < count) {
+            int byte = in.get();
+            if (byte == EOF) {
+                failed = true;
+                return 0;
+            }
+            value |= static_cast<uint32_t>(byte) << bit_count;
+            bit_count += 8;
+        }
+        bit_buffer = value >> count;
+        bit_count -= count;
+        return static_cast<int>(value & ((1u << count) - 1));
+    }
+
+    // Drop the rest of the current byte (stored blocks start on a byte boundary)
+    void align() {
+        bit_buffer = 0;
+        bit_count = 0;
+    }
+
+    istream& in;
+    bool failed = false;
+
+private:
+    uint32_t bit_buffer = 0;
+    int bit_count = 0;
+};
+
+// Canonical Huffman code: number of codes of each length, and the symbols ordered by code
+struct HuffmanTable {
+    short count[16];
+    short symbol[320];
+};
+
+// Writes deflate data, least significant bit first
+class BitWriter {
+public:
+    explicit BitWriter(vector<char>& out) : out(out) {}
+
+    void bits(uint32_t value, int count) {
+        bit_buffer |= static_cast<uint64_t>(value) << bit_count;
+        bit_count += count;
+        while (bit_count >= 8) {
+            out.push_back(static_cast<char>(bit_buffer));
+            bit_buffer >>= 8;
+            bit_count -= 8;
+        }
+    }
+
+    // Huffman codes are packed starting from their most significant bit
+    void code(uint32_t value, int length) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed = reversed << 1 | ((value >> i) & 1);
+        }
+        bits(reversed, length);
+    }
+
+    // Pad the last byte with zero bits
+    void flush() {
+        if (bit_count > 0) {
+            out.push_back(static_cast<char>(bit_buffer));
+        }
+        bit_buffer = 0;
+        bit_count = 0;
+    }
+
+private:
+    vector<char>& out;
+    uint64_t bit_buffer = 0;
+    int bit_count = 0;
+};
+
+// Lengths and distances of deflate matches: base value and extra bits of each code
+const short deflate_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const short deflate_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const short deflate_distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                          513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const short deflate_distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                           8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Matches up Bank A and Bank B files by their sysex headers. Banks are paired within the same
+// directory of the same source (archive), in the order they are seen, so an archive holding many
+// pairs side by side works without relying on any naming scheme.
+class BankPairer {
+public:
+    explicit BankPairer(BankPairHandler handler) : handler(handler) {}
+
+    // Returns false if the data is not an FB-01 bank dump at all
+    bool add(const string& source, const string& name, vector<char>& data) {
+        bool bank_a = is_dump<Fb01BankALayout>(data.data(), data.size());
+        if (!bank_a && !is_dump<Fb01BankBLayout>(data.data(), data.size())) {
+            return false;
+        }
+        int bank = bank_a ? 0 : 1;
+        string directory = source + "\n" + name.substr(0, name.find_last_of('/') + 1);
+        deque<pair<string, vector<char>>>& partners = pending[1 - bank][directory];
+        if (partners.empty()) {
+            pending[bank][directory].emplace_back(name, std::move(data));
+            return true;
+        }
+        pair<string, vector<char>> partner = std::move(partners.front());
+        partners.pop_front();
+        if (bank == 0) {
+            handler(name, data, partner.first, partner.second);
+        }
+        else {
+            handler(partner.first, partner.second, name, data);
+        }
+        return true;
+    }
+
+    // Names of the banks still waiting for a partner
+    vector<string> unpaired() const {
+        vector<string> names;
+        for (int bank = 0; bank < 2; bank++) {
+            for (const auto& directory : pending[bank]) {
+                string source = directory.first.substr(0, directory.first.find('\n'));
+                for (const auto& entry : directory.second) {
+                    names.push_back(source + ": " + entry.first);
+                }
+            }
+        }
+        return names;
+    }
+
+private:
+    BankPairHandler handler;
+    map<string, deque<pair<string, vector<char>>>> pending[2];
+};
+
+// Writes entries into a tar archive, or a zip archive (stored, uncompressed) if the filename ends in .zip
+class ArchiveWriter {
+public:
+    bool open(const string& filename);
+    void add(const string& name, const vector<char>& data);
+    bool close(string& error);
+
+private:
+    struct ZipEntry {
+        string name;
+        uint32_t crc;
+        uint32_t size;
+        uint32_t offset;
+    };
+    void write_tar_header(const string& name, size_t size, char type);
+
+    ofstream out;
+    bool zip = false;
+    vector<ZipEntry> zip_entries;
+    uint64_t offset = 0;
+    uint16_t dos_time = 0, dos_date = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Each of the 96 instruments in the patch is a 64-byte FB-01 voice record, laid out as:   //
+//                                                                                          //
+//  $00-$06 :  Voice name (7 ASCII characters)                                              //
+//  $08-$0F :  Voice-wide parameters (LFO, algorithm, feedback, transpose...)               //
+//  $10-$2F :  Four 8-byte operator blocks (OP1 to OP4)                                     //
+//  $3A-$3B :  Play mode, portamento and pitch bend parameters                              //
+//                                                                                          //
+//  The tables below say where each parameter lives, so dumping, editing and translating    //
+//  voices all work from the same description instead of poking at bit masks.               //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Location of one voice parameter inside the voice record
+struct VoiceParameter {
+    const char* name;
+    int offset;       // Byte offset in the voice record, or in the operator block for operator parameters
+    int shift;        // Position of the parameter's lowest bit
+    int bits;         // Width of the parameter in bits
+    bool is_signed;   // Two's complement value
+};
+
+const VoiceParameter voice_parameters[] = {
+    { "lfo_speed",            8, 0, 8, false },
+    { "lfo_load",             9, 7, 1, false },
+    { "amd",                  9, 0, 7, false },
+    { "lfo_sync",            10, 7, 1, false },
+    { "pmd",                 10, 0, 7, false },
+    { "operator_enable",     11, 3, 4, false },
+    { "feedback",            12, 3, 3, false },
+    { "algorithm",           12, 0, 3, false },
+    { "pms",                 13, 4, 3, false },
+    { "ams",                 13, 0, 2, false },
+    { "lfo_waveform",        14, 5, 2, false },
+    { "transpose",           15, 0, 8, true },
+    { "mono",                58, 7, 1, false },
+    { "portamento_time",     58, 0, 7, false },
+    { "pmd_controller",      59, 4, 3, false },
+    { "pitchbend_range",     59, 0, 4, false },
+};
+
+const VoiceParameter operator_parameters[] = {
+    { "total_level",          0, 0, 7, false },
+    { "level_scaling_depth",  1, 4, 4, false },
+    { "velocity_sensitivity", 2, 4, 3, false },
+    { "level_scaling_type",   3, 7, 1, false },
+    { "detune",               3, 4, 3, false },
+    { "multiple",             3, 0, 4, false },
+    { "rate_scaling",         4, 6, 2, false },
+    { "attack_rate",          4, 0, 5, false },
+    { "am_enable",            5, 7, 1, false },
+    { "decay1_rate",          5, 0, 5, false },
+    { "inharmonic",           6, 6, 2, false },
+    { "decay2_rate",          6, 0, 5, false },
+    { "sustain_level",        7, 4, 4, false },
+    { "release_rate",         7, 0, 4, false },
+};
+
+// Indices into voice_parameters[] and operator_parameters[], for code that needs a particular parameter
+enum VoiceParameterIndex {
+    VOICE_LFO_SPEED, VOICE_LFO_LOAD, VOICE_AMD, VOICE_LFO_SYNC, VOICE_PMD, VOICE_OPERATOR_ENABLE, VOICE_FEEDBACK,
+    VOICE_ALGORITHM, VOICE_PMS, VOICE_AMS, VOICE_LFO_WAVEFORM, VOICE_TRANSPOSE, VOICE_MONO, VOICE_PORTAMENTO_TIME,
+    VOICE_PMD_CONTROLLER, VOICE_PITCHBEND_RANGE
+};
+enum OperatorParameterIndex {
+    OP_TOTAL_LEVEL, OP_LEVEL_SCALING_DEPTH, OP_VELOCITY_SENSITIVITY, OP_LEVEL_SCALING_TYPE, OP_DETUNE, OP_MULTIPLE,
+    OP_RATE_SCALING, OP_ATTACK_RATE, OP_AM_ENABLE, OP_DECAY1_RATE, OP_INHARMONIC, OP_DECAY2_RATE, OP_SUSTAIN_LEVEL,
+    OP_RELEASE_RATE
+};
+
+const int voice_parameter_count = sizeof(voice_parameters) / sizeof(voice_parameters[0]);
+const int operator_parameter_count = sizeof(operator_parameters) / sizeof(operator_parameters[0]);
+const int operator_offsets[4] = { 0x10, 0x18, 0x20, 0x28 };
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  The eight FB-01 algorithms, operators numbered as on the FB-01 (OP4 has the feedback    //
+//  loop, OP1 is always a carrier). Bit n stands for operator n+1.                          //
+//                                                                                          //
+//  1: 4>3>2>1        2: (3+4)>2>1      3: (3>2 + 4)>1    4: (4>3 + 2)>1                     //
+//  5: 4>3, 2>1       6: 4>(1,2,3)      7: 4>3, 2, 1      8: 1, 2, 3, 4                      //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Operators whose output is heard, per algorithm
+const int algorithm_carriers[8] = { 0x1, 0x1, 0x1, 0x1, 0x5, 0x7, 0x7, 0xF };
+
+// Operators modulating each operator, per algorithm
+const int algorithm_modulators[8][4] = {
+    { 0x2, 0x4, 0x8, 0x0 },
+    { 0x2, 0xC, 0x0, 0x0 },
+    { 0xA, 0x4, 0x0, 0x0 },
+    { 0x6, 0x0, 0x8, 0x0 },
+    { 0x2, 0x0, 0x8, 0x0 },
+    { 0x8, 0x8, 0x8, 0x0 },
+    { 0x0, 0x0, 0x8, 0x0 },
+    { 0x0, 0x0, 0x0, 0x0 },
+};
+
+// How the two operators of an OPL2 (AdLib) instrument are picked from the four FB-01 operators
+enum OplSelection {
+    OPL_SELECT_CARRIER,   // Loudest carrier plus its loudest modulator (default)
+    OPL_SELECT_LOUDEST,   // The two loudest operators
+    OPL_SELECT_FIXED,     // The same two operators for every voice (--opl-select M,C)
+};
+
+OplSelection opl_selection = OPL_SELECT_CARRIER;
+int opl_fixed_operators[2] = { 1, 0 };   // Modulator and carrier for OPL_SELECT_FIXED, zero based
+
+// --normalize: every voice's carriers are turned up or down until a rendered middle C has this
+// RMS level, in dB relative to full scale
+bool normalize_levels = false;
+double normalize_target = -18.0;
+const double total_level_step = 0.75;   // dB of attenuation per step of an operator's total level
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  The TX81Z, DX21, DX27 and DX100 use the same 4-operator chip family as the FB-01, so    //
+//  their voices translate almost parameter for parameter. Their bulk dumps are:            //
+//                                                                                          //
+//  VMEM (32 voices):  F0 43 0n 04 20 00, 32 x 128 packed bytes, checksum, F7               //
+//  VCED (1 voice):    F0 43 0n 03 00 5D, 93 unpacked bytes, checksum, F7                   //
+//                                                                                          //
+//  VCED holds one parameter per byte: four 13-byte operator blocks (in the order OP4,      //
+//  OP2, OP3, OP1) followed by the voice parameters and the 10 character name at 77.        //
+//  VMEM packs the same parameters into 10 bytes per operator and 118 bytes per voice.      //
+//  Voices are unpacked to VCED layout first, so both dumps share one parameter mapper.     //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+const int vced_size = 93;
+const int vced_operator_size = 13;
+const int vced_name = 77;
+const int vmem_voice_size = 128;
+const int four_op_operator_order[4] = { 3, 1, 2, 0 };   // FB-01 operator of each VCED operator block
+
+// Where a VCED parameter sits in a packed VMEM voice. Operator fields are relative to the
+// operator's block in both layouts. Only the parameters the FB-01 has a use for are listed.
+struct PackedField {
+    int vced;
+    int offset;
+    int shift;
+    int bits;
+};
+
+const PackedField vmem_operator_fields[] = {
+    {  0, 0, 0, 5 },   // AR
+    {  1, 1, 0, 5 },   // D1R
+    {  2, 2, 0, 5 },   // D2R
+    {  3, 3, 0, 4 },   // RR
+    {  4, 4, 0, 4 },   // D1L
+    {  5, 5, 0, 7 },   // LS
+    {  6, 9, 3, 2 },   // RS
+    {  8, 6, 6, 1 },   // AME
+    {  9, 6, 0, 3 },   // KVS
+    { 10, 7, 0, 7 },   // OUT
+    { 11, 8, 0, 6 },   // CRS (frequency ratio)
+    { 12, 9, 0, 3 },   // DET
+};
+
+const PackedField vmem_voice_fields[] = {
+    { 52, 40, 0, 3 },   // ALG
+    { 53, 40, 3, 3 },   // FBL
+    { 54, 41, 0, 7 },   // LFS
+    { 56, 43, 0, 7 },   // PMD
+    { 57, 44, 0, 7 },   // AMD
+    { 58, 40, 6, 1 },   // SYNC
+    { 59, 45, 0, 2 },   // LFW
+    { 60, 45, 4, 3 },   // PMS
+    { 61, 45, 2, 2 },   // AMS
+    { 62, 46, 0, 6 },   // TRPS
+    { 63, 48, 3, 1 },   // POLY/MONO
+    { 64, 47, 0, 4 },   // PBR
+    { 66, 49, 0, 7 },   // PORT TIME
+};
+
+// How a VCED value becomes an FB-01 value
+enum FourOpConversion {
+    FOUR_OP_COPY,           // Same range on both
+    FOUR_OP_SCALE,          // 0 to range, stretched to the full width of the FB-01 field
+    FOUR_OP_INVERT,         // range minus the value (D1L is a level, the FB-01 stores an attenuation)
+    FOUR_OP_OUTPUT_LEVEL,   // Output level 0-99 to total level attenuation
+    FOUR_OP_MULTIPLE,       // Frequency ratio to the multiple...
+    FOUR_OP_INHARMONIC,     // ...and inharmonic (DT2) fields
+    FOUR_OP_DETUNE,         // 0-6 centred on 3, to sign and magnitude
+    FOUR_OP_TRANSPOSE,      // 0-48 centred on 24, to two's complement
+};
+
+struct FourOpMapping {
+    int source;             // VCED parameter, relative to the operator block for operator parameters
+    int target;             // Index into voice_parameters[] or operator_parameters[]
+    FourOpConversion conversion;
+    int range;              // Largest VCED value, for FOUR_OP_SCALE and FOUR_OP_INVERT
+};
+
+const FourOpMapping four_op_voice_mappings[] = {
+    { 52, VOICE_ALGORITHM,        FOUR_OP_COPY,      7 },
+    { 53, VOICE_FEEDBACK,         FOUR_OP_COPY,      7 },
+    { 54, VOICE_LFO_SPEED,        FOUR_OP_SCALE,    99 },
+    { 56, VOICE_PMD,              FOUR_OP_SCALE,    99 },
+    { 57, VOICE_AMD,              FOUR_OP_SCALE,    99 },
+    { 58, VOICE_LFO_SYNC,         FOUR_OP_COPY,      1 },
+    { 59, VOICE_LFO_WAVEFORM,     FOUR_OP_COPY,      3 },
+    { 60, VOICE_PMS,              FOUR_OP_COPY,      7 },
+    { 61, VOICE_AMS,              FOUR_OP_COPY,      3 },
+    { 62, VOICE_TRANSPOSE,        FOUR_OP_TRANSPOSE, 48 },
+    { 63, VOICE_MONO,             FOUR_OP_COPY,      1 },
+    { 64, VOICE_PITCHBEND_RANGE,  FOUR_OP_COPY,     12 },
+    { 66, VOICE_PORTAMENTO_TIME,  FOUR_OP_SCALE,    99 },
+};
+
+const FourOpMapping four_op_operator_mappings[] = {
+    {  0, OP_ATTACK_RATE,          FOUR_OP_COPY,        31 },
+    {  1, OP_DECAY1_RATE,          FOUR_OP_COPY,        31 },
+    {  2, OP_DECAY2_RATE,          FOUR_OP_COPY,        31 },
+    {  3, OP_RELEASE_RATE,         FOUR_OP_COPY,        15 },
+    {  4, OP_SUSTAIN_LEVEL,        FOUR_OP_INVERT,      15 },
+    {  5, OP_LEVEL_SCALING_DEPTH,  FOUR_OP_SCALE,       99 },
+    {  6, OP_RATE_SCALING,         FOUR_OP_COPY,         3 },
+    {  8, OP_AM_ENABLE,            FOUR_OP_COPY,         1 },
+    {  9, OP_VELOCITY_SENSITIVITY, FOUR_OP_COPY,         7 },
+    { 10, OP_TOTAL_LEVEL,          FOUR_OP_OUTPUT_LEVEL, 99 },
+    { 11, OP_MULTIPLE,             FOUR_OP_MULTIPLE,    63 },
+    { 11, OP_INHARMONIC,           FOUR_OP_INHARMONIC,  63 },
+    { 12, OP_DETUNE,               FOUR_OP_DETUNE,       6 },
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  DX7 32-voice bulk dump:  F0 43 0n 09 20 00, 32 x 128 packed bytes, checksum, F7         //
+//                                                                                          //
+//  $00 :   Operators...................6 x 17 bytes, OP6 first: EG rates and levels,       //
+//                                      keyboard scaling, AMS/KVS, output level, frequency  //
+//  $66 :   Pitch EG....................4 rates, 4 levels                                   //
+//  $6E :   Algorithm, feedback, LFO....ALG, OKS/FB, LFS, LFD, PMD, AMD, PMS/WAVE/SYNC      //
+//  $75 :   Transpose...................0-48, 24 is none                                    //
+//  $76 :   Name........................10 characters                                       //
+//                                                                                          //
+//  A DX7 voice has two operators too many for the FB-01, so every way of keeping four of   //
+//  them and laying them onto one of the eight FB-01 algorithms is scored by how much of    //
+//  the DX7 modulation structure survives. The best few are then rendered and the one       //
+//  whose spectrum is closest to the DX7 voice's wins.                                      //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+const int dx7_voice_size = 128;
+
+// The 32 DX7 algorithms, operators numbered as on the DX7. Bit n stands for operator n+1.
+// Algorithms 4 and 6 loop OP6 back from OP4 and OP5; that is treated as feedback on OP6.
+struct Dx7Algorithm {
+    int carriers;
+    int modulators[6];   // Operators modulating each operator
+    int feedback;        // Operator with the feedback loop, zero based
+};
+
+const Dx7Algorithm dx7_algorithms[32] = {
+    { 0x05, { 0x02, 0x00, 0x08, 0x10, 0x20, 0x00 }, 5 },   //  1: 2>1, 6>5>4>3
+    { 0x05, { 0x02, 0x00, 0x08, 0x10, 0x20, 0x00 }, 1 },   //  2
+    { 0x09, { 0x02, 0x04, 0x00, 0x10, 0x20, 0x00 }, 5 },   //  3: 3>2>1, 6>5>4
+    { 0x09, { 0x02, 0x04, 0x00, 0x10, 0x20, 0x00 }, 5 },   //  4
+    { 0x15, { 0x02, 0x00, 0x08, 0x00, 0x20, 0x00 }, 5 },   //  5: 2>1, 4>3, 6>5
+    { 0x15, { 0x02, 0x00, 0x08, 0x00, 0x20, 0x00 }, 5 },   //  6
+    { 0x05, { 0x02, 0x00, 0x18, 0x00, 0x20, 0x00 }, 5 },   //  7: 2>1, (4 + 6>5)>3
+    { 0x05, { 0x02, 0x00, 0x18, 0x00, 0x20, 0x00 }, 3 },   //  8
+    { 0x05, { 0x02, 0x00, 0x18, 0x00, 0x20, 0x00 }, 1 },   //  9
+    { 0x09, { 0x02, 0x04, 0x00, 0x30, 0x00, 0x00 }, 2 },   // 10: 3>2>1, (5 + 6)>4
+    { 0x09, { 0x02, 0x04, 0x00, 0x30, 0x00, 0x00 }, 5 },   // 11
+    { 0x05, { 0x02, 0x00, 0x38, 0x00, 0x00, 0x00 }, 1 },   // 12: 2>1, (4 + 5 + 6)>3
+    { 0x05, { 0x02, 0x00, 0x38, 0x00, 0x00, 0x00 }, 5 },   // 13
+    { 0x05, { 0x02, 0x00, 0x08, 0x30, 0x00, 0x00 }, 5 },   // 14: 2>1, (5 + 6)>4>3
+    { 0x05, { 0x02, 0x00, 0x08, 0x30, 0x00, 0x00 }, 1 },   // 15
+    { 0x01, { 0x16, 0x00, 0x08, 0x00, 0x20, 0x00 }, 5 },   // 16: (2 + 4>3 + 6>5)>1
+    { 0x01, { 0x16, 0x00, 0x08, 0x00, 0x20, 0x00 }, 1 },   // 17
+    { 0x01, { 0x0E, 0x00, 0x00, 0x10, 0x20, 0x00 }, 2 },   // 18: (2 + 3 + 6>5>4)>1
+    { 0x19, { 0x02, 0x04, 0x00, 0x20, 0x20, 0x00 }, 5 },   // 19: 3>2>1, 6>(4, 5)
+    { 0x0B, { 0x04, 0x04, 0x00, 0x30, 0x00, 0x00 }, 2 },   // 20: 3>(1, 2), (5 + 6)>4
+    { 0x1B, { 0x04, 0x04, 0x00, 0x20, 0x20, 0x00 }, 2 },   // 21: 3>(1, 2), 6>(4, 5)
+    { 0x1D, { 0x02, 0x00, 0x20, 0x20, 0x20, 0x00 }, 5 },   // 22: 2>1, 6>(3, 4, 5)
+    { 0x1B, { 0x00, 0x04, 0x00, 0x20, 0x20, 0x00 }, 5 },   // 23: 1, 3>2, 6>(4, 5)
+    { 0x1F, { 0x00, 0x00, 0x20, 0x20, 0x20, 0x00 }, 5 },   // 24: 1, 2, 6>(3, 4, 5)
+    { 0x1F, { 0x00, 0x00, 0x00, 0x20, 0x20, 0x00 }, 5 },   // 25: 1, 2, 3, 6>(4, 5)
+    { 0x0B, { 0x00, 0x04, 0x00, 0x30, 0x00, 0x00 }, 5 },   // 26: 1, 3>2, (5 + 6)>4
+    { 0x0B, { 0x00, 0x04, 0x00, 0x30, 0x00, 0x00 }, 2 },   // 27
+    { 0x25, { 0x02, 0x00, 0x08, 0x10, 0x00, 0x00 }, 4 },   // 28: 2>1, 5>4>3, 6
+    { 0x17, { 0x00, 0x00, 0x08, 0x00, 0x20, 0x00 }, 5 },   // 29: 1, 2, 4>3, 6>5
+    { 0x27, { 0x00, 0x00, 0x08, 0x10, 0x00, 0x00 }, 4 },   // 30: 1, 2, 5>4>3, 6
+    { 0x1F, { 0x00, 0x00, 0x00, 0x00, 0x20, 0x00 }, 5 },   // 31: 1, 2, 3, 4, 6>5
+    { 0x3F, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, 5 },   // 32: all carriers
+};
+
+struct Dx7Operator {
+    int rates[4];
+    int levels[4];
+    int level_scaling_depth;   // Larger of the left and right depths
+    int rate_scaling;
+    int am_sensitivity;
+    int velocity_sensitivity;
+    int output_level;
+    bool fixed_frequency;
+    int coarse;
+    int fine;
+    int detune;                // 0-14, 7 is none
+};
+
+struct Dx7Voice {
+    Dx7Operator operators[6];  // OP1 first
+    int algorithm;             // Zero based
+    int feedback;
+    int lfo_speed;
+    int pmd;
+    int amd;
+    int lfo_sync;
+    int lfo_waveform;
+    int pms;
+    int transpose;
+    char name[10];
+};
+
+// One way of fitting a DX7 voice onto the FB-01: the DX7 operator (zero based) played by each
+// FB-01 operator, the FB-01 algorithm, and the structural cost of the fit
+struct Dx7Reduction {
+    int kept[4];
+    int algorithm;
+    double cost;
+};
+
+const int dx7_reduction_candidates = 6;   // Structural best fits that get rendered and compared
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  MT-32 / General MIDI mapping: every voice is reduced to a handful of timbre features    //
+//  (0 to 1 each) and matched against reference instruments with known MT-32 timbre and     //
+//  GM program numbers. The closest reference wins.                                         //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+enum TimbreFeature {
+    FEATURE_CARRIERS,     // Share of operators that are carriers
+    FEATURE_BRIGHTNESS,   // Modulator levels and feedback
+    FEATURE_ATTACK,       // Carrier attack rate
+    FEATURE_DECAY,        // Carrier first decay rate
+    FEATURE_SUSTAIN,      // Level the carriers hold while the key is down
+    FEATURE_RELEASE,      // Carrier release rate
+    FEATURE_PITCH,        // Frequency multiples and inharmonic detuning
+    FEATURE_VIBRATO,      // Pitch modulation sensitivity
+    FEATURE_COUNT
+};
+
+struct ReferenceTimbre {
+    const char* name;
+    int mt32;   // MT-32 preset timbre (0-127)
+    int gm;     // General MIDI program (0-127)
+    float features[FEATURE_COUNT];
+};
+
+const ReferenceTimbre reference_timbres[] = {
+    //                    MT-32  GM    carriers bright attack decay sustain release pitch vibrato
+    { "Piano",              0,   0,  { 0.25f, 0.45f, 1.00f, 0.45f, 0.15f, 0.45f, 0.10f, 0.00f } },
+    { "Electric piano",     3,   4,  { 0.50f, 0.35f, 1.00f, 0.55f, 0.10f, 0.45f, 0.15f, 0.00f } },
+    { "Organ",              8,  16,  { 0.75f, 0.20f, 1.00f, 0.00f, 1.00f, 0.80f, 0.15f, 0.20f } },
+    { "Harpsichord",       16,   6,  { 0.25f, 0.75f, 1.00f, 0.55f, 0.05f, 0.60f, 0.10f, 0.00f } },
+    { "Strings",           48,  48,  { 0.25f, 0.50f, 0.45f, 0.15f, 0.85f, 0.35f, 0.05f, 0.35f } },
+    { "Brass",             95,  61,  { 0.25f, 0.70f, 0.70f, 0.15f, 0.80f, 0.50f, 0.05f, 0.15f } },
+    { "Synth brass",       24,  62,  { 0.25f, 0.80f, 0.80f, 0.25f, 0.70f, 0.45f, 0.05f, 0.05f } },
+    { "Bass",              66,  33,  { 0.25f, 0.45f, 1.00f, 0.45f, 0.35f, 0.70f, 0.00f, 0.00f } },
+    { "Synth bass",        28,  38,  { 0.25f, 0.85f, 1.00f, 0.55f, 0.40f, 0.75f, 0.00f, 0.00f } },
+    { "Flute",             72,  73,  { 0.25f, 0.15f, 0.60f, 0.10f, 0.90f, 0.50f, 0.10f, 0.35f } },
+    { "Reed",              78,  65,  { 0.25f, 0.60f, 0.75f, 0.10f, 0.85f, 0.55f, 0.10f, 0.30f } },
+    { "Bell",             102,  14,  { 0.50f, 0.55f, 1.00f, 0.35f, 0.00f, 0.25f, 0.45f, 0.00f } },
+    { "Vibraphone",        97,  11,  { 0.50f, 0.30f, 1.00f, 0.40f, 0.10f, 0.30f, 0.30f, 0.50f } },
+    { "Marimba",          104,  12,  { 0.50f, 0.35f, 1.00f, 0.75f, 0.00f, 0.55f, 0.30f, 0.00f } },
+    { "Guitar",            59,  24,  { 0.25f, 0.50f, 1.00f, 0.50f, 0.05f, 0.45f, 0.10f, 0.00f } },
+    { "Harp",              57,  46,  { 0.25f, 0.30f, 1.00f, 0.40f, 0.00f, 0.35f, 0.10f, 0.00f } },
+    { "Pad",               37,  89,  { 0.50f, 0.30f, 0.25f, 0.10f, 0.90f, 0.15f, 0.10f, 0.30f } },
+    { "Lead",              47,  80,  { 0.25f, 0.90f, 0.90f, 0.10f, 0.90f, 0.60f, 0.05f, 0.20f } },
+    { "Timpani",          112,  47,  { 0.25f, 0.40f, 1.00f, 0.70f, 0.00f, 0.50f, 0.00f, 0.00f } },
+};
+
+// Result of matching one voice against the reference timbres
+struct VoiceMapping {
+    int reference;   // Index into reference_timbres[]
+    float score;     // 1 for a perfect match, 0 for as far away as possible
+};
+
+// Voice mappings remembered between runs (--map-cache), keyed by the hash of the 64-byte voice record.
+// Lookups and additions are safe from several threads; new entries are appended to the cache file
+// as they are found.
+class VoiceMapCache {
+public:
+    bool open(const string& filename);
+    bool find(uint64_t hash, VoiceMapping& mapping);
+    void add(uint64_t hash, const VoiceMapping& mapping);
+
+private:
+    mutex lock;
+    unordered_map<uint64_t, VoiceMapping> entries;
+    ofstream log;
+};
+
+VoiceMapCache voice_map_cache;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  SCI0 SOUND resources hold one MIDI-like event stream for all devices:                   //
+//                                                                                          //
+//  $00 :   8400h.......................SCI's resource type identifier header (files only)  //
+//  $00 :   Digital sample flag.........02h if a digital sample follows the song            //
+//  $01 :   Channel table...............16 x (initial voice count, device play mask)        //
+//  $21 :   Events......................Delta time, then a MIDI event (running status)      //
+//                                                                                          //
+//  Delta times count 60Hz ticks, F8h meaning 240 ticks with another delta byte to follow.  //
+//  FCh ends the song. Channel 16 carries SCI's cue and loop control events, not music.     //
+//  A channel is only played on the FB-01 if bit 02h is set in its play mask.               //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// One event of an SCI0 song, timed in ticks from the start of the song
+struct SongEvent {
+    uint32_t tick;
+    unsigned char status;
+    unsigned char data1;
+    unsigned char data2;
+};
+
+struct Sci0Song {
+    unsigned char channel_voices[16];
+    unsigned char channel_flags[16];
+    vector<SongEvent> events;
+};
+
+const int sci0_ticks_per_second = 60;
+const unsigned char sci0_fb01_play_mask = 0x02;
+
+// Program numbers played on each channel, one bit per program
+struct VoiceUsage {
+    uint64_t programs[16][2];
+};
+
+// Read-only view of a whole file, memory-mapped where the platform allows it and read into
+// memory elsewhere
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& filename);
+    void close();
+    const char* data() const { return view; }
+    size_t size() const { return length; }
+
+private:
+    const char* view = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    vector<char> contents;
+};
+
+// A bank pair under --watch and the output made from it. The buffers live as long as the pair
+// so a reconversion reuses the memory of the last one.
+struct WatchedPair {
+    string bank1;
+    string bank2;
+    string output;
+    vector<char> raw1, raw2, data1, data2;
+    vector<pair<string, vector<char>>> outputs;
+};
+
+// Reports the files that changed in a set of directories: inotify on Linux, comparing directory
+// listings every watch_poll_ms elsewhere. Directories are watched rather than the files, since
+// librarians often save by writing a new file and renaming it over the old one.
+class DirectoryWatcher {
+public:
+    DirectoryWatcher();
+    ~DirectoryWatcher();
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+    bool add(const string& directory);
+    // Blocks until something changes, lets the writes settle, then returns the changed paths
+    void wait(set<string>& changed);
+
+private:
+    vector<string> directories;
+#ifdef __linux__
+    int inotify_fd = -1;
+    map<int, string> watches;
+#else
+    map<string, pair<filesystem::file_time_type, uintmax_t>> stamps;
+    set<string> settling;
+    void scan(set<string>* changed);
+#endif
+};
+
+const int watch_settle_ms = 5;   // A save is done once its directory has been quiet this long
+const int watch_poll_ms = 50;    // Listing interval where inotify isn't available
+
+// Writes outputs so a crash never leaves a half written file behind: each one goes to a temporary
+// file that is renamed over the target. Renames wait until batch_size outputs are staged; then one
+// syncfs per filesystem (an fsync per file where there is no syncfs) makes all of their data durable,
+// the renames are done, and one fsync per directory makes the renames durable. With batch_size 0
+// (--sync off) outputs are renamed straight away and nothing is synced.
+class OutputCommitter {
+public:
+    Result write(const string& filename, const vector<char>& data);
+    // Takes an output its caller has already written to filename + ".tmp", for outputs streamed to disk
+    Result stage(const string& filename);
+    // Commits whatever is still staged; every mode calls this once its outputs are written
+    Result flush();
+
+    int batch_size = 256;
+    function<void(const vector<string>&)> committed;   // Told which targets are safely in place after each commit
+    // Told of each target a commit could not put in place. Without it, the problems of the whole
+    // group go back to whichever write or flush happened to commit it.
+    function<void(const string&, const Result&)> failed;
+
+private:
+    Result commit(vector<string>& targets);
+
+    mutex lock;
+    vector<string> staged;   // Targets whose temporary files are waiting for the next sync
+};
+
+OutputCommitter output_committer;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Voice name index (--name-index), searched through a memory map by --find-name.          //
+//  All numbers are little-endian 32-bit unless noted:                                      //
+//                                                                                          //
+//  $00 :   "FBNI", version.............Identifier and format version (1)                   //
+//  $08 :   Counts......................Voices, sources, trigrams                           //
+//  $14 :   Offsets.....................Source table, voice table, trigram table, postings  //
+//  Source table:   offset and length of each source name, then the names                   //
+//  Voice table:    12 bytes a voice: source number, slot (8 bits), 7-character name        //
+//  Trigram table:  12 bytes a trigram, sorted: 3 name characters, postings offset, count   //
+//  Postings:       voice numbers containing the trigram, ascending, each stored as the     //
+//                  LEB128 varint of its difference from the one before                    //
+//                                                                                          //
+//  Names are indexed upper-cased, so searches ignore case.                                 //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+const int name_index_version = 1;
+const int name_index_header_size = 36;
+const int name_index_voice_size = 12;
+const int name_index_trigram_size = 12;
+const size_t name_search_limit = 100;   // Matches listed by --find-name; all of them are counted
+
+class NameIndex {
+public:
+    bool open(const string& filename, string& error);
+    uint32_t voice_count() const { return voices; }
+    string name(uint32_t voice) const { return string(voice_table + voice * name_index_voice_size + 5, 7); }
+    uint32_t slot(uint32_t voice) const { return static_cast<unsigned char>(voice_table[voice * name_index_voice_size + 4]); }
+    string source(uint32_t voice) const;
+    // Decodes the postings of one trigram; false if no name contains it, or its list is damaged
+    bool postings(uint32_t trigram, vector<uint32_t>& ids) const;
+
+private:
+    MappedFile file;
+    uint32_t voices = 0, sources = 0, trigrams = 0;
+    const char* source_table = nullptr;
+    const char* voice_table = nullptr;
+    const char* trigram_table = nullptr;
+    const char* posting_data = nullptr;
+    size_t posting_size = 0;   // Bytes from posting_data to the end of the map
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Voice store (--store-add): a directory holding a collection of voices column by column. //
+//  Every decoded parameter has a file of one byte per voice, named as in the CSV output    //
+//  (algorithm.col, op1_multiple.col, ...), so a query only touches the columns it tests:   //
+//                                                                                          //
+//  sources.txt.................One source (patch file, or archive:bank file) per line      //
+//  source.col..................Line of sources.txt each voice came from (32-bit)           //
+//  slot.col....................Slot of the voice in its patch or bank pair (0-95)          //
+//  records.bin.................The 64-byte voice records themselves                        //
+//  <parameter>.col.............One byte per voice, signed parameters in two's complement   //
+//  hashes.idx..................12 bytes a voice, sorted: FNV-1a hash of the record (64     //
+//                              bits), voice number                                         //
+//  voices.bloom................Bloom filter of the record hashes (see VoiceFilter)         //
+//  cluster.col.................Family of each voice, from --cluster (one byte)             //
+//  clusters.txt................Timbre features at the centre of each family                //
+//                                                                                          //
+//  Voices are only ever appended. A store cut short by a crash is read up to the shortest  //
+//  column. The hash index and the filter are rebuilt from records.bin whenever they don't  //
+//  cover exactly the voices in the store.                                                  //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// One step of a compiled query, run over a block of voices at a time. Tests leave a byte per
+// voice (1 = match) on a stack of masks; AND, OR and NOT combine the masks on top.
+enum QueryOperation { QUERY_TEST, QUERY_AND, QUERY_OR, QUERY_NOT };
+
+struct QueryStep {
+    QueryOperation operation;
+    int column;                  // Index into the query's column list (QUERY_TEST)
+    bool use_table;              // Matching codes don't form one range: look each one up
+    unsigned char low, high;     // Otherwise a voice matches when low <= code <= high
+    array<unsigned char, 256> table;
+};
+
+const int query_block_size = 4096;   // Voices per block; a block's masks stay in the L1 cache
+
+// Blocked Bloom filter of the voices in a store, kept in voices.bloom and mapped read-write, so
+// --store-add can tell that most new voices are new without searching hashes.idx. Each hash sets
+// voice_filter_probes bits inside one 64-byte block, so a lookup touches a single cache line.
+// The file is a 16-byte header ("FBBF", version, block count, voices covered), then the blocks.
+// Without mmap the filter is read into memory and written back by close().
+class VoiceFilter {
+public:
+    VoiceFilter() {}
+    ~VoiceFilter() { close(); }
+    VoiceFilter(const VoiceFilter&) = delete;
+    VoiceFilter& operator=(const VoiceFilter&) = delete;
+
+    // Opens an existing filter; fails if it is missing, damaged, or misses some of the store's voices
+    bool open(const string& filename, size_t store_voices);
+    // Replaces the filter with an empty one sized for capacity voices
+    bool create(const string& filename, size_t capacity);
+    // Records how many voices the filter covers and writes it out
+    bool close();
+
+    bool maybe_contains(uint64_t hash) const;
+    void add(uint64_t hash);
+    size_t capacity() const { return blocks * voice_filter_voices_per_block; }
+
+    size_t voices = 0;   // Voices of the store the filter covers
+
+private:
+    static const size_t voice_filter_voices_per_block = 32;   // 16 bits a voice: about 1 false hit in 1000
+    static const int voice_filter_probes = 7;
+
+    unsigned char* view = nullptr;
+    size_t length = 0;
+    size_t blocks = 0;
+    bool mapped = false;
+    string path;
+    vector<char> contents;
+};
+
+const int voice_filter_version = 1;
+const int voice_filter_header_size = 16;
+const int store_index_entry_size = 12;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Voice archive (--store-pack): the voices of a store and where they came from, deflated  //
+//  in blocks so any one voice is read back by inflating a single block. Numbers are        //
+//  little-endian 32-bit unless noted:                                                      //
+//                                                                                          //
+//  $00 :   "FBVA", version.............Identifier and format version (1)                   //
+//  $08 :   Counts......................Voices, voices per block, blocks                    //
+//  $14 :   Sizes.......................Dictionary, source names                            //
+//  $1C :   Dictionary..................Preset deflate dictionary (may be empty)            //
+//          Source names................One per line, as in sources.txt                     //
+//          Block index.................16 bytes a block: offset in the file (64 bits),     //
+//                                      deflated size, CRC-32 of the inflated block         //
+//          Blocks......................Raw deflate data. A block inflates to the records   //
+//                                      of its voices, their source numbers, their slots    //
+//                                                                                          //
+//  Every block is deflated as if the dictionary came just before it. The dictionary holds  //
+//  the 8-byte runs of voice data that are most common in the store, so the settings most   //
+//  voices share are coded as short matches even at the start of a block.                   //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reads a voice archive through a memory map. Blocks are inflated on request; the archive can
+// be shared between threads once it is open.
+class VoiceArchive {
+public:
+    bool open(const string& filename, string& error);
+
+    size_t voice_count() const { return voices; }
+    size_t block_count() const { return blocks; }
+    size_t voices_per_block() const { return block_voices; }
+    size_t compressed_size() const { return file.size(); }
+    const string& source(uint32_t number) const;
+
+    // Inflates a block and checks its CRC: records, then source numbers, then slots
+    bool read_block(size_t block, vector<char>& contents) const;
+
+private:
+    MappedFile file;
+    size_t voices = 0;
+    size_t block_voices = 0;
+    size_t blocks = 0;
+    vector<char> dictionary;
+    vector<string> sources;
+    const unsigned char* index = nullptr;
+};
+
+const int voice_archive_version = 1;
+const int voice_archive_header_size = 28;
+const int voice_archive_index_entry_size = 16;
+const int voice_archive_block_voices = 256;    // 17KB a block inflated
+const int voice_archive_dictionary_size = 4096;
+
+// Voice families (--cluster) group the voices of a store by their timbre features (see
+// TimbreFeature), with k-means, or bottom-up with Ward's method for small stores. A cluster
+// number fits the one byte of cluster.col, so families can be picked out with --query.
+const int cluster_limit = 256;
+const int agglomerative_limit = 20000;   // Ward's method takes time quadratic in the voices
+const int cluster_iterations = 50;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Arrow export (--store-arrow): the columns of a store as an Arrow IPC file, which        //
+//  dataframe libraries can memory map without parsing anything. The file is               //
+//                                                                                          //
+//  "ARROW1\0\0"..................Magic, padded to 8 bytes                                  //
+//  Schema message..............One field per column: the parameters as int8/uint8, then   //
+//                              the voice name and source (utf8), slot, cluster             //
+//  Record batch messages.......Up to --rows voices each                                    //
+//  Footer......................The schema again and where each record batch starts       //
+//  Footer size, "ARROW1".......32-bit footer size, magic                                   //
+//                                                                                          //
+//  A message is 0xFFFFFFFF, the size of its metadata, the metadata (a flatbuffer, padded   //
+//  to 8 bytes), then its body. A record batch body is each column's buffers one after      //
+//  another, every buffer padded to 8 bytes. Parameter columns go out straight from the     //
+//  mapped .col files. No column has nulls, so every validity buffer is empty.              //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+// Builds a flatbuffer back to front, as the format intends: children are finished before the
+// tables that point at them, and offsets are kept from the end of the buffer until finish()
+// knows where everything landed. Only what the Arrow metadata needs is here.
+class FlatBufferBuilder {
+public:
+    // Objects are named by their offset from the end of the buffer
+    uint32_t add_string(const string& text);
+    uint32_t add_offset_vector(const vector<uint32_t>& objects);
+    // A vector of structs already laid out in little-endian, 8-byte aligned
+    uint32_t add_struct_vector(const vector<char>& elements, size_t count);
+
+    void start_table();
+    void add_scalar(int field, uint64_t value, int size);
+    void add_offset(int field, uint32_t object);
+    uint32_t end_table();
+
+    // Adds the root offset and returns the finished buffer, padded to 8 bytes
+    vector<char> finish(uint32_t root);
+
+private:
+    void prepend(const void* data, size_t size);
+    void align(size_t size, size_t alignment);
+
+    deque<char> bytes;
+    size_t table_start = 0;
+    vector<pair<int, uint32_t>> table_fields;   // Field number and offset from the end of each field
+};
+
+// Arrow type codes and message kinds used by the export (Schema.fbs, Message.fbs)
+enum ArrowType { ARROW_TYPE_INT = 2, ARROW_TYPE_UTF8 = 5 };
+enum ArrowMessage { ARROW_MESSAGE_SCHEMA = 1, ARROW_MESSAGE_RECORD_BATCH = 3 };
+
+// One column of the export: a byte column, or a string column filled in per batch
+struct ArrowColumn {
+    string name;
+    bool is_string;
+    bool is_signed;
+    const char* data;   // One byte a voice, for byte columns
+};
+
+const int arrow_metadata_version = 4;   // V5
+const int arrow_batch_rows = 1 << 20;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//  Software FB-01 (YM2164 OPP) FM engine, used to audition voices without the hardware.    //
+//                                                                                          //
+//  Like the FB-01 it has eight channels of four operators. Everything is kept as arrays    //
+//  indexed [operator][channel], and each sample is computed one operator at a time across  //
+//  all eight channels, so the inner loops are straight-line integer code the compiler can  //
+//  vectorize. Phases are 32-bit integer accumulators indexing a sine table; envelopes      //
+//  count attenuation in 0.09375dB steps like the chip. The LFO is not emulated.            //
+//                                                                                          //
+//  In every algorithm an operator is only modulated by higher numbered operators, so       //
+//  evaluating OP4, OP3, OP2 then OP1 always has the modulator outputs ready.               //
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+class Fb01Synth {
+public:
+    static const int channels = 8;
+
+    explicit Fb01Synth(int sample_rate);
+    void set_voice(int channel, const char* record);
+    void note_on(int channel, int note, int velocity);
+    void note_off(int channel);
+    bool is_active(int channel) const;
+    void render(int16_t* out, int samples);
+
+private:
+    enum EnvelopeStage { STAGE_ATTACK, STAGE_DECAY1, STAGE_DECAY2, STAGE_RELEASE, STAGE_OFF };
+
+    int32_t decay_step(int rate) const;
+    int32_t attack_coefficient(int rate) const;
+
+    int sample_rate;
+    char voices[channels][64];
+
+    // Oscillators
+    uint32_t phase[4][channels];
+    uint32_t increment[4][channels];
+    int32_t output[4][channels];
+    int32_t feedback_history[2][channels];
+    int32_t feedback_shift[channels];          // 0 when the voice has no feedback
+    int32_t modulated_by[4][4][channels];      // [target][source] is 1 if source modulates target
+    int32_t is_carrier[4][channels];
+
+    // Envelopes: attenuation in 16.16 fixed point, 0 is full volume and 1023 silence
+    int32_t envelope[4][channels];
+    int32_t stage[4][channels];
+    int32_t level_offset[4][channels];         // Total level plus velocity, in envelope units
+    int32_t sustain_level[4][channels];
+    int32_t attack_rate[4][channels];
+    int32_t decay1_step[4][channels];
+    int32_t decay2_step[4][channels];
+    int32_t release_step[4][channels];
+};
+
+// Output formats that can be produced from one decode of a bank pair (see output_formats[])
+enum OutputFormat {
+    FORMAT_PATCH = 1,   // SCI patch resource (PATCH.002)
+    FORMAT_RAW = 2,     // The 96 raw 64-byte voice records back to back
+    FORMAT_JSON = 4,    // Decoded voice parameters as JSON
+    FORMAT_CSV = 8,     // Decoded voice parameters as CSV, one voice per row
+    FORMAT_SYSEX = 16,  // FB-01 single voice sysex messages, one per voice
+    FORMAT_ADLIB = 32,  // SCI AdLib patch resource (PATCH.003), translated to two operators
+    FORMAT_MAP = 64,    // MT-32 timbre and GM program chosen for each voice, as text
+};
+
+struct OutputFormatInfo {
+    const char* name;        // As given to --formats
+    OutputFormat format;
+    const char* extension;   // Replaces the extension of the patch filename (the patch itself keeps its name)
+    void (*render)(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+};
+
 void read_files(ifstream& file1, ifstream& file2, vector<char>& data1, vector<char>& data2);
-void reorganize_data(vector<char>& data1, vector<char>& data2);
-void write_to_file(std::vector<char> data1, std::vector<char> data2, const char* output_filename);
+int convert_banks(vector<char>& data1, vector<char>& data2, const char* output_filename, unsigned int formats);
+Result reorganize_data(vector<char>& data1, vector<char>& data2);
+Result write_to_file(std::vector<char> data1, std::vector<char> data2, const char* output_filename);
+void build_patch_image(const std::vector<char>& data1, const std::vector<char>& data2, std::vector<char>& image);
 bool check_file_exists(const char* filename);
-void check_output_file(string output_filename);
+bool check_output_file(string output_filename);
+int stream_descriptor(const string& name, int standard);
+bool is_stream_name(const string& name);
+bool read_stream(const string& name, vector<char>& raw);
+bool read_bank_streams(const string& name1, const string& name2, vector<char>& data1, vector<char>& data2);
+Result write_stream(const string& name, const vector<char>& image);
+int run_watch(int argc, char* argv[]);
+string watch_key(const string& path);
+void find_watched_pairs(const string& directory, const string& output_directory, vector<unique_ptr<WatchedPair>>& pairs);
+Result convert_watched_pair(WatchedPair& pair, unsigned int formats);
+bool sync_staged_files(const vector<string>& targets, const set<string>& directories);
+bool sync_directory(const string& directory);
+int run_batch(int argc, char* argv[]);
+bool load_job_list(const char* list_filename, vector<unique_ptr<ConversionJob>>& jobs);
+int run_coordinator(int argc, char* argv[]);
+int open_socket(const string& address, bool listening, string& error);
+bool send_line(int fd, const string& line);
+bool take_line(string& buffer, string& line);
+int run_name_index(int argc, char* argv[]);
+int run_find_name(int argc, char* argv[]);
+void name_trigrams(const string& name, vector<uint32_t>& trigrams);
+int substring_edit_distance(const string& pattern, const string& text);
+int run_store_add(int argc, char* argv[]);
+int run_query(int argc, char* argv[]);
+vector<string> store_column_names();
+size_t store_voice_count(const string& directory);
+bool compile_query(const string& text, vector<QueryStep>& program, vector<string>& columns, string& error);
+void run_query_block(const vector<QueryStep>& program, const vector<const unsigned char*>& columns, size_t begin, unsigned char* matches);
+vector<char> build_store_index(const char* records, size_t count);
+int run_store_pack(int argc, char* argv[]);
+int run_cluster(int argc, char* argv[]);
+void extract_store_features(const char* records, size_t count, vector<float>& features);
+int nearest_centroid(const float* features, const vector<float>& centroids);
+int kmeans_clusters(const vector<float>& features, int k, int iterations, vector<float>& centroids, vector<unsigned char>& assignments);
+void agglomerative_clusters(const vector<float>& features, int k, vector<float>& centroids, vector<unsigned char>& assignments);
+bool load_centroids(const string& filename, vector<float>& centroids);
+int run_store_arrow(int argc, char* argv[]);
+uint32_t add_arrow_schema(FlatBufferBuilder& builder, const vector<ArrowColumn>& columns);
+vector<char> build_arrow_message(int type, uint64_t body_length, const function<uint32_t(FlatBufferBuilder&)>& header);
+int run_store_fetch(int argc, char* argv[]);
+int run_store_scan(int argc, char* argv[]);
+vector<char> train_dictionary(const char* records, size_t count, size_t size);
+bool find_in_store_index(const char* index, size_t entries, const char* records, uint64_t hash, const char* record);
+bool load_file(const string& filename, vector<char>& raw);
+Result validate_bank_data(const vector<char>& raw, const string& filename, int bank);
+void extract_packets(const vector<char>& raw, vector<char>& data);
+int run_archive(int argc, char* argv[]);
+bool read_bank_pairs_from_archive(const string& filename, BankPairer& pairer, string& error);
+bool read_archive(const string& filename, size_t entry_size, const ArchiveEntryHandler& handler, string& error);
+bool read_tar_stream(istream& in, size_t entry_size, const ArchiveEntryHandler& handler, string& error);
+bool read_zip_stream(istream& in, size_t entry_size, const ArchiveEntryHandler& handler, string& error);
+bool inflate_stream(istream& in, vector<char>& out, const vector<char>& dictionary = vector<char>());
+void deflate_data(const char* data, size_t size, const vector<char>& dictionary, vector<char>& out);
+uint32_t compute_crc32(const char* data, size_t size);
+int get_parameter(const char* record, const VoiceParameter& parameter);
+void set_parameter(char* record, const VoiceParameter& parameter, int value);
+string get_voice_name(const char* record);
+bool parse_formats(const string& list, unsigned int& formats);
+bool is_output_option(const string& option);
+bool parse_output_option(const string& option, const string& value, unsigned int& formats);
+string strip_extension(const string& filename);
+string format_output_filename(const OutputFormatInfo& info, const string& output_filename);
+bool is_output_complete(unsigned int formats, const string& output_filename, const CheckpointLog& checkpoint);
+void render_outputs(unsigned int formats, const vector<char>& data1, const vector<char>& data2, const string& output_filename,
+                    vector<pair<string, vector<char>>>& outputs);
+Result write_outputs(unsigned int formats, const vector<char>& data1, const vector<char>& data2, const string& output_filename);
+void render_raw(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+void render_json(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+void render_csv(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+void render_voice_sysex(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+void render_adlib_patch(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+void render_voice_map(const vector<char>& data1, const vector<char>& data2, vector<char>& out);
+void parallel_for(int count, const function<void(int)>& body);
+void normalize_voices(vector<char>& data1, vector<char>& data2, bool parallel);
+double measure_loudness(const char* record);
+uint64_t hash_voice(const char* record);
+uint64_t fnv1a_hash(const char* data, size_t size);
+void extract_timbre_features(const char* record, float* features);
+VoiceMapping classify_voice(const char* record);
+int run_render(int argc, char* argv[]);
+int run_synth_benchmark(int argc, char* argv[]);
+bool load_patch_file(const string& filename, vector<char>& data1, vector<char>& data2, string& error);
+void build_wav_image(const vector<int16_t>& samples, int sample_rate, vector<char>& image);
+void render_note(const char* record, int note, double seconds, int sample_rate, vector<int16_t>& samples);
+int run_previews(int argc, char* argv[]);
+bool read_voices_from_source(const string& source, const VoiceHandler& handler, string& error);
+string preview_cache_path(const string& cache_directory, uint64_t hash);
+void build_adpcm_wav_image(const vector<int16_t>& samples, int sample_rate, vector<char>& image);
+int run_render_songs(int argc, char* argv[]);
+bool parse_sci0_sound(const char* data, size_t size, Sci0Song& song, string& error);
+void render_song(const Sci0Song& song, const vector<char>& data1, const vector<char>& data2, int sample_rate, vector<int16_t>& samples);
+int run_used_voices(int argc, char* argv[]);
+void scan_used_voices(const Sci0Song& song, VoiceUsage& usage);
+int run_import(int argc, char* argv[], const VoiceImporter& importer, const char* dump_types);
+int output_level_attenuation(int level);
+bool read_dx7_voices(const vector<char>& raw, const string& filename, vector<char>& records, string& error);
+void unpack_dx7_voice(const unsigned char* packed, Dx7Voice& voice);
+void reduce_dx7_voice(const Dx7Voice& voice, char* record);
+void build_dx7_record(const Dx7Voice& voice, const Dx7Reduction& reduction, bool held, char* record);
+void render_dx7_reference(const Dx7Voice& voice, int note, int sample_rate, int count, vector<double>& samples);
+void compute_spectrum(const vector<double>& samples, vector<double>& magnitudes);
+bool read_4op_voices(const vector<char>& raw, const string& filename, vector<char>& records, string& error);
+void unpack_vmem_voices(const unsigned char* packed, int count, vector<unsigned char>& vced);
+void convert_4op_voices(const vector<unsigned char>& vced, int count, char* records);
+
+const OutputFormatInfo output_formats[] = {
+    { "patch", FORMAT_PATCH, "",      build_patch_image },
+    { "raw",   FORMAT_RAW,   ".bin",  render_raw },
+    { "json",  FORMAT_JSON,  ".json", render_json },
+    { "csv",   FORMAT_CSV,   ".csv",  render_csv },
+    { "syx",   FORMAT_SYSEX, ".syx",  render_voice_sysex },
+    { "adlib", FORMAT_ADLIB, ".003",  render_adlib_patch },
+    { "map",   FORMAT_MAP,   ".map",  render_voice_map },
+};
 
 int main(int argc, char* argv[]) {
-    // Check if the user provided exactly three arguments
+    // When the patch goes to stdout, everything meant for the user goes to stderr instead
+    if (argc >= 4 && strncmp(argv[1], "--", 2) != 0 && stream_descriptor(argv[3], 1) == 1) {
+        cout.rdbuf(cerr.rdbuf());
+    }
 
     std::cout << std::fixed;
     std::cout << std::setprecision(2);
     cout << "\nFB2SCI  v" << nVersion << "    by Brandon Blume    February 25, 2023" << endl;
 
-    if (argc != 4) {
+    // Batch mode converts a whole list of bank pairs through the reader/converter/writer pipeline
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argc, argv);
+    }
+
+    // Hand out a job list to --batch workers in other processes (or on other machines) and total up their results
+    if (argc >= 2 && strcmp(argv[1], "--coordinate") == 0) {
+        return run_coordinator(argc, argv);
+    }
+
+    // Archive mode converts every bank pair found in tar/zip archives into an output archive
+    if (argc >= 2 && strcmp(argv[1], "--archive") == 0) {
+        return run_archive(argc, argv);
+    }
+
+    // Watch mode reconverts bank pairs whenever a librarian saves them
+    if (argc >= 2 && strcmp(argv[1], "--watch") == 0) {
+        return run_watch(argc, argv);
+    }
+
+    // Index the voice names of a collection of patches and bank archives, and search the index
+    if (argc >= 2 && strcmp(argv[1], "--name-index") == 0) {
+        return run_name_index(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--find-name") == 0) {
+        return run_find_name(argc, argv);
+    }
+
+    // Collect voices into a column store, and query it by parameter values
+    if (argc >= 2 && strcmp(argv[1], "--store-add") == 0) {
+        return run_store_add(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--query") == 0) {
+        return run_query(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--cluster") == 0) {
+        return run_cluster(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--store-arrow") == 0) {
+        return run_store_arrow(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--store-pack") == 0) {
+        return run_store_pack(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--store-fetch") == 0) {
+        return run_store_fetch(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--store-scan") == 0) {
+        return run_store_scan(argc, argv);
+    }
+
+    // Render a note of one voice of a patch through the software FB-01, or benchmark the engine
+    if (argc >= 2 && strcmp(argv[1], "--render") == 0) {
+        return run_render(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--synth-bench") == 0) {
+        return run_synth_benchmark(argc, argv);
+    }
+
+    // Fill a preview cache with a short rendered note for every voice not already in it
+    if (argc >= 2 && strcmp(argv[1], "--previews") == 0) {
+        return run_previews(argc, argv);
+    }
+
+    // Render SCI0 songs through a patch, to hear a game's music with it
+    if (argc >= 2 && strcmp(argv[1], "--render-songs") == 0) {
+        return run_render_songs(argc, argv);
+    }
+
+    // Report which patch slots a game's songs use, and optionally pack the used ones together
+    if (argc >= 2 && strcmp(argv[1], "--used-voices") == 0) {
+        return run_used_voices(argc, argv);
+    }
+
+    // Build a patch from TX81Z / DX21 / DX27 / DX100 voice dumps
+    if (argc >= 2 && strcmp(argv[1], "--import-4op") == 0) {
+        return run_import(argc, argv, read_4op_voices, "TX81Z, DX21, DX27 or DX100 sysex dumps, 32-voice VMEM banks or single VCED voices");
+    }
+
+    // Build a patch from DX7 banks, cut down to four operators
+    if (argc >= 2 && strcmp(argv[1], "--import-dx7") == 0) {
+        return run_import(argc, argv, read_dx7_voices, "DX7 32-voice sysex bank dumps");
+    }
+
+    // Anything after the three filenames is an output option
+    unsigned int formats = FORMAT_PATCH;
+    bool options_ok = argc >= 4 && argc % 2 == 0;
+    for (int i = 4; options_ok && i < argc; i += 2) {
+        options_ok = is_output_option(argv[i]) && parse_output_option(argv[i], argv[i + 1], formats);
+    }
+
+    if (!options_ok) {
         cout << "   usage:  " << argv[0] << "   bankfile1   bankfile2   patfile\n";
+        cout << "           " << argv[0] << "   --batch joblist [--readers n] [--converters n] [--writers n] [--queue n]\n";
+        cout << "           " << argv[0] << "   --coordinate joblist address [--range n]\n";
+        cout << "           " << argv[0] << "   --archive outarchive inarchive [inarchive ...]\n";
+        cout << "           " << argv[0] << "   --watch bankfile1 bankfile2 patfile | --watch bankdir outdir\n";
+        cout << "           " << argv[0] << "   --name-index indexfile source [source ...]\n";
+        cout << "           " << argv[0] << "   --find-name indexfile text [--fuzzy n]\n";
+        cout << "           " << argv[0] << "   --store-add storedir source [source ...]\n";
+        cout << "           " << argv[0] << "   --query storedir expression\n";
+        cout << "           " << argv[0] << "   --cluster storedir k [--agglomerative] [--iterations n]\n";
+        cout << "           " << argv[0] << "   --store-arrow storedir arrowfile [--rows n] [--sync n|off]\n";
+        cout << "           " << argv[0] << "   --store-pack storedir archive [--block n] [--dictionary bytes]\n";
+        cout << "           " << argv[0] << "   --store-fetch archive id [id ...]\n";
+        cout << "           " << argv[0] << "   --store-scan archive\n";
+        cout << "           " << argv[0] << "   --render patfile voice note seconds wavfile\n";
+        cout << "           " << argv[0] << "   --synth-bench patfile [seconds]\n";
+        cout << "           " << argv[0] << "   --previews cachedir source [source ...]\n";
+        cout << "           " << argv[0] << "   --render-songs patfile outdir soundfile [soundfile ...]\n";
+        cout << "           " << argv[0] << "   --used-voices patfile [--pack outpatfile] soundfile [soundfile ...]\n";
+        cout << "           " << argv[0] << "   --import-4op patfile dumpfile [dumpfile ...]\n";
+        cout << "           " << argv[0] << "   --import-dx7 patfile dumpfile [dumpfile ...]\n";
+        cout << "           " << argv[0] << "   bankfile1   bankfile2   patfile   [--formats patch,raw,json,csv,syx,adlib,map]\n";
+        cout << "                   [--opl-select carrier|loudest|M,C] [--map-cache file] [--normalize dBFS] [--sync n|off]\n";
+        cout << "           (\"-\" or fd:N in place of a filename reads or writes a stream; \"- -\" reads both banks from stdin)\n";
         return 1;
     }
     cout << endl;
@@ -44,23 +1642,42 @@ int main(int argc, char* argv[]) {
     char* input_filename2 = argv[2];
     char* output_filename = argv[3];
 
+    if (is_stream_name(output_filename) && formats != FORMAT_PATCH) {
+        cout << "Error: only the patch can be written to a stream (--formats patch)" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Piped banks can't be reopened or checked ahead of time, so read them whole and validate what arrived
+    vector<char> data1, data2;
+    if (is_stream_name(input_filename1) || is_stream_name(input_filename2)) {
+        if (!read_bank_streams(input_filename1, input_filename2, data1, data2)) {
+            return EXIT_FAILURE;
+        }
+        // With stdin carrying the banks there's nobody left to answer the prompt, so overwrite like batch mode does
+        bool stdin_used = stream_descriptor(input_filename1, 0) == 0 || stream_descriptor(input_filename2, 0) == 0;
+        if ((formats & FORMAT_PATCH) && !stdin_used && !is_stream_name(output_filename) && !check_output_file(output_filename)) {
+            return EXIT_FAILURE;
+        }
+        return convert_banks(data1, data2, output_filename, formats);
+    }
+
     // Open the first input bank file (Bank A)
     ifstream input_file1(input_filename1, ios::binary);
 
     // Check if bankfile1 exists
     if (!check_file_exists(input_filename1)) {
         cout << "Error: file " << input_filename1 << " not found" << endl;
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
 
-    // Read the first 7 bytes from the file
-    char header[7];
-    input_file1.read(header, 7);
+    // Read the header bytes from the file
+    char header[Fb01BankALayout::header_size];
+    input_file1.read(header, sizeof(header));
 
     // Check if the header for bankfile1 matches the expected value for the FB-01's send Bank A sysex code
-    if (memcmp(header, "\xF0\x43\x75\x00\x00\x00\x00", 7) != 0) {
+    if (!header_matches<Fb01BankALayout>(header, make_index_sequence<Fb01BankALayout::header_size>())) {
         cout << "Error: " << input_filename1 << " is not a valid FB-01 sysex bank file (missing expected sysex header)." << endl;
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
 
     // Get the length of the file
@@ -68,10 +1685,10 @@ int main(int argc, char* argv[]) {
     std::streamoff length = input_file1.tellg();
     input_file1.seekg(0, ios::beg);
 
-    // Check if the length is 6363 bytes (must be no larger or smaller
-    if (length != 6363) {
-        cout << input_filename1 << " is not the expected size (6363 bytes). Not a valid FB-01 sysex bank file." << endl << "Actual size: " << length << endl;
-        exit(EXIT_FAILURE);
+    // Check if the length is exactly the bank dump size (must be no larger or smaller)
+    if (length != Fb01BankALayout::file_size) {
+        cout << input_filename1 << " is not the expected size (" << Fb01BankALayout::file_size << " bytes). Not a valid FB-01 sysex bank file." << endl << "Actual size: " << length << endl;
+        return EXIT_FAILURE;
     }
 
     // Open the second input bank file (Bank B)
@@ -80,16 +1697,16 @@ int main(int argc, char* argv[]) {
     // Check if bankfile2 exists
     if (!check_file_exists(input_filename2)) {
         cout << "Error: file " << input_filename2 << " not found" << endl;
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
 
-    // Read the first 7 bytes from the file
-    input_file2.read(header, 7);
+    // Read the header bytes from the file
+    input_file2.read(header, sizeof(header));
 
     // Check if the header for bankfile2 matches the expected value for the FB-01's send Bank B sysex code
-    if (memcmp(header, "\xF0\x43\x75\x00\x00\x00\x01", 7) != 0) {
+    if (!header_matches<Fb01BankBLayout>(header, make_index_sequence<Fb01BankBLayout::header_size>())) {
         cout << "Error: " << input_filename2 << " is not a valid FB-01 sysex bank file (missing expected sysex header)." << endl;
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
 
     // Get the length of the file
@@ -97,71 +1714,81 @@ int main(int argc, char* argv[]) {
     length = input_file2.tellg();
     input_file2.seekg(0, ios::beg);
 
-    // Check if the length is 6363 bytes (no larger or smaller)
-    if (length != 6363) {
-        cout << input_filename2 << " is not the expected size (6363 bytes). Not a valid FB-01 sysex bank file." << endl << "Actual size: " << length << endl;
-        exit(EXIT_FAILURE);
+    // Check if the length is exactly the bank dump size (no larger or smaller)
+    if (length != Fb01BankBLayout::file_size) {
+        cout << input_filename2 << " is not the expected size (" << Fb01BankBLayout::file_size << " bytes). Not a valid FB-01 sysex bank file." << endl << "Actual size: " << length << endl;
+        return EXIT_FAILURE;
     }
 
     // Check if output file already exists. If it does, ask user whether to overwrite or abort.
-    check_output_file(output_filename);
+    if ((formats & FORMAT_PATCH) && !check_output_file(output_filename)) {
+        return EXIT_FAILURE;
+    }
 
     // Read the files into memory
-    vector<char> data1, data2;
     read_files(input_file1, input_file2, data1, data2);
 
     // Close the input files
     input_file1.close();
     input_file2.close();
 
+    return convert_banks(data1, data2, output_filename, formats);
+}
 
+int convert_banks(vector<char>& data1, vector<char>& data2, const char* output_filename, unsigned int formats) {
     // Byte-swap then nibble-merge the data, overwriting and truncating the vectors by half
-    reorganize_data(data1, data2);
+    Result result = reorganize_data(data1, data2);
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return EXIT_FAILURE;
+    }
+    if (normalize_levels) {
+        normalize_voices(data1, data2, true);
+    }
     // Create the patch file with the new "denibbled" data
-    write_to_file(data1, data2, output_filename);
-
-    cout << "SCI FB-01 Patch created successfully!" << endl;
+    if (formats & FORMAT_PATCH) {
+        result.merge(write_to_file(data1, data2, output_filename));
+        if (result.ok()) {
+            cout << "SCI FB-01 Patch created successfully!" << endl;
+        }
+    }
+    if (formats & ~FORMAT_PATCH) {
+        result.merge(write_outputs(formats & ~FORMAT_PATCH, data1, data2, output_filename));
+        if (result.ok()) {
+            cout << "Voice data written in the requested formats." << endl;
+        }
+    }
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return EXIT_FAILURE;
+    }
 
     return 0;
 }
 
 void read_files(ifstream& file1, ifstream& file2, vector<char>& data1, vector<char>& data2) {
-    // Set the initial read position for each bank file to address 0x4C (this is where the first instrument packet's patch data is located)
-    streampos pos1 = 0x4c;
-    streampos pos2 = 0x4C;
-
-    // Read the files one at a time, skipping 3 bytes between each 128-byte instrument patch block
-    //   (the last byte in a packet is that packet's checksum and the first two bytes of the next packet are the next packet's
-    //    size identifier. we already skipped the two packet size indentifier bytes in the first packet by jumping straight to address 0x4C)
-    for (int i = 0; i < 48; i++) {
-        // Read 128 bytes from bankfile1 and bankfile2
-        file1.seekg(pos1);
-        file2.seekg(pos2);
-        char buffer1[128];
-        char buffer2[128];
-        file1.read(buffer1, 128);
-        file2.read(buffer2, 128);
-        data1.insert(data1.end(), buffer1, buffer1 + 128);
-        data2.insert(data2.end(), buffer2, buffer2 + 128);
-
-        // Skip 3 bytes (the current packet's checksum and the following packet's size identifier bytes) to get to the next instrument's patch data
-        pos1 += 131;
-        pos2 += 131;
-    }
-}
-
-void reorganize_data(vector<char>& data1, vector<char>& data2) {
-    // Check if the data vectors have the same size. (really, if the input files passed the format checks, this should never error)
-    if (data1.size() != data2.size()) {
-        cout << "Error: data vectors have different sizes" << endl;
-        cout << "data1 size = " << data1.size() << endl << "data2 size = " << data2.size() << endl;
-        return;
-    }
-    // Double check to ensure that both sets of instrument packets equal 6144 bytes in length (128 bytes per 48 instruments per bank file).
-    // Again, this should never error. Probably superfluous.
-    else if (data1.size() != 6144) {
-        cout << "Error: data vectors not the expected size (6144)" << endl;
-        cout << "data1 size = " << data1.size() << endl << "data2 size = " << data2.size() << endl;
+    // Read both bank files whole (main() has already checked their size), then take out the 128-byte instrument patch blocks,
+    //   skipping the 3 bytes between each (the last byte in a packet is that packet's checksum and the first two bytes of the
+    //   next packet are the next packet's size identifier)
+    vector<char> raw1(Fb01BankALayout::file_size);
+    vector<char> raw2(Fb01BankBLayout::file_size);
+    file1.seekg(0, ios::beg);
+    file2.seekg(0, ios::beg);
+    file1.read(raw1.data(), raw1.size());
+    file2.read(raw2.data(), raw2.size());
+    extract_packets(raw1, data1);
+    extract_packets(raw2, data2);
+}
+
+Result reorganize_data(vector<char>& data1, vector<char>& data2) {
+    // Check that both sets of instrument packets are the full packet data of a bank (128 bytes per 48 instruments per bank file).
+    // Really, if the input files passed the format checks, this should never fail.
+    Result result;
+    if (data1.size() != static_cast<size_t>(Fb01BankALayout::packet_data_size) || data2.size() != static_cast<size_t>(Fb01BankBLayout::packet_data_size)) {
+        result.fail(STEP_CONVERT, "instrument data not the expected size (" + to_string(Fb01BankALayout::packet_data_size) + "), data1 size = " +
+                    to_string(data1.size()) + ", data2 size = " + to_string(data2.size()));
+        return result;
     }
 
     //////////////////////////////////////////////////////////////////////////////////////////////
@@ -171,36 +1798,27 @@ void reorganize_data(vector<char>& data1, vector<char>& data2) {
     //  are "denibblized", we will halve the data vectors sizes                                 //
     //////////////////////////////////////////////////////////////////////////////////////////////
 
-    // Iterate over each byte pair of the data vectors
-    for (int i = 0; i < static_cast<int>(data1.size()); i += 2) {
-        // Extract the high and low bytes for the first byte pairs
-        char high_byte1 = data1[i];
-        char low_byte1 = data1[i + 1];
-        char high_byte2 = data2[i];
-        char low_byte2 = data2[i + 1];
+    // Merge each byte pair in place; the layout unrolls this into straight-line code
+    denibble_packets<Fb01BankALayout>(data1.data(), data1.data());
+    denibble_packets<Fb01BankBLayout>(data2.data(), data2.data());
 
-        // Merge the byte pairs by shifting the low byte's low nibble to its high nibble and OR-ing the high byte's low nibble together 
-        // with the low byte's new high nibble
-        unsigned char merged_byte1 = ((low_byte1 & 0x0F) << 4) | (high_byte1 & 0x0F);
-        unsigned char merged_byte2 = ((low_byte2 & 0x0F) << 4) | (high_byte2 & 0x0F);
+    // Halve the size of both data vectors now that the "denibblized" data is half the original size
+    data1.resize(Fb01BankALayout::voice_data_size);
+    data2.resize(Fb01BankBLayout::voice_data_size);
+    return result;
+}
 
-        // Store the reorganized data back to the data vector at the beginning where it left off
-        data1[i / 2] = merged_byte1;
-        data1[(i / 2) + 1] = 0x00;
-        data2[i / 2] = merged_byte2;
-        data2[(i / 2) + 1] = 0x00;
+Result write_to_file(std::vector<char> data1, std::vector<char> data2, const char* output_filename) {
+    std::vector<char> image;
+    build_patch_image(data1, data2, image);
+    if (is_stream_name(output_filename)) {
+        return write_stream(output_filename, image);
     }
 
-    // Halve the size of both data vectors now that the "denibblized" data is half the original size
-    data1.resize(data1.size() / 2);
-    data2.resize(data2.size() / 2);
+    return output_committer.write(output_filename, image);
 }
 
-void write_to_file(std::vector<char> data1, std::vector<char> data2, const char* output_filename) {
-    // Open the output file in binary mode for writing
-    std::ofstream out_file(output_filename, std::ios::binary);
-    out_file.seekp(0, std::ios::beg);
-
+void build_patch_image(const std::vector<char>& data1, const std::vector<char>& data2, std::vector<char>& image) {
     //////////////////////////////////////////////////////////////////////////////////////////
     //  The FB-01 SCI Patch file format we must create is structured like so:               //
     //                                                                                      //
@@ -213,12 +1831,13 @@ void write_to_file(std::vector<char> data1, std::vector<char> data2, const char*
     //////////////////////////////////////////////////////////////////////////////////////////
 
     char sciPatchHeader[2] = { '\x89', '\x00' };
-    out_file.write(reinterpret_cast<char*>(&sciPatchHeader), sizeof(sciPatchHeader));
-    out_file.write(data1.data(), data1.size());
     char bankSeparator[2] = { '\xAB', '\xCD' };
-    out_file.write(reinterpret_cast<char*>(&bankSeparator), sizeof(bankSeparator));
-    out_file.write(data2.data(), data2.size());
-    out_file.close();
+    image.clear();
+    image.reserve(sizeof(sciPatchHeader) + data1.size() + sizeof(bankSeparator) + data2.size());
+    image.insert(image.end(), sciPatchHeader, sciPatchHeader + sizeof(sciPatchHeader));
+    image.insert(image.end(), data1.begin(), data1.end());
+    image.insert(image.end(), bankSeparator, bankSeparator + sizeof(bankSeparator));
+    image.insert(image.end(), data2.begin(), data2.end());
 }
 
 bool check_file_exists(const char* filename) {
@@ -226,20 +1845,6102 @@ bool check_file_exists(const char* filename) {
     return infile.good();
 }
 
-void check_output_file(string output_filename) {
+bool check_output_file(string output_filename) {
     ifstream file(output_filename);
     if (file.good()) {
         cout << "Output file already exists. Do you want to overwrite it? (Y/N): ";
         string answer;
         cin >> answer;
         if (answer == "Y" || answer == "y") {
-            ofstream file(output_filename, ios::trunc);
-            cout << "\nFile " << output_filename << " successfully wiped.\n" << endl;
-            file.close();
+            // Left alone until the new file is complete and renamed over it
+            cout << "\nFile " << output_filename << " will be replaced.\n" << endl;
         }
         else {
             cout << "Aborting operation..." << endl;
-            exit(EXIT_FAILURE);
+            return false;
+        }
+    }
+    return true;
+}
+
+int run_batch(int argc, char* argv[]) {
+    if (argc < 3) {
+        cout << "   usage:  " << argv[0] << "   --batch joblist [--readers n] [--converters n] [--writers n] [--queue n] [--formats list] [--opl-select s]\n";
+        cout << "                   [--checkpoint file [--resume]] [--shard i/N | --coordinator address]\n";
+        cout << "           (each line of joblist holds:  bankfile1   bankfile2   patfile)\n";
+        return 1;
+    }
+
+    // Default stage sizes: readers and writers mostly wait on the disk, converters want every core
+    unsigned int cores = thread::hardware_concurrency();
+    int reader_count = 2;
+    int converter_count = cores > 0 ? static_cast<int>(cores) : 2;
+    int writer_count = 2;
+    int queue_depth = 64;
+    unsigned int formats = FORMAT_PATCH;
+    string checkpoint_filename;
+    bool resume = false;
+    uint64_t shard_index = 0;
+    uint64_t shard_count = 1;
+    string coordinator_address;
+
+    for (int i = 3; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--resume") {
+            resume = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cout << "Error: missing value for option " << option << endl;
+            return 1;
+        }
+        if (is_output_option(option)) {
+            if (!parse_output_option(option, argv[++i], formats)) {
+                return 1;
+            }
+            continue;
+        }
+        if (option == "--checkpoint") {
+            checkpoint_filename = argv[++i];
+            continue;
+        }
+        if (option == "--coordinator") {
+            coordinator_address = argv[++i];
+            continue;
+        }
+        // --shard i/N keeps the jobs whose Bank A path hashes to shard i of N, so N processes given
+        // the same job list split it between them without talking to each other
+        if (option == "--shard") {
+            unsigned long long index = 0, count = 0;
+            char extra;
+            if (sscanf(argv[++i], "%llu/%llu%c", &index, &count, &extra) != 2 || count < 1 || index >= count) {
+                cout << "Error: --shard must be i/N with 0 <= i < N, such as 0/4" << endl;
+                return 1;
+            }
+            shard_index = index;
+            shard_count = count;
+            continue;
+        }
+        int value = atoi(argv[++i]);
+        if (value < 1) {
+            cout << "Error: " << option << " must be at least 1" << endl;
+            return 1;
+        }
+        if (option == "--readers") reader_count = value;
+        else if (option == "--converters") converter_count = value;
+        else if (option == "--writers") writer_count = value;
+        else if (option == "--queue") queue_depth = value;
+        else {
+            cout << "Error: unknown option " << option << endl;
+            return 1;
+        }
+    }
+
+    vector<unique_ptr<ConversionJob>> jobs;
+    if (!load_job_list(argv[2], jobs)) {
+        return 1;
+    }
+    if (shard_count > 1 && !coordinator_address.empty()) {
+        cout << "Error: a worker takes its jobs from either --shard or --coordinator, not both" << endl;
+        return 1;
+    }
+    CoordinatorClient coordinator;
+    if (!coordinator_address.empty() && !coordinator.connect(coordinator_address)) {
+        return 1;
+    }
+
+    // Skipped jobs are dropped but keep their slot, so a job's index is its line in the job list
+    // for every worker and for the coordinator
+    size_t skipped = 0;
+    if (shard_count > 1) {
+        for (auto& job : jobs) {
+            if (fnv1a_hash(job->input_filename1.data(), job->input_filename1.size()) % shard_count != shard_index) {
+                job.reset();
+                skipped++;
+            }
+        }
+        cout << "Shard " << shard_index << "/" << shard_count << ": " << jobs.size() - skipped << " of " << jobs.size() << " bank pairs" << endl;
+    }
+
+    // Jobs whose outputs were committed by an earlier run, and are still there, are left out
+    CheckpointLog checkpoint;
+    if (resume && checkpoint_filename.empty()) {
+        cout << "Error: --resume needs the --checkpoint file of the earlier run" << endl;
+        return 1;
+    }
+    if (!checkpoint_filename.empty()) {
+        if (!checkpoint.open(checkpoint_filename, resume)) {
+            cout << "Error: could not open checkpoint file " << checkpoint_filename << endl;
+            return 1;
+        }
+    }
+    if (resume) {
+        size_t completed = 0;
+        for (auto& job : jobs) {
+            if (job && is_output_complete(formats, job->output_filename, checkpoint)) {
+                job.reset();
+                completed++;
+            }
+        }
+        cout << "Resuming: " << completed << " of " << jobs.size() - skipped << " bank pairs already converted" << endl;
+        skipped += completed;
+    }
+    if (coordinator_address.empty()) {
+        cout << "Converting " << jobs.size() - skipped << " bank pairs";
+    }
+    else {
+        cout << "Converting bank pairs handed out by " << coordinator_address;
+    }
+    cout << " (" << reader_count << " readers, " << converter_count << " converters, " << writer_count << " writers)" << endl << endl;
+
+    auto start_time = chrono::steady_clock::now();
+
+    // A null job marks the end of the stream. The last thread of a stage to finish sends one
+    // to every thread of the next stage.
+    BoundedQueue<unique_ptr<ConversionJob>> read_queue(queue_depth);
+    BoundedQueue<unique_ptr<ConversionJob>> write_queue(queue_depth);
+    atomic<size_t> next_job{ 0 };
+    atomic<int> readers_running{ reader_count };
+    atomic<int> converters_running{ converter_count };
+    int converted = 0;
+    mutex report_mutex;
+    vector<unique_ptr<ConversionJob>> failures;
+
+    // A written job waits until the committer has put every one of its outputs in place, or failed
+    // to; only then is it counted. Whoever settles its last output counts it, with report_mutex held.
+    map<size_t, unique_ptr<ConversionJob>> waiting;   // Keyed by job index
+    unordered_multimap<string, size_t> output_owners;  // Each output not settled yet, and its job
+    auto finish = [&](unique_ptr<ConversionJob> job) {
+        if (job->result.ok()) {
+            converted++;
+        }
+        else {
+            // Failed jobs are kept (without their data) for the report at the end
+            vector<char>().swap(job->data1);
+            vector<char>().swap(job->data2);
+            failures.push_back(std::move(job));
+        }
+    };
+    auto settle = [&](size_t index, const Result& problem) {
+        auto job = waiting.find(index);
+        job->second->result.merge(problem);
+        if (--job->second->outputs_pending == 0) {
+            finish(std::move(job->second));
+            waiting.erase(job);
+        }
+    };
+    auto settle_output = [&](const string& target, const Result& problem) {
+        auto owner = output_owners.find(target);
+        if (owner != output_owners.end()) {
+            size_t index = owner->second;
+            output_owners.erase(owner);
+            settle(index, problem);
+        }
+    };
+    output_committer.committed = [&](const vector<string>& targets) {
+        if (!checkpoint_filename.empty()) {
+            checkpoint.record(targets);
+        }
+        lock_guard<mutex> lock(report_mutex);
+        for (const string& target : targets) {
+            settle_output(target, Result());
+        }
+    };
+    output_committer.failed = [&](const string& target, const Result& problem) {
+        lock_guard<mutex> lock(report_mutex);
+        settle_output(target, problem);
+    };
+
+    vector<thread> threads;
+
+    // Job indices come straight from the list, or a range at a time from the coordinator
+    mutex range_mutex;
+    size_t range_next = 0, range_end = 0;
+    bool ranges_done = false;
+    auto next_index = [&](size_t& i) {
+        if (coordinator_address.empty()) {
+            i = next_job.fetch_add(1);
+            return i < jobs.size();
+        }
+        lock_guard<mutex> lock(range_mutex);
+        while (range_next >= range_end) {
+            if (ranges_done || !coordinator.next_range(range_next, range_end)) {
+                ranges_done = true;
+                return false;
+            }
+            range_end = min(range_end, jobs.size());
+        }
+        i = range_next++;
+        return true;
+    };
+
+    // Reader stage: load both bank files of each pair into memory
+    for (int t = 0; t < reader_count; t++) {
+        threads.emplace_back([&]() {
+            for (size_t i = 0; next_index(i); ) {
+                if (!jobs[i]) {
+                    continue;
+                }
+                unique_ptr<ConversionJob> job = std::move(jobs[i]);
+                job->index = i;
+                if (!load_file(job->input_filename1, job->raw1)) {
+                    job->result.fail(STEP_READ, "file " + job->input_filename1 + " not found");
+                }
+                if (!load_file(job->input_filename2, job->raw2)) {
+                    job->result.fail(STEP_READ, "file " + job->input_filename2 + " not found");
+                }
+                read_queue.push(std::move(job));
+            }
+            if (readers_running.fetch_sub(1) == 1) {
+                for (int c = 0; c < converter_count; c++) read_queue.push(nullptr);
+            }
+        });
+    }
+
+    // Converter stage: validate the banks, pull out the instrument packets and denibble them
+    for (int t = 0; t < converter_count; t++) {
+        threads.emplace_back([&]() {
+            for (unique_ptr<ConversionJob> job = read_queue.pop(); job; job = read_queue.pop()) {
+                if (job->result.ok()) {
+                    job->result.merge(validate_bank_data(job->raw1, job->input_filename1, 0));
+                    job->result.merge(validate_bank_data(job->raw2, job->input_filename2, 1));
+                }
+                if (job->result.ok()) {
+                    extract_packets(job->raw1, job->data1);
+                    extract_packets(job->raw2, job->data2);
+                    job->result.merge(reorganize_data(job->data1, job->data2));
+                }
+                if (job->result.ok() && normalize_levels) {
+                    normalize_voices(job->data1, job->data2, false);
+                }
+                // The raw bank images are no longer needed, don't hold them in the write queue
+                vector<char>().swap(job->raw1);
+                vector<char>().swap(job->raw2);
+                write_queue.push(std::move(job));
+            }
+            if (converters_running.fetch_sub(1) == 1) {
+                for (int w = 0; w < writer_count; w++) write_queue.push(nullptr);
+            }
+        });
+    }
+
+    // Writer stage: flush the finished patch images (and any other requested formats) to disk.
+    // Batch mode never prompts before overwriting.
+    for (int t = 0; t < writer_count; t++) {
+        threads.emplace_back([&]() {
+            for (unique_ptr<ConversionJob> job = write_queue.pop(); job; job = write_queue.pop()) {
+                if (!job->result.ok()) {
+                    lock_guard<mutex> lock(report_mutex);
+                    finish(std::move(job));
+                    continue;
+                }
+
+                // The outputs are registered before any is staged, since a group can commit while
+                // this job is still writing. The writer's own share keeps the job alive until then.
+                vector<pair<string, vector<char>>> outputs;
+                render_outputs(formats, job->data1, job->data2, job->output_filename, outputs);
+                size_t index = job->index;
+                {
+                    lock_guard<mutex> lock(report_mutex);
+                    job->outputs_pending = outputs.size() + 1;
+                    for (const auto& output : outputs) {
+                        output_owners.emplace(output.first, index);
+                    }
+                    waiting[index] = std::move(job);
+                }
+                for (const auto& output : outputs) {
+                    Result written = output_committer.write(output.first, output.second);
+                    if (!written.ok()) {
+                        // Never staged, so the committer won't report it
+                        lock_guard<mutex> lock(report_mutex);
+                        auto range = output_owners.equal_range(output.first);
+                        for (auto owner = range.first; owner != range.second; ++owner) {
+                            if (owner->second == index) {
+                                output_owners.erase(owner);
+                                break;
+                            }
+                        }
+                        settle(index, written);
+                    }
+                }
+                lock_guard<mutex> lock(report_mutex);
+                settle(index, Result());
+            }
+        });
+    }
+
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    // The last partial group of outputs still has to be synced and renamed into place; its jobs
+    // are settled by the callbacks like the rest
+    output_committer.flush();
+    output_committer.committed = nullptr;
+    output_committer.failed = nullptr;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    // Every failed job is listed once, in job list order, with all of its problems, so a rerun
+    // can be limited to just these pairs
+    sort(failures.begin(), failures.end(), [](const unique_ptr<ConversionJob>& a, const unique_ptr<ConversionJob>& b) { return a->index < b->index; });
+    if (!failures.empty()) {
+        cout << "Failed jobs:" << endl;
+        for (const unique_ptr<ConversionJob>& job : failures) {
+            cout << "  " << job->input_filename1 << " " << job->input_filename2 << " " << job->output_filename << endl;
+            cout << job->result.describe("      ");
+        }
+    }
+    if (!coordinator_address.empty()) {
+        coordinator.report(converted, failures);
+    }
+    cout << endl << converted << " SCI FB-01 patches created, " << failures.size() << " failed (" << elapsed.count() << " seconds)" << endl;
+
+    return failures.empty() ? 0 : 1;
+}
+
+bool load_job_list(const char* list_filename, vector<unique_ptr<ConversionJob>>& jobs) {
+    ifstream list_file(list_filename);
+    if (!list_file.good()) {
+        cout << "Error: file " << list_filename << " not found" << endl;
+        return false;
+    }
+
+    // Each non-empty line names one bank pair and its output: bankfile1 bankfile2 patfile.
+    // Lines starting with '#' are comments.
+    string line;
+    int line_number = 0;
+    while (getline(list_file, line)) {
+        line_number++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+
+        istringstream fields(line);
+        unique_ptr<ConversionJob> job(new ConversionJob);
+        string extra;
+        if (!(fields >> job->input_filename1 >> job->input_filename2 >> job->output_filename) || (fields >> extra)) {
+            cout << "Error: " << list_filename << " line " << line_number << " must hold exactly three filenames" << endl;
+            return false;
+        }
+        jobs.push_back(std::move(job));
+    }
+    return true;
+}
+
+bool load_file(const string& filename, vector<char>& raw) {
+    ifstream file(filename, ios::binary);
+    if (!file.good()) {
+        return false;
+    }
+    file.seekg(0, ios::end);
+    raw.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0, ios::beg);
+    file.read(raw.data(), raw.size());
+    return true;
+}
+
+Result validate_bank_data(const vector<char>& raw, const string& filename, int bank) {
+    // Same checks as the single conversion does on the open files: the FB-01's send Bank A/B sysex header,
+    // and exactly the size of a bank dump
+    bool header_ok = raw.size() >= static_cast<size_t>(Fb01BankALayout::header_size) &&
+        (bank == 0 ? header_matches<Fb01BankALayout>(raw.data(), make_index_sequence<Fb01BankALayout::header_size>())
+                   : header_matches<Fb01BankBLayout>(raw.data(), make_index_sequence<Fb01BankBLayout::header_size>()));
+    Result result;
+    if (!header_ok) {
+        result.fail(STEP_VALIDATE, filename + " is not a valid FB-01 sysex bank file (missing expected sysex header).");
+    }
+    else if (raw.size() != static_cast<size_t>(Fb01BankALayout::file_size)) {
+        result.fail(STEP_VALIDATE, filename + " is not the expected size (" + to_string(Fb01BankALayout::file_size) + " bytes). Not a valid FB-01 sysex bank file. Actual size: " + to_string(raw.size()));
+    }
+    return result;
+}
+
+void extract_packets(const vector<char>& raw, vector<char>& data) {
+    // Take each 128-byte instrument packet and skip the 3 bytes of checksum and packet size
+    // identifier between them. Bank A and Bank B dumps only differ in their header.
+    static_assert(Fb01BankALayout::first_packet == Fb01BankBLayout::first_packet &&
+                  Fb01BankALayout::packet_stride == Fb01BankBLayout::packet_stride, "FB-01 banks share one packet layout");
+    data.resize(Fb01BankALayout::packet_data_size);
+    gather_packets<Fb01BankALayout>(raw.data(), data.data());
+}
+
+int run_archive(int argc, char* argv[]) {
+    // Options may appear anywhere after --archive, the remaining arguments are the archives
+    unsigned int formats = FORMAT_PATCH;
+    vector<string> archives;
+    for (int i = 2; i < argc; i++) {
+        if (is_output_option(argv[i]) && i + 1 < argc) {
+            if (!parse_output_option(argv[i], argv[i + 1], formats)) {
+                return 1;
+            }
+            i++;
+        }
+        else {
+            archives.push_back(argv[i]);
+        }
+    }
+
+    if (archives.size() < 2) {
+        cout << "   usage:  " << argv[0] << "   --archive outarchive inarchive [inarchive ...] [--formats list] [--opl-select s]\n";
+        cout << "           (outarchive is written as zip if it ends in .zip, otherwise as tar)\n";
+        return 1;
+    }
+
+    ArchiveWriter writer;
+    if (!writer.open(archives[0])) {
+        cout << "Error: could not create " << archives[0] << endl;
+        return 1;
+    }
+
+    int converted = 0;
+    int failed = 0;
+
+    // Each pair is converted as soon as its second bank turns up in the stream and goes straight
+    // into the output archive, named after the Bank A entry
+    BankPairer pairer([&](const string& name1, vector<char>& raw1, const string& name2, vector<char>& raw2) {
+        Result result = validate_bank_data(raw1, name1, 0);
+        result.merge(validate_bank_data(raw2, name2, 1));
+        vector<char> data1, data2;
+        if (result.ok()) {
+            extract_packets(raw1, data1);
+            extract_packets(raw2, data2);
+            result.merge(reorganize_data(data1, data2));
+        }
+        if (!result.ok()) {
+            cout << "Error: " << name1 << " + " << name2 << endl << result.describe("    ");
+            failed++;
+            return;
+        }
+        if (normalize_levels) {
+            normalize_voices(data1, data2, false);
+        }
+
+        string output_name = strip_extension(name1) + ".002";
+        vector<pair<string, vector<char>>> outputs;
+        render_outputs(formats, data1, data2, output_name, outputs);
+        for (const auto& output : outputs) {
+            writer.add(output.first, output.second);
+        }
+        cout << name1 << " + " << name2 << "  ->  " << output_name << endl;
+        converted++;
+    });
+
+    for (size_t i = 1; i < archives.size(); i++) {
+        string error;
+        if (!read_bank_pairs_from_archive(archives[i], pairer, error)) {
+            cout << "Error: " << error << endl;
+            failed++;
+        }
+    }
+
+    for (const string& name : pairer.unpaired()) {
+        cout << "Warning: no matching bank found for " << name << endl;
+    }
+
+    string error;
+    if (!writer.close(error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+
+    cout << endl << converted << " SCI FB-01 patches written to " << archives[0] << ", " << failed << " failed" << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+bool read_bank_pairs_from_archive(const string& filename, BankPairer& pairer, string& error) {
+    // Only entries of exactly bank file size are worth decompressing; everything else is skipped
+    return read_archive(filename, Fb01BankALayout::file_size, [&](const string& name, vector<char>& data) {
+        pairer.add(filename, name, data);
+    }, error);
+}
+
+bool read_archive(const string& filename, size_t entry_size, const ArchiveEntryHandler& handler, string& error) {
+    ifstream in(filename, ios::binary);
+    if (!in.good()) {
+        error = "file " + filename + " not found";
+        return false;
+    }
+
+    // Zip archives start with a local file header signature, anything else is treated as tar
+    char signature[4] = { 0 };
+    in.read(signature, 4);
+    in.clear();
+    in.seekg(0, ios::beg);
+
+    bool ok = memcmp(signature, "PK\x03\x04", 4) == 0 ? read_zip_stream(in, entry_size, handler, error)
+                                                      : read_tar_stream(in, entry_size, handler, error);
+    if (!ok) {
+        error = filename + ": " + error;
+    }
+    return ok;
+}
+
+// Parses a tar numeric field (octal text, or base-256 if the high bit of the first byte is set)
+static uint64_t parse_tar_number(const char* field, size_t length) {
+    uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        for (size_t i = 1; i < length; i++) {
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+    for (size_t i = 0; i < length && field[i] != '\0'; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
         }
     }
+    return value;
+}
+
+bool read_tar_stream(istream& in, size_t entry_size, const ArchiveEntryHandler& handler, string& error) {
+    char header[512];
+    string long_name;
+
+    while (in.read(header, 512)) {
+        // Two zero blocks end the archive; one is enough to know we're done
+        bool empty = true;
+        for (int i = 0; i < 512 && empty; i++) {
+            empty = header[i] == '\0';
+        }
+        if (empty) {
+            return true;
+        }
+
+        // The checksum is the sum of all header bytes with the checksum field itself counted as spaces
+        unsigned int sum = 0;
+        for (int i = 0; i < 512; i++) {
+            sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        if (sum != parse_tar_number(header + 148, 8)) {
+            error = "corrupt tar header";
+            return false;
+        }
+
+        uint64_t size = parse_tar_number(header + 124, 12);
+        uint64_t padded_size = (size + 511) & ~static_cast<uint64_t>(511);
+        char type = header[156];
+
+        // GNU long names and pax extended headers carry the real name of the following entry
+        if (type == 'L' || type == 'x') {
+            string extended(static_cast<size_t>(padded_size), '\0');
+            if (!in.read(&extended[0], padded_size)) break;
+            extended.resize(static_cast<size_t>(size));
+            if (type == 'L') {
+                long_name = extended.c_str();
+            }
+            else {
+                // pax records look like "<length> <key>=<value>\n"
+                size_t pos = 0;
+                while (pos < extended.size()) {
+                    size_t space = extended.find(' ', pos);
+                    size_t record_length = strtoul(extended.c_str() + pos, nullptr, 10);
+                    if (space == string::npos || record_length == 0) break;
+                    string record = extended.substr(space + 1, pos + record_length - space - 2);
+                    if (record.compare(0, 5, "path=") == 0) {
+                        long_name = record.substr(5);
+                    }
+                    pos += record_length;
+                }
+            }
+            continue;
+        }
+
+        string name = long_name;
+        if (name.empty()) {
+            string prefix(header + 345, strnlen(header + 345, 155));
+            name = string(header, strnlen(header, 100));
+            if (!prefix.empty() && memcmp(header + 257, "ustar", 5) == 0) {
+                name = prefix + "/" + name;
+            }
+        }
+        long_name.clear();
+
+        if ((type == '0' || type == '\0' || type == '7') && size == entry_size) {
+            vector<char> data(static_cast<size_t>(size));
+            if (!in.read(data.data(), size)) break;
+            in.ignore(padded_size - size);
+            handler(name, data);
+        }
+        else {
+            in.ignore(padded_size);
+        }
+    }
+
+    error = "unexpected end of tar archive";
+    return false;
+}
+
+static uint32_t read_le(const unsigned char* bytes, int count) {
+    uint32_t value = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+bool read_zip_stream(istream& in, size_t entry_size, const ArchiveEntryHandler& handler, string& error) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  Zip entries are read front to back through their local headers, so the archive      //
+    //  never has to be seeked around in. Only stored and deflated entries are supported.    //
+    //  Entries written with a trailing data descriptor (sizes unknown up front) can still    //
+    //  be streamed if they are deflated, since the deflate data marks its own end.           //
+    //////////////////////////////////////////////////////////////////////////////////////////
+
+    for (;;) {
+        unsigned char header[30];
+        if (!in.read(reinterpret_cast<char*>(header), 4)) {
+            error = "unexpected end of zip archive";
+            return false;
+        }
+        uint32_t signature = read_le(header, 4);
+        if (signature == 0x02014b50 || signature == 0x06054b50) {
+            // Reached the central directory, every entry has been seen
+            return true;
+        }
+        if (signature != 0x04034b50 || !in.read(reinterpret_cast<char*>(header + 4), 26)) {
+            error = "corrupt zip archive";
+            return false;
+        }
+
+        uint32_t flags = read_le(header + 6, 2);
+        uint32_t method = read_le(header + 8, 2);
+        uint32_t crc = read_le(header + 14, 4);
+        uint32_t compressed_size = read_le(header + 18, 4);
+        uint32_t size = read_le(header + 22, 4);
+        string name(read_le(header + 26, 2), '\0');
+        if (!in.read(&name[0], name.size())) {
+            error = "unexpected end of zip archive";
+            return false;
+        }
+        in.ignore(read_le(header + 28, 2));
+
+        bool encrypted = (flags & 0x01) != 0;
+        bool has_descriptor = (flags & 0x08) != 0;
+        bool directory = !name.empty() && name.back() == '/';
+        vector<char> data;
+
+        if (has_descriptor) {
+            if (method != 8) {
+                error = name + " has no size in its local header and is not deflated, it cannot be streamed";
+                return false;
+            }
+            if (!inflate_stream(in, data)) {
+                error = name + " is corrupt";
+                return false;
+            }
+            // The descriptor may or may not start with its own signature
+            unsigned char descriptor[16];
+            in.read(reinterpret_cast<char*>(descriptor), 12);
+            if (read_le(descriptor, 4) == 0x08074b50) {
+                in.read(reinterpret_cast<char*>(descriptor + 12), 4);
+                crc = read_le(descriptor + 4, 4);
+            }
+            else {
+                crc = read_le(descriptor, 4);
+            }
+            if (!in) {
+                error = "unexpected end of zip archive";
+                return false;
+            }
+            if (data.size() != entry_size) continue;
+        }
+        else if (directory || encrypted || size != entry_size || (method != 0 && method != 8)) {
+            in.ignore(compressed_size);
+            continue;
+        }
+        else {
+            string compressed(compressed_size, '\0');
+            if (!in.read(&compressed[0], compressed_size)) {
+                error = "unexpected end of zip archive";
+                return false;
+            }
+            if (method == 0) {
+                data.assign(compressed.begin(), compressed.end());
+            }
+            else {
+                istringstream compressed_stream(compressed);
+                if (!inflate_stream(compressed_stream, data)) {
+                    error = name + " is corrupt";
+                    return false;
+                }
+            }
+        }
+
+        if (compute_crc32(data.data(), data.size()) != crc) {
+            error = name + " fails its CRC check";
+            return false;
+        }
+        handler(name, data);
+    }
+}
+
+// Builds a canonical Huffman table from code lengths. Returns 0 for a complete code, a positive
+// value for an incomplete one and a negative value for an over-subscribed (invalid) one.
+static int build_huffman(HuffmanTable& table, const short* lengths, int count) {
+    for (int len = 0; len < 16; len++) {
+        table.count[len] = 0;
+    }
+    for (int symbol = 0; symbol < count; symbol++) {
+        table.count[lengths[symbol]]++;
+    }
+    if (table.count[0] == count) {
+        return 0;
+    }
+
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= table.count[len];
+        if (left < 0) return left;
+    }
+
+    short offsets[16];
+    offsets[1] = 0;
+    for (int len = 1; len < 15; len++) {
+        offsets[len + 1] = offsets[len] + table.count[len];
+    }
+    for (int symbol = 0; symbol < count; symbol++) {
+        if (lengths[symbol] != 0) {
+            table.symbol[offsets[lengths[symbol]]++] = static_cast<short>(symbol);
+        }
+    }
+    return left;
+}
+
+static int decode_symbol(BitReader& reader, const HuffmanTable& table) {
+    // Walk the code one bit at a time; codes of each length are consecutive integers
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        code |= reader.bits(1);
+        int count = table.count[len];
+        if (code - count < first) {
+            return table.symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+        if (reader.failed) break;
+    }
+    return -1;
+}
+
+bool inflate_stream(istream& in, vector<char>& out, const vector<char>& dictionary) {
+    static const short code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    // Matches may reach back into a preset dictionary, which is dropped again at the end
+    BitReader reader(in);
+    out.assign(dictionary.begin(), dictionary.end());
+
+    int last_block;
+    do {
+        last_block = reader.bits(1);
+        int type = reader.bits(2);
+        if (reader.failed) return false;
+
+        if (type == 0) {
+            // Stored block: byte aligned length, its complement, then raw bytes
+            reader.align();
+            unsigned char lengths[4];
+            if (!in.read(reinterpret_cast<char*>(lengths), 4)) return false;
+            uint32_t length = read_le(lengths, 2);
+            if (length != (~read_le(lengths + 2, 2) & 0xFFFF)) return false;
+            size_t start = out.size();
+            out.resize(start + length);
+            if (!in.read(out.data() + start, length)) return false;
+            continue;
+        }
+        if (type == 3) {
+            return false;
+        }
+
+        HuffmanTable length_code, distance_code;
+        short lengths[320];
+        if (type == 1) {
+            // Fixed Huffman codes
+            int symbol = 0;
+            for (; symbol < 144; symbol++) lengths[symbol] = 8;
+            for (; symbol < 256; symbol++) lengths[symbol] = 9;
+            for (; symbol < 280; symbol++) lengths[symbol] = 7;
+            for (; symbol < 288; symbol++) lengths[symbol] = 8;
+            build_huffman(length_code, lengths, 288);
+            for (symbol = 0; symbol < 30; symbol++) lengths[symbol] = 5;
+            build_huffman(distance_code, lengths, 30);
+        }
+        else {
+            // Dynamic Huffman codes, themselves sent Huffman coded
+            int length_count = reader.bits(5) + 257;
+            int distance_count = reader.bits(5) + 1;
+            int code_count = reader.bits(4) + 4;
+            if (length_count > 286 || distance_count > 30) return false;
+
+            for (int i = 0; i < 19; i++) {
+                lengths[code_length_order[i]] = static_cast<short>(i < code_count ? reader.bits(3) : 0);
+            }
+            HuffmanTable code_length_code;
+            if (build_huffman(code_length_code, lengths, 19) != 0) return false;
+
+            int index = 0;
+            while (index < length_count + distance_count) {
+                int symbol = decode_symbol(reader, code_length_code);
+                if (symbol < 0) return false;
+                if (symbol < 16) {
+                    lengths[index++] = static_cast<short>(symbol);
+                    continue;
+                }
+                short repeat_length = 0;
+                int repeat;
+                if (symbol == 16) {
+                    if (index == 0) return false;
+                    repeat_length = lengths[index - 1];
+                    repeat = 3 + reader.bits(2);
+                }
+                else if (symbol == 17) {
+                    repeat = 3 + reader.bits(3);
+                }
+                else {
+                    repeat = 11 + reader.bits(7);
+                }
+                if (index + repeat > length_count + distance_count) return false;
+                while (repeat--) lengths[index++] = repeat_length;
+            }
+
+            // There has to be an end-of-block code, and incomplete codes are only allowed for a single symbol
+            if (lengths[256] == 0) return false;
+            int result = build_huffman(length_code, lengths, length_count);
+            if (result < 0 || (result > 0 && length_count - length_code.count[0] != 1)) return false;
+            result = build_huffman(distance_code, lengths + length_count, distance_count);
+            if (result < 0 || (result > 0 && distance_count - distance_code.count[0] != 1)) return false;
+        }
+
+        // Decode literals and length/distance pairs until the end-of-block code
+        for (;;) {
+            int symbol = decode_symbol(reader, length_code);
+            if (symbol < 0) return false;
+            if (symbol < 256) {
+                out.push_back(static_cast<char>(symbol));
+                continue;
+            }
+            if (symbol == 256) break;
+
+            symbol -= 257;
+            if (symbol >= 29) return false;
+            int length = deflate_length_base[symbol] + reader.bits(deflate_length_extra[symbol]);
+            symbol = decode_symbol(reader, distance_code);
+            if (symbol < 0 || symbol >= 30) return false;
+            size_t distance = static_cast<size_t>(deflate_distance_base[symbol] + reader.bits(deflate_distance_extra[symbol]));
+            if (distance > out.size() || reader.failed) return false;
+            while (length--) {
+                out.push_back(out[out.size() - distance]);
+            }
+        }
+    } while (!last_block);
+
+    out.erase(out.begin(), out.begin() + dictionary.size());
+    return !reader.failed;
+}
+
+uint32_t compute_crc32(const char* data, size_t size) {
+    static const array<uint32_t, 256> table = []() {
+        array<uint32_t, 256> entries;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+static void append_le(vector<char>& buffer, uint32_t value, int count) {
+    for (int i = 0; i < count; i++) {
+        buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+bool ArchiveWriter::open(const string& filename) {
+    zip = filename.size() >= 4 && (filename.compare(filename.size() - 4, 4, ".zip") == 0 || filename.compare(filename.size() - 4, 4, ".ZIP") == 0);
+    out.open(filename, ios::binary | ios::trunc);
+
+    // Zip entries carry an MS-DOS timestamp, use the time the archive was created for all of them
+    time_t now = time(nullptr);
+    tm* local = localtime(&now);
+    dos_time = static_cast<uint16_t>((local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2));
+    dos_date = static_cast<uint16_t>(((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday);
+    return out.good();
+}
+
+void ArchiveWriter::add(const string& name, const vector<char>& data) {
+    if (zip) {
+        ZipEntry entry = { name, compute_crc32(data.data(), data.size()), static_cast<uint32_t>(data.size()), static_cast<uint32_t>(offset) };
+        vector<char> header;
+        append_le(header, 0x04034b50, 4);   // Local file header signature
+        append_le(header, 10, 2);           // Version needed to extract (1.0, stored)
+        append_le(header, 0, 2);            // Flags
+        append_le(header, 0, 2);            // Method: stored
+        append_le(header, dos_time, 2);
+        append_le(header, dos_date, 2);
+        append_le(header, entry.crc, 4);
+        append_le(header, entry.size, 4);   // Compressed size
+        append_le(header, entry.size, 4);   // Uncompressed size
+        append_le(header, static_cast<uint32_t>(name.size()), 2);
+        append_le(header, 0, 2);            // Extra field length
+        header.insert(header.end(), name.begin(), name.end());
+        out.write(header.data(), header.size());
+        out.write(data.data(), data.size());
+        offset += header.size() + data.size();
+        zip_entries.push_back(entry);
+        return;
+    }
+
+    write_tar_header(name, data.size(), '0');
+    out.write(data.data(), data.size());
+    static const char padding[512] = { 0 };
+    out.write(padding, (512 - data.size() % 512) % 512);
+}
+
+void ArchiveWriter::write_tar_header(const string& name, size_t size, char type) {
+    // Names that don't fit the 100-byte field go in a GNU long name entry first
+    if (name.size() >= 100) {
+        vector<char> long_name(name.begin(), name.end());
+        long_name.push_back('\0');
+        write_tar_header("././@LongLink", long_name.size(), 'L');
+        out.write(long_name.data(), long_name.size());
+        static const char padding[512] = { 0 };
+        out.write(padding, (512 - long_name.size() % 512) % 512);
+    }
+
+    char header[512] = { 0 };
+    memcpy(header, name.c_str(), min(name.size(), static_cast<size_t>(99)));
+    snprintf(header + 100, 8, "%07o", 0644);                                  // Mode
+    snprintf(header + 108, 8, "%07o", 0);                                     // Owner id
+    snprintf(header + 116, 8, "%07o", 0);                                     // Group id
+    snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+    snprintf(header + 136, 12, "%011llo", static_cast<unsigned long long>(time(nullptr)));
+    memset(header + 148, ' ', 8);                                             // Checksum counts as spaces while summing
+    header[156] = type;
+    memcpy(header + 257, "ustar\0" "00", 8);
+
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += static_cast<unsigned char>(header[i]);
+    }
+    snprintf(header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+    out.write(header, 512);
+}
+
+bool ArchiveWriter::close(string& error) {
+    if (zip) {
+        // Central directory, then the end of central directory record pointing at it
+        if (zip_entries.size() > 0xFFFF || offset > 0xFFFFFFFF) {
+            error = "too many entries for a zip archive, write a tar archive instead";
+            return false;
+        }
+        vector<char> directory;
+        for (const ZipEntry& entry : zip_entries) {
+            append_le(directory, 0x02014b50, 4);  // Central file header signature
+            append_le(directory, 20, 2);          // Version made by
+            append_le(directory, 10, 2);          // Version needed to extract
+            append_le(directory, 0, 2);           // Flags
+            append_le(directory, 0, 2);           // Method: stored
+            append_le(directory, dos_time, 2);
+            append_le(directory, dos_date, 2);
+            append_le(directory, entry.crc, 4);
+            append_le(directory, entry.size, 4);
+            append_le(directory, entry.size, 4);
+            append_le(directory, static_cast<uint32_t>(entry.name.size()), 2);
+            append_le(directory, 0, 2);           // Extra field length
+            append_le(directory, 0, 2);           // Comment length
+            append_le(directory, 0, 2);           // Disk number
+            append_le(directory, 0, 2);           // Internal attributes
+            append_le(directory, 0, 4);           // External attributes
+            append_le(directory, entry.offset, 4);
+            directory.insert(directory.end(), entry.name.begin(), entry.name.end());
+        }
+        uint32_t directory_size = static_cast<uint32_t>(directory.size());
+        append_le(directory, 0x06054b50, 4);      // End of central directory signature
+        append_le(directory, 0, 2);
+        append_le(directory, 0, 2);
+        append_le(directory, static_cast<uint32_t>(zip_entries.size()), 2);
+        append_le(directory, static_cast<uint32_t>(zip_entries.size()), 2);
+        append_le(directory, directory_size, 4);
+        append_le(directory, static_cast<uint32_t>(offset), 4);
+        append_le(directory, 0, 2);               // Comment length
+        out.write(directory.data(), directory.size());
+    }
+    else {
+        static const char end_blocks[1024] = { 0 };
+        out.write(end_blocks, sizeof(end_blocks));
+    }
+
+    out.close();
+    if (!out) {
+        error = "could not write the output archive";
+        return false;
+    }
+    return true;
+}
+
+// Operator parameters are read and written the same way, with record pointing at the operator block
+int get_parameter(const char* record, const VoiceParameter& parameter) {
+    int value = (static_cast<unsigned char>(record[parameter.offset]) >> parameter.shift) & ((1 << parameter.bits) - 1);
+    if (parameter.is_signed && (value & (1 << (parameter.bits - 1)))) {
+        value -= 1 << parameter.bits;
+    }
+    return value;
+}
+
+void set_parameter(char* record, const VoiceParameter& parameter, int value) {
+    int mask = ((1 << parameter.bits) - 1) << parameter.shift;
+    unsigned char byte = static_cast<unsigned char>(record[parameter.offset]);
+    record[parameter.offset] = static_cast<char>((byte & ~mask) | ((value << parameter.shift) & mask));
+}
+
+string get_voice_name(const char* record) {
+    // The name is space padded; anything outside printable ASCII is shown as '?'
+    string name(record, 7);
+    for (char& c : name) {
+        if (c < 0x20 || c > 0x7E) c = '?';
+    }
+    while (!name.empty() && name.back() == ' ') name.pop_back();
+    return name;
+}
+
+bool parse_formats(const string& list, unsigned int& formats) {
+    formats = 0;
+    istringstream names(list);
+    string name;
+    while (getline(names, name, ',')) {
+        bool found = false;
+        for (const OutputFormatInfo& info : output_formats) {
+            if (name == info.name) {
+                formats |= info.format;
+                found = true;
+            }
+        }
+        if (!found) return false;
+    }
+    return formats != 0;
+}
+
+bool is_output_option(const string& option) {
+    return option == "--formats" || option == "--opl-select" || option == "--map-cache" || option == "--normalize" || option == "--sync";
+}
+
+bool parse_output_option(const string& option, const string& value, unsigned int& formats) {
+    if (option == "--formats") {
+        if (!parse_formats(value, formats)) {
+            cout << "Error: unknown output format in " << value << endl;
+            return false;
+        }
+        return true;
+    }
+
+    if (option == "--map-cache") {
+        if (!voice_map_cache.open(value)) {
+            cout << "Error: could not open voice mapping cache " << value << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // --normalize takes the target level in dBFS, such as -18, or "off"
+    if (option == "--normalize") {
+        char* end = nullptr;
+        double target = strtod(value.c_str(), &end);
+        if (value == "off") {
+            normalize_levels = false;
+        }
+        else if (!value.empty() && *end == '\0' && target < 0.0 && target > -60.0) {
+            normalize_levels = true;
+            normalize_target = target;
+        }
+        else {
+            cout << "Error: --normalize must be a level between -60 and 0 dBFS, such as -18, or off" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // --sync takes the number of outputs made durable together, or "off" to skip syncing
+    if (option == "--sync") {
+        int batch_size = atoi(value.c_str());
+        if (value == "off") {
+            output_committer.batch_size = 0;
+        }
+        else if (batch_size >= 1 && value.find_first_not_of("0123456789") == string::npos) {
+            output_committer.batch_size = batch_size;
+        }
+        else {
+            cout << "Error: --sync must be the number of outputs to sync at once, such as 256, or off" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // --opl-select picks how AdLib instruments are built: "carrier", "loudest", or a fixed
+    // modulator,carrier pair of FB-01 operator numbers such as "2,1"
+    if (value == "carrier") {
+        opl_selection = OPL_SELECT_CARRIER;
+    }
+    else if (value == "loudest") {
+        opl_selection = OPL_SELECT_LOUDEST;
+    }
+    else if (value.size() == 3 && value[1] == ',' && value[0] >= '1' && value[0] <= '4' && value[2] >= '1' && value[2] <= '4' && value[0] != value[2]) {
+        opl_selection = OPL_SELECT_FIXED;
+        opl_fixed_operators[0] = value[0] - '1';
+        opl_fixed_operators[1] = value[2] - '1';
+    }
+    else {
+        cout << "Error: --opl-select must be carrier, loudest or two operator numbers such as 2,1" << endl;
+        return false;
+    }
+    return true;
+}
+
+string strip_extension(const string& filename) {
+    size_t separator = filename.find_last_of("/\\");
+    size_t dot = filename.find_last_of('.');
+    if (dot == string::npos || (separator != string::npos && dot < separator)) {
+        return filename;
+    }
+    return filename.substr(0, dot);
+}
+
+string format_output_filename(const OutputFormatInfo& info, const string& output_filename) {
+    // The patch keeps the given name; the other formats swap in their own extension
+    return info.format == FORMAT_PATCH ? output_filename : strip_extension(output_filename) + info.extension;
+}
+
+bool is_output_complete(unsigned int formats, const string& output_filename, const CheckpointLog& checkpoint) {
+    // Trust the checkpoint only as far as the disk agrees: every output logged, present, and a patch the full 6148 bytes
+    for (const OutputFormatInfo& info : output_formats) {
+        if (formats & info.format) {
+            string filename = format_output_filename(info, output_filename);
+            error_code ec;
+            uintmax_t size = filesystem::file_size(filename, ec);
+            if (!checkpoint.contains(filename) || ec || (info.format == FORMAT_PATCH ? size != 6148 : size == 0)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void render_outputs(unsigned int formats, const vector<char>& data1, const vector<char>& data2, const string& output_filename,
+                    vector<pair<string, vector<char>>>& outputs) {
+    // Every format works from the same denibbled voice data, so the banks are only read and decoded once
+    for (const OutputFormatInfo& info : output_formats) {
+        if (formats & info.format) {
+            outputs.emplace_back(format_output_filename(info, output_filename), vector<char>());
+            info.render(data1, data2, outputs.back().second);
+        }
+    }
+}
+
+Result write_outputs(unsigned int formats, const vector<char>& data1, const vector<char>& data2, const string& output_filename) {
+    Result result;
+    vector<pair<string, vector<char>>> outputs;
+    render_outputs(formats, data1, data2, output_filename, outputs);
+    for (const auto& output : outputs) {
+        result.merge(output_committer.write(output.first, output.second));
+    }
+    return result;
+}
+
+void render_raw(const vector<char>& data1, const vector<char>& data2, vector<char>& out) {
+    out.assign(data1.begin(), data1.end());
+    out.insert(out.end(), data2.begin(), data2.end());
+}
+
+static void append_text(vector<char>& out, const string& text) {
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+void render_json(const vector<char>& data1, const vector<char>& data2, vector<char>& out) {
+    out.clear();
+    append_text(out, "{\n  \"voices\": [\n");
+    for (int voice = 0; voice < 96; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+
+        // Voice names are printable ASCII after get_voice_name(), only quotes and backslashes need escaping
+        string name;
+        for (char c : get_voice_name(record)) {
+            if (c == '"' || c == '\\') name += '\\';
+            name += c;
+        }
+
+        ostringstream text;
+        text << "    { \"slot\": " << voice << ", \"bank\": \"" << (voice < 48 ? 'A' : 'B') << "\", \"name\": \"" << name << "\"";
+        for (const VoiceParameter& parameter : voice_parameters) {
+            text << ", \"" << parameter.name << "\": " << get_parameter(record, parameter);
+        }
+        text << ",\n      \"operators\": [\n";
+        for (int op = 0; op < 4; op++) {
+            text << "        {";
+            for (int i = 0; i < operator_parameter_count; i++) {
+                text << (i ? ", \"" : " \"") << operator_parameters[i].name << "\": " << get_parameter(record + operator_offsets[op], operator_parameters[i]);
+            }
+            text << " }" << (op < 3 ? ",\n" : "\n");
+        }
+        text << "      ] }" << (voice < 95 ? ",\n" : "\n");
+        append_text(out, text.str());
+    }
+    append_text(out, "  ]\n}\n");
+}
+
+void render_csv(const vector<char>& data1, const vector<char>& data2, vector<char>& out) {
+    ostringstream text;
+    text << "slot,bank,name";
+    for (const VoiceParameter& parameter : voice_parameters) {
+        text << "," << parameter.name;
+    }
+    for (int op = 0; op < 4; op++) {
+        for (const VoiceParameter& parameter : operator_parameters) {
+            text << ",op" << op + 1 << "_" << parameter.name;
+        }
+    }
+    text << "\n";
+
+    for (int voice = 0; voice < 96; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        string name;
+        for (char c : get_voice_name(record)) {
+            if (c == '"') name += '"';
+            name += c;
+        }
+        text << voice << "," << (voice < 48 ? 'A' : 'B') << ",\"" << name << "\"";
+        for (const VoiceParameter& parameter : voice_parameters) {
+            text << "," << get_parameter(record, parameter);
+        }
+        for (int op = 0; op < 4; op++) {
+            for (const VoiceParameter& parameter : operator_parameters) {
+                text << "," << get_parameter(record + operator_offsets[op], parameter);
+            }
+        }
+        text << "\n";
+    }
+    out.clear();
+    append_text(out, text.str());
+}
+
+void render_voice_sysex(const vector<char>& data1, const vector<char>& data2, vector<char>& out) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  One FB-01 "voice data for instrument 1" message per voice, back to back:             //
+    //                                                                                      //
+    //  F0 43 75 00 08 00 00 ......... Sysex header (system channel 1, instrument 1)        //
+    //  01 00 ........................ Packet size (128 bytes)                             //
+    //  128 bytes .................... Voice record, nibblized again (low nibble first)     //
+    //  checksum F7 .................. Two's complement of the data sum, end of sysex       //
+    //////////////////////////////////////////////////////////////////////////////////////////
+
+    out.clear();
+    out.reserve(96 * 139);
+    for (int voice = 0; voice < 96; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        const char header[9] = { '\xF0', '\x43', '\x75', '\x00', '\x08', '\x00', '\x00', '\x01', '\x00' };
+        out.insert(out.end(), header, header + sizeof(header));
+        int sum = 0;
+        for (int i = 0; i < 64; i++) {
+            char low = record[i] & 0x0F;
+            char high = (record[i] >> 4) & 0x0F;
+            out.push_back(low);
+            out.push_back(high);
+            sum += low + high;
+        }
+        out.push_back(static_cast<char>(-sum & 0x7F));
+        out.push_back('\xF7');
+    }
+}
+
+void render_adlib_patch(const vector<char>& data1, const vector<char>& data2, vector<char>& out) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  The SCI AdLib patch (PATCH.003) mirrors the FB-01 one:                               //
+    //                                                                                      //
+    //  $00 :   8900h.......................SCI's resource type identifier header           //
+    //  $02 :   Bank 1 data.................First 48 instruments (28 bytes each)             //
+    //  $542:   ABCDh.......................Seperator bytes between the two banks           //
+    //  $544:   Bank 2 data.................Last 48 instruments (28 bytes each)              //
+    //                                                                                      //
+    //  Each instrument is two 13-byte operator blocks (modulator, then carrier) holding     //
+    //  KSL, MULT, FB, AR, SL, EG-TYP, DR, RR, TL, AM, VIB, KSR, CON, followed by the two    //
+    //  operators' wave select. The CON byte is inverted: 1 means FM, 0 additive.            //
+    //  The resulting file will be exactly 2692 bytes long.                                  //
+    //////////////////////////////////////////////////////////////////////////////////////////
+
+    const int voices = 96;
+
+    // Pick the two operators of every voice: [0] is the OPL modulator, [1] the carrier
+    int selected[2][voices];
+    bool additive[voices];
+    for (int voice = 0; voice < voices; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        int algorithm = get_parameter(record, voice_parameters[VOICE_ALGORITHM]);
+        int level[4];
+        for (int op = 0; op < 4; op++) {
+            level[op] = get_parameter(record + operator_offsets[op], operator_parameters[OP_TOTAL_LEVEL]);
+        }
+
+        // Operators the voice switches off are never picked, unless fewer than two are left on
+        int enabled = get_parameter(record, voice_parameters[VOICE_OPERATOR_ENABLE]);
+        int enabled_count = 0;
+        for (int op = 0; op < 4; op++) {
+            enabled_count += (enabled >> op) & 1;
+        }
+        if (enabled_count < 2) {
+            enabled = 0xF;
+        }
+
+        // Lower total level means louder. Returns the loudest operator in the mask, or -1.
+        auto loudest = [&](int mask, int exclude) {
+            int best = -1;
+            for (int op = 0; op < 4; op++) {
+                if ((mask & (1 << op)) && op != exclude && (best < 0 || level[op] < level[best])) best = op;
+            }
+            return best;
+        };
+
+        int modulator, carrier;
+        if (opl_selection == OPL_SELECT_FIXED) {
+            modulator = opl_fixed_operators[0];
+            carrier = opl_fixed_operators[1];
+        }
+        else if (opl_selection == OPL_SELECT_LOUDEST) {
+            int first = loudest(enabled, -1);
+            int second = loudest(enabled, first);
+            // Keep an existing modulation between the two, otherwise the carrier is the audible one
+            if (algorithm_modulators[algorithm][second] & (1 << first)) {
+                modulator = first;
+                carrier = second;
+            }
+            else if ((algorithm_carriers[algorithm] & (1 << second)) && !(algorithm_carriers[algorithm] & (1 << first))) {
+                modulator = first;
+                carrier = second;
+            }
+            else {
+                modulator = second;
+                carrier = first;
+            }
+        }
+        else {
+            carrier = loudest(algorithm_carriers[algorithm] & enabled, -1);
+            if (carrier < 0) {
+                // Every carrier is switched off; the loudest operator left stands in
+                carrier = loudest(enabled, -1);
+            }
+            modulator = loudest(algorithm_modulators[algorithm][carrier] & enabled, -1);
+            if (modulator < 0) {
+                // The carrier is unmodulated (e.g. algorithm 8), pair it with the next loudest carrier instead
+                modulator = loudest(algorithm_carriers[algorithm] & enabled, carrier);
+            }
+            if (modulator < 0) {
+                modulator = loudest(enabled, carrier);
+            }
+        }
+
+        selected[0][voice] = modulator;
+        selected[1][voice] = carrier;
+        additive[voice] = (algorithm_carriers[algorithm] & (1 << modulator)) != 0;
+    }
+
+    // Gather the parameters of the selected operators into columns, then translate the columns
+    // a field at a time. Working over plain arrays like this lets the compiler vectorize the
+    // per-field conversions across all 96 voices.
+    unsigned char fb01[2][operator_parameter_count][voices];
+    unsigned char feedback[voices], pms[voices], ams[voices];
+    for (int voice = 0; voice < voices; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        for (int i = 0; i < 2; i++) {
+            for (int p = 0; p < operator_parameter_count; p++) {
+                fb01[i][p][voice] = static_cast<unsigned char>(get_parameter(record + operator_offsets[selected[i][voice]], operator_parameters[p]));
+            }
+        }
+        feedback[voice] = static_cast<unsigned char>(get_parameter(record, voice_parameters[VOICE_FEEDBACK]));
+        pms[voice] = static_cast<unsigned char>(get_parameter(record, voice_parameters[VOICE_PMS]));
+        ams[voice] = static_cast<unsigned char>(get_parameter(record, voice_parameters[VOICE_AMS]));
+    }
+
+    // OPL2 has no multiples of 11, 13 and 14; those play 10, 12 and 15
+    static const unsigned char opl_multiple[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 10, 12, 12, 15, 15 };
+
+    unsigned char opl[2][13][voices];
+    for (int i = 0; i < 2; i++) {
+        for (int v = 0; v < voices; v++) opl[i][0][v] = fb01[i][OP_LEVEL_SCALING_DEPTH][v] >> 2;
+        for (int v = 0; v < voices; v++) opl[i][1][v] = opl_multiple[fb01[i][OP_MULTIPLE][v]];
+        for (int v = 0; v < voices; v++) opl[i][2][v] = i == 0 ? feedback[v] : 0;
+        // FB-01 envelope rates run 0-31 against OPL2's 0-15
+        for (int v = 0; v < voices; v++) opl[i][3][v] = fb01[i][OP_ATTACK_RATE][v] >> 1;
+        for (int v = 0; v < voices; v++) opl[i][4][v] = fb01[i][OP_SUSTAIN_LEVEL][v];
+        // OPL2 can only hold the sustain level or keep decaying; hold it when the FB-01 second decay is off
+        for (int v = 0; v < voices; v++) opl[i][5][v] = fb01[i][OP_DECAY2_RATE][v] == 0 ? 1 : 0;
+        for (int v = 0; v < voices; v++) opl[i][6][v] = fb01[i][OP_DECAY1_RATE][v] >> 1;
+        for (int v = 0; v < voices; v++) opl[i][7][v] = fb01[i][OP_RELEASE_RATE][v];
+        // Both chips attenuate in 0.75dB steps, OPL2 just stops at 63
+        for (int v = 0; v < voices; v++) opl[i][8][v] = fb01[i][OP_TOTAL_LEVEL][v] > 63 ? 63 : fb01[i][OP_TOTAL_LEVEL][v];
+        for (int v = 0; v < voices; v++) opl[i][9][v] = (fb01[i][OP_AM_ENABLE][v] && ams[v]) ? 1 : 0;
+        for (int v = 0; v < voices; v++) opl[i][10][v] = pms[v] ? 1 : 0;
+        for (int v = 0; v < voices; v++) opl[i][11][v] = fb01[i][OP_RATE_SCALING][v] >= 2 ? 1 : 0;
+        for (int v = 0; v < voices; v++) opl[i][12][v] = (i == 0 && !additive[v]) ? 1 : 0;
+    }
+
+    out.clear();
+    out.reserve(2 + 2 * 48 * 28 + 2);
+    out.push_back('\x89');
+    out.push_back('\x00');
+    for (int voice = 0; voice < voices; voice++) {
+        if (voice == 48) {
+            out.push_back('\xAB');
+            out.push_back('\xCD');
+        }
+        for (int i = 0; i < 2; i++) {
+            for (int field = 0; field < 13; field++) {
+                out.push_back(static_cast<char>(opl[i][field][voice]));
+            }
+        }
+        // Sine waves for both operators, the only waveform the FB-01 has
+        out.push_back(0);
+        out.push_back(0);
+    }
+}
+
+void parallel_for(int count, const function<void(int)>& body) {
+    // Hand out indices one at a time to a thread per core
+    unsigned int cores = thread::hardware_concurrency();
+    int thread_count = min(count, cores > 0 ? static_cast<int>(cores) : 2);
+    atomic<int> next{ 0 };
+    vector<thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&]() {
+            for (int i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+                body(i);
+            }
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+}
+
+uint64_t hash_voice(const char* record) {
+    // 64-bit FNV-1a over the whole 64-byte voice record
+    return fnv1a_hash(record, 64);
+}
+
+uint64_t fnv1a_hash(const char* data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+void extract_timbre_features(const char* record, float* features) {
+    int algorithm = get_parameter(record, voice_parameters[VOICE_ALGORITHM]);
+    int carriers = algorithm_carriers[algorithm];
+
+    int carrier_count = 0, modulator_count = 0;
+    float modulation = 0, attack = 0, decay = 0, sustain = 0, release = 0, multiple = 0;
+    bool inharmonic = false;
+    for (int op = 0; op < 4; op++) {
+        const char* block = record + operator_offsets[op];
+        multiple += get_parameter(block, operator_parameters[OP_MULTIPLE]) / 15.0f;
+        inharmonic = inharmonic || get_parameter(block, operator_parameters[OP_INHARMONIC]) != 0;
+
+        float level = 1.0f - get_parameter(block, operator_parameters[OP_TOTAL_LEVEL]) / 127.0f;
+        if (!(carriers & (1 << op))) {
+            modulation += level;
+            modulator_count++;
+            continue;
+        }
+        carrier_count++;
+        attack += get_parameter(block, operator_parameters[OP_ATTACK_RATE]) / 31.0f;
+        decay += get_parameter(block, operator_parameters[OP_DECAY1_RATE]) / 31.0f;
+        release += get_parameter(block, operator_parameters[OP_RELEASE_RATE]) / 15.0f;
+        // A carrier that keeps decaying after reaching its sustain level doesn't really sustain
+        float held = (15 - get_parameter(block, operator_parameters[OP_SUSTAIN_LEVEL])) / 15.0f;
+        sustain += held * (1.0f - get_parameter(block, operator_parameters[OP_DECAY2_RATE]) / 31.0f);
+    }
+
+    float feedback = get_parameter(record, voice_parameters[VOICE_FEEDBACK]) / 7.0f;
+    bool vibrato = get_parameter(record, voice_parameters[VOICE_PMD]) > 0;
+
+    features[FEATURE_CARRIERS] = carrier_count / 4.0f;
+    features[FEATURE_BRIGHTNESS] = min(1.0f, 0.8f * (modulator_count ? modulation / modulator_count : 0.0f) + 0.2f * feedback);
+    features[FEATURE_ATTACK] = attack / carrier_count;
+    features[FEATURE_DECAY] = decay / carrier_count;
+    features[FEATURE_SUSTAIN] = sustain / carrier_count;
+    features[FEATURE_RELEASE] = release / carrier_count;
+    features[FEATURE_PITCH] = min(1.0f, multiple / 4 + (inharmonic ? 0.25f : 0.0f));
+    features[FEATURE_VIBRATO] = vibrato ? get_parameter(record, voice_parameters[VOICE_PMS]) / 7.0f : 0.0f;
+}
+
+VoiceMapping classify_voice(const char* record) {
+    float features[FEATURE_COUNT];
+    extract_timbre_features(record, features);
+
+    VoiceMapping best = { 0, -1.0f };
+    for (int r = 0; r < static_cast<int>(sizeof(reference_timbres) / sizeof(reference_timbres[0])); r++) {
+        float distance = 0;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            float difference = features[f] - reference_timbres[r].features[f];
+            distance += difference * difference;
+        }
+        // Features run 0 to 1, so the largest possible distance is sqrt(FEATURE_COUNT)
+        float score = 1.0f - sqrt(distance / FEATURE_COUNT);
+        if (score > best.score) {
+            best.reference = r;
+            best.score = score;
+        }
+    }
+    return best;
+}
+
+void render_voice_map(const vector<char>& data1, const vector<char>& data2, vector<char>& out) {
+    // Classify the 96 voices, skipping any the cache already knows. This runs on the caller's
+    // thread: a voice takes well under a microsecond, and batch and archive modes already
+    // convert pairs in parallel.
+    VoiceMapping mappings[96];
+    for (int voice = 0; voice < 96; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        uint64_t hash = hash_voice(record);
+        if (!voice_map_cache.find(hash, mappings[voice])) {
+            mappings[voice] = classify_voice(record);
+            voice_map_cache.add(hash, mappings[voice]);
+        }
+    }
+
+    ostringstream text;
+    text << "# slot\tmt32\tgm\tscore\tvoice\treference\n";
+    text << fixed << setprecision(3);
+    for (int voice = 0; voice < 96; voice++) {
+        const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        const ReferenceTimbre& reference = reference_timbres[mappings[voice].reference];
+        text << voice << "\t" << reference.mt32 << "\t" << reference.gm << "\t" << mappings[voice].score << "\t"
+             << get_voice_name(record) << "\t" << reference.name << "\n";
+    }
+    out.clear();
+    append_text(out, text.str());
+}
+
+bool VoiceMapCache::open(const string& filename) {
+    // One entry per line: voice hash (hex), reference timbre name, score
+    ifstream in(filename);
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string hash_text, score_text, name;
+        if (!(fields >> hash_text >> score_text) || !getline(fields >> ws, name)) continue;
+        for (int r = 0; r < static_cast<int>(sizeof(reference_timbres) / sizeof(reference_timbres[0])); r++) {
+            if (name == reference_timbres[r].name) {
+                VoiceMapping mapping = { r, static_cast<float>(atof(score_text.c_str())) };
+                entries[strtoull(hash_text.c_str(), nullptr, 16)] = mapping;
+            }
+        }
+    }
+    log.open(filename, ios::app);
+    return log.good();
+}
+
+bool VoiceMapCache::find(uint64_t hash, VoiceMapping& mapping) {
+    lock_guard<mutex> guard(lock);
+    auto entry = entries.find(hash);
+    if (entry == entries.end()) {
+        return false;
+    }
+    mapping = entry->second;
+    return true;
+}
+
+void VoiceMapCache::add(uint64_t hash, const VoiceMapping& mapping) {
+    lock_guard<mutex> guard(lock);
+    if (!log.is_open() || !entries.emplace(hash, mapping).second) {
+        return;
+    }
+    log << hex << setw(16) << setfill('0') << hash << dec << setfill(' ') << " " << mapping.score << " "
+        << reference_timbres[mapping.reference].name << "\n";
+    log.flush();
+}
+
+int run_render(int argc, char* argv[]) {
+    if (argc != 7) {
+        cout << "   usage:  " << argv[0] << "   --render patfile voice note seconds wavfile\n";
+        cout << "           (voice is 0-95, note is a MIDI note number, 60 is middle C)\n";
+        return 1;
+    }
+
+    vector<char> data1, data2;
+    string error;
+    if (!load_patch_file(argv[2], data1, data2, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    int voice = atoi(argv[3]);
+    int note = atoi(argv[4]);
+    double seconds = atof(argv[5]);
+    if (voice < 0 || voice > 95 || note < 0 || note > 127 || seconds <= 0) {
+        cout << "Error: voice must be 0-95, note 0-127 and seconds more than 0" << endl;
+        return 1;
+    }
+
+    const char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+    vector<int16_t> samples;
+    render_note(record, note, seconds, 44100, samples);
+
+    vector<char> image;
+    build_wav_image(samples, 44100, image);
+    ofstream out_file(argv[6], ios::binary);
+    out_file.write(image.data(), image.size());
+    if (!out_file) {
+        cout << "Error: could not write " << argv[6] << endl;
+        return 1;
+    }
+    cout << "Rendered voice " << voice << " (" << get_voice_name(record) << ") to " << argv[6] << endl;
+    return 0;
+}
+
+int run_synth_benchmark(int argc, char* argv[]) {
+    if (argc != 3 && argc != 4) {
+        cout << "   usage:  " << argv[0] << "   --synth-bench patfile [seconds]\n";
+        return 1;
+    }
+
+    vector<char> data1, data2;
+    string error;
+    if (!load_patch_file(argv[2], data1, data2, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    double seconds = argc == 4 ? atof(argv[3]) : 2.0;
+    if (seconds <= 0) {
+        cout << "Error: seconds must be more than 0" << endl;
+        return 1;
+    }
+
+    // Play all 96 voices, eight at a time (one per channel) as a chord, like a busy FB-01 would
+    const int sample_rate = 44100;
+    const int samples = static_cast<int>(seconds * sample_rate);
+    vector<int16_t> buffer(samples);
+    auto start_time = chrono::steady_clock::now();
+    for (int group = 0; group < 12; group++) {
+        Fb01Synth synth(sample_rate);
+        for (int channel = 0; channel < Fb01Synth::channels; channel++) {
+            int voice = group * 8 + channel;
+            synth.set_voice(channel, (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64);
+            synth.note_on(channel, 48 + channel * 3, 100);
+        }
+        synth.render(buffer.data(), samples);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    double audio_seconds = 12 * seconds;
+    cout << "Rendered " << audio_seconds << " seconds of 8-channel audio in " << elapsed.count() << " seconds" << endl;
+    cout << "Realtime factor: " << audio_seconds / elapsed.count() << "x (" << audio_seconds * Fb01Synth::channels / elapsed.count()
+         << " voice-seconds per second)" << endl;
+    return 0;
+}
+
+bool load_patch_file(const string& filename, vector<char>& data1, vector<char>& data2, string& error) {
+    // Reads back a patch written by write_to_file(): header, 48 voices, separator, 48 voices
+    vector<char> image;
+    if (!load_file(filename, image)) {
+        error = "file " + filename + " not found";
+        return false;
+    }
+    if (image.size() != 6148 || image[0] != '\x89' || image[1] != '\x00' || image[3074] != '\xAB' || image[3075] != '\xCD') {
+        error = filename + " is not an SCI FB-01 patch file (6148 bytes, 8900h header, ABCDh separator)";
+        return false;
+    }
+    data1.assign(image.begin() + 2, image.begin() + 3074);
+    data2.assign(image.begin() + 3076, image.end());
+    return true;
+}
+
+void build_wav_image(const vector<int16_t>& samples, int sample_rate, vector<char>& image) {
+    // Canonical 44-byte header for 16-bit mono PCM
+    uint32_t data_size = static_cast<uint32_t>(samples.size() * 2);
+    image.clear();
+    image.reserve(44 + data_size);
+    append_text(image, "RIFF");
+    append_le(image, 36 + data_size, 4);
+    append_text(image, "WAVEfmt ");
+    append_le(image, 16, 4);               // Format chunk size
+    append_le(image, 1, 2);                // PCM
+    append_le(image, 1, 2);                // Mono
+    append_le(image, sample_rate, 4);
+    append_le(image, sample_rate * 2, 4);  // Bytes per second
+    append_le(image, 2, 2);                // Block align
+    append_le(image, 16, 2);               // Bits per sample
+    append_text(image, "data");
+    append_le(image, data_size, 4);
+    for (int16_t sample : samples) {
+        append_le(image, static_cast<uint16_t>(sample), 2);
+    }
+}
+
+void render_note(const char* record, int note, double seconds, int sample_rate, vector<int16_t>& samples) {
+    // Hold the note for the given time, then let it ring out for up to a second after the key is released
+    Fb01Synth synth(sample_rate);
+    synth.set_voice(0, record);
+    synth.note_on(0, note, 100);
+
+    int held = static_cast<int>(seconds * sample_rate);
+    samples.assign(held, 0);
+    synth.render(samples.data(), held);
+    synth.note_off(0);
+
+    const int block = 512;
+    for (int tail = 0; tail < sample_rate && synth.is_active(0); tail += block) {
+        samples.resize(samples.size() + block);
+        synth.render(samples.data() + samples.size() - block, block);
+    }
+}
+
+// Sine table indexed by the top 12 bits of an operator's phase
+static const int sine_bits = 12;
+static const array<int16_t, 1 << sine_bits>& sine_table() {
+    static const array<int16_t, 1 << sine_bits> table = []() {
+        array<int16_t, 1 << sine_bits> entries;
+        for (int i = 0; i < (1 << sine_bits); i++) {
+            entries[i] = static_cast<int16_t>(lround(32767.0 * sin(2.0 * 3.14159265358979323846 * i / (1 << sine_bits))));
+        }
+        return entries;
+    }();
+    return table;
+}
+
+// Linear gain (Q15) for an attenuation in envelope units of 0.09375dB
+static const int attenuation_limit = 2048;
+static const array<int32_t, attenuation_limit>& gain_table() {
+    static const array<int32_t, attenuation_limit> table = []() {
+        array<int32_t, attenuation_limit> entries;
+        for (int i = 0; i < attenuation_limit; i++) {
+            entries[i] = static_cast<int32_t>(lround(32767.0 * pow(10.0, -i * 0.09375 / 20.0)));
+        }
+        entries[attenuation_limit - 1] = 0;
+        return entries;
+    }();
+    return table;
+}
+
+Fb01Synth::Fb01Synth(int sample_rate) : sample_rate(sample_rate) {
+    memset(voices, 0, sizeof(voices));
+    memset(phase, 0, sizeof(phase));
+    memset(increment, 0, sizeof(increment));
+    memset(output, 0, sizeof(output));
+    memset(feedback_history, 0, sizeof(feedback_history));
+    memset(feedback_shift, 0, sizeof(feedback_shift));
+    memset(modulated_by, 0, sizeof(modulated_by));
+    memset(is_carrier, 0, sizeof(is_carrier));
+    memset(level_offset, 0, sizeof(level_offset));
+    memset(sustain_level, 0, sizeof(sustain_level));
+    memset(attack_rate, 0, sizeof(attack_rate));
+    memset(decay1_step, 0, sizeof(decay1_step));
+    memset(decay2_step, 0, sizeof(decay2_step));
+    memset(release_step, 0, sizeof(release_step));
+    for (int op = 0; op < 4; op++) {
+        for (int channel = 0; channel < channels; channel++) {
+            envelope[op][channel] = 1023 << 16;
+            stage[op][channel] = STAGE_OFF;
+        }
+    }
+}
+
+void Fb01Synth::set_voice(int channel, const char* record) {
+    memcpy(voices[channel], record, 64);
+    int algorithm = get_parameter(record, voice_parameters[VOICE_ALGORITHM]);
+    // A switched-off operator is heard neither as a carrier nor through the operators it modulates
+    int enabled = get_parameter(record, voice_parameters[VOICE_OPERATOR_ENABLE]);
+    for (int target = 0; target < 4; target++) {
+        is_carrier[target][channel] = (algorithm_carriers[algorithm] & enabled) >> target & 1;
+        for (int source = 0; source < 4; source++) {
+            modulated_by[target][source][channel] = (algorithm_modulators[algorithm][target] & enabled) >> source & 1;
+        }
+    }
+    // Feedback level 1 is a phase swing of pi/16, each step doubles it up to 4pi at level 7
+    int feedback = get_parameter(record, voice_parameters[VOICE_FEEDBACK]);
+    feedback_shift[channel] = feedback ? feedback + 10 : 0;
+}
+
+int32_t Fb01Synth::decay_step(int rate) const {
+    // Rate 0 never moves. Otherwise the time to fall through the whole 96dB range halves every
+    // four rate steps, from about 20 seconds down to well under a millisecond at rate 63.
+    if (rate <= 0) return 0;
+    double seconds = 20.0 * pow(2.0, -rate / 4.0);
+    return static_cast<int32_t>(min(1023.0 * 65536.0, (1023.0 * 65536.0) / (seconds * sample_rate)) + 1);
+}
+
+int32_t Fb01Synth::attack_coefficient(int rate) const {
+    // The attack is exponential: each sample removes a fixed share (Q16) of the remaining attenuation
+    if (rate <= 0) return 0;
+    if (rate >= 62) return 65536;
+    double seconds = 4.0 * pow(2.0, -rate / 4.0);
+    return static_cast<int32_t>(min(65536.0, 7.0 * 65536.0 / (seconds * sample_rate)) + 1);
+}
+
+void Fb01Synth::note_on(int channel, int note, int velocity) {
+    static const double inharmonic_ratio[4] = { 1.0, 1.41, 1.57, 1.73 };
+    // Detune settings 1-3 raise the pitch by a few cents, 5-7 lower it
+    static const int detune_cents[8] = { 0, 3, 6, 9, 0, -3, -6, -9 };
+
+    const char* record = voices[channel];
+    int key = note + get_parameter(record, voice_parameters[VOICE_TRANSPOSE]);
+    double frequency = 440.0 * pow(2.0, (key - 69) / 12.0);
+    int key_code = min(31, max(0, key / 4));
+
+    for (int op = 0; op < 4; op++) {
+        const char* block = record + operator_offsets[op];
+        int multiple = get_parameter(block, operator_parameters[OP_MULTIPLE]);
+        double ratio = (multiple ? multiple : 0.5) * inharmonic_ratio[get_parameter(block, operator_parameters[OP_INHARMONIC])]
+                     * pow(2.0, detune_cents[get_parameter(block, operator_parameters[OP_DETUNE])] / 1200.0);
+        increment[op][channel] = static_cast<uint32_t>(fmod(frequency * ratio / sample_rate, 1.0) * 4294967296.0);
+        phase[op][channel] = 0;
+
+        // Higher notes run their envelopes faster, more so with a higher rate scaling setting
+        int scaling = key_code >> (3 - get_parameter(block, operator_parameters[OP_RATE_SCALING]));
+        auto scaled_rate = [&](int rate) { return rate ? min(63, 2 * rate + scaling) : 0; };
+        attack_rate[op][channel] = attack_coefficient(scaled_rate(get_parameter(block, operator_parameters[OP_ATTACK_RATE])));
+        decay1_step[op][channel] = decay_step(scaled_rate(get_parameter(block, operator_parameters[OP_DECAY1_RATE])));
+        decay2_step[op][channel] = decay_step(scaled_rate(get_parameter(block, operator_parameters[OP_DECAY2_RATE])));
+        release_step[op][channel] = decay_step(scaled_rate(get_parameter(block, operator_parameters[OP_RELEASE_RATE]) * 2 + 1));
+
+        // Sustain levels are 3dB steps, except the last one which is silence
+        int sustain = get_parameter(block, operator_parameters[OP_SUSTAIN_LEVEL]);
+        sustain_level[op][channel] = (sustain == 15 ? 1023 : sustain * 32) << 16;
+
+        // Total level is in 0.75dB steps (8 envelope units); softer notes are attenuated by the velocity sensitivity
+        int velocity_attenuation = ((127 - velocity) * get_parameter(block, operator_parameters[OP_VELOCITY_SENSITIVITY])) >> 2;
+        level_offset[op][channel] = get_parameter(block, operator_parameters[OP_TOTAL_LEVEL]) * 8 + velocity_attenuation;
+
+        stage[op][channel] = STAGE_ATTACK;
+    }
+    feedback_history[0][channel] = 0;
+    feedback_history[1][channel] = 0;
+}
+
+void Fb01Synth::note_off(int channel) {
+    for (int op = 0; op < 4; op++) {
+        if (stage[op][channel] != STAGE_OFF) {
+            stage[op][channel] = STAGE_RELEASE;
+        }
+    }
+}
+
+bool Fb01Synth::is_active(int channel) const {
+    for (int op = 0; op < 4; op++) {
+        if (is_carrier[op][channel] && stage[op][channel] != STAGE_OFF) return true;
+    }
+    return false;
+}
+
+void Fb01Synth::render(int16_t* out, int samples) {
+    const array<int16_t, 1 << sine_bits>& sine = sine_table();
+    const array<int32_t, attenuation_limit>& gain = gain_table();
+    const int32_t silence = 1023 << 16;
+
+    for (int n = 0; n < samples; n++) {
+        // Envelopes
+        for (int op = 0; op < 4; op++) {
+            for (int channel = 0; channel < channels; channel++) {
+                int32_t& level = envelope[op][channel];
+                switch (stage[op][channel]) {
+                case STAGE_ATTACK:
+                    level -= static_cast<int32_t>((static_cast<int64_t>(level) * attack_rate[op][channel]) >> 16) + (attack_rate[op][channel] ? 1 : 0);
+                    if (level <= 0) {
+                        level = 0;
+                        stage[op][channel] = STAGE_DECAY1;
+                    }
+                    break;
+                case STAGE_DECAY1:
+                    level += decay1_step[op][channel];
+                    if (level >= sustain_level[op][channel]) {
+                        level = sustain_level[op][channel];
+                        stage[op][channel] = STAGE_DECAY2;
+                    }
+                    break;
+                case STAGE_DECAY2:
+                    level = min(silence, level + decay2_step[op][channel]);
+                    break;
+                case STAGE_RELEASE:
+                    level += release_step[op][channel];
+                    if (level >= silence) {
+                        level = silence;
+                        stage[op][channel] = STAGE_OFF;
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+
+        // Operators, OP4 down to OP1, each across all channels
+        int32_t mix = 0;
+        for (int op = 3; op >= 0; op--) {
+            for (int channel = 0; channel < channels; channel++) {
+                int32_t modulation = 0;
+                for (int source = op + 1; source < 4; source++) {
+                    modulation += modulated_by[op][source][channel] * output[source][channel];
+                }
+                uint32_t offset = static_cast<uint32_t>(modulation) << 18;
+                if (op == 3 && feedback_shift[channel]) {
+                    offset = static_cast<uint32_t>(feedback_history[0][channel] + feedback_history[1][channel]) << feedback_shift[channel];
+                }
+
+                int32_t attenuation = min(attenuation_limit - 1, (envelope[op][channel] >> 16) + level_offset[op][channel]);
+                int32_t value = (sine[(phase[op][channel] + offset) >> (32 - sine_bits)] * gain[attenuation]) >> 15;
+                output[op][channel] = value;
+                phase[op][channel] += increment[op][channel];
+                mix += is_carrier[op][channel] * value;
+            }
+        }
+        for (int channel = 0; channel < channels; channel++) {
+            feedback_history[1][channel] = feedback_history[0][channel];
+            feedback_history[0][channel] = output[3][channel];
+        }
+
+        mix >>= 2;
+        out[n] = static_cast<int16_t>(max(-32768, min(32767, mix)));
+    }
+}
+
+int run_previews(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "   usage:  " << argv[0] << "   --previews cachedir source [source ...]\n";
+        cout << "           (sources are patch files or tar/zip archives of bank files)\n";
+        return 1;
+    }
+    string cache_directory = argv[2];
+    auto start_time = chrono::steady_clock::now();
+
+    // Gather the voices, keeping one copy of each distinct record. Anything whose preview is
+    // already in the cache is dropped here, so only new voices get rendered.
+    vector<pair<uint64_t, array<char, 64>>> pending;
+    unordered_map<uint64_t, bool> seen;
+    size_t voice_count = 0, cached_count = 0;
+    int failed = 0;
+    for (int i = 3; i < argc; i++) {
+        string error;
+        bool ok = read_voices_from_source(argv[i], [&](const string&, int, const char* record) {
+            voice_count++;
+            uint64_t hash = hash_voice(record);
+            if (!seen.emplace(hash, true).second) return;
+            if (filesystem::exists(preview_cache_path(cache_directory, hash))) {
+                cached_count++;
+                return;
+            }
+            pending.emplace_back(hash, array<char, 64>());
+            memcpy(pending.back().second.data(), record, 64);
+        }, error);
+        if (!ok) {
+            cout << "Error: " << error << endl;
+            failed++;
+        }
+    }
+
+    cout << voice_count << " voices, " << seen.size() << " distinct, " << cached_count << " already cached, rendering "
+         << pending.size() << endl;
+
+    // Render across all cores. Each preview is written under a temporary name and renamed into
+    // place, so an interrupted run never leaves a truncated file that looks cached.
+    const int sample_rate = 22050;
+    atomic<int> write_failures{ 0 };
+    parallel_for(static_cast<int>(pending.size()), [&](int i) {
+        vector<int16_t> samples;
+        vector<char> image;
+        render_note(pending[i].second.data(), 60, 1.0, sample_rate, samples);
+        build_adpcm_wav_image(samples, sample_rate, image);
+
+        string path = preview_cache_path(cache_directory, pending[i].first);
+        string temporary_path = path + ".tmp";
+        error_code error;
+        filesystem::create_directories(filesystem::path(path).parent_path(), error);
+        ofstream out_file(temporary_path, ios::binary);
+        out_file.write(image.data(), image.size());
+        out_file.close();
+        if (!out_file) {
+            filesystem::remove(temporary_path, error);
+            write_failures++;
+            return;
+        }
+        filesystem::rename(temporary_path, path, error);
+        if (error) {
+            filesystem::remove(temporary_path, error);
+            write_failures++;
+        }
+    });
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    cout << pending.size() - write_failures << " previews rendered in " << elapsed.count() << " seconds";
+    if (write_failures > 0) {
+        cout << ", " << write_failures << " could not be written to " << cache_directory;
+    }
+    cout << endl;
+    return (failed > 0 || write_failures > 0) ? 1 : 0;
+}
+
+bool read_voices_from_source(const string& source, const VoiceHandler& handler, string& error) {
+    // A source is either a patch file (recognized by its size) or an archive of bank files
+    ifstream in(source, ios::binary | ios::ate);
+    if (!in.good()) {
+        error = "file " + source + " not found";
+        return false;
+    }
+    if (in.tellg() == 6148) {
+        vector<char> data1, data2;
+        if (!load_patch_file(source, data1, data2, error)) {
+            return false;
+        }
+        for (int voice = 0; voice < 96; voice++) {
+            handler(source, voice, (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64);
+        }
+        return true;
+    }
+
+    BankPairer pairer([&](const string& name1, vector<char>& raw1, const string& name2, vector<char>& raw2) {
+        if (!validate_bank_data(raw1, name1, 0).ok() || !validate_bank_data(raw2, name2, 1).ok()) {
+            return;
+        }
+        vector<char> data1, data2;
+        extract_packets(raw1, data1);
+        extract_packets(raw2, data2);
+        if (!reorganize_data(data1, data2).ok()) {
+            return;
+        }
+        string origin = source + ":" + name1;
+        for (int voice = 0; voice < 96; voice++) {
+            handler(origin, voice, (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64);
+        }
+    });
+    return read_bank_pairs_from_archive(source, pairer, error);
+}
+
+string preview_cache_path(const string& cache_directory, uint64_t hash) {
+    // Content addressed: <cachedir>/<first two hex digits>/<hash>.wav, keeping directories small
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return cache_directory + "/" + string(name, 2) + "/" + name + ".wav";
+}
+
+void build_adpcm_wav_image(const vector<int16_t>& samples, int sample_rate, vector<char>& image) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  IMA ADPCM (WAVE format 11h), mono, 4 bits per sample in 256-byte blocks. Each block  //
+    //  starts with a plain 16-bit sample and the step index, followed by 504 samples two    //
+    //  to a byte (low nibble first). A quarter of the size of 16-bit PCM, and any player    //
+    //  can decode it.                                                                       //
+    //////////////////////////////////////////////////////////////////////////////////////////
+
+    static const int step_table[89] = {
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+        107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+        876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871,
+        5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+        27086, 29794, 32767
+    };
+    static const int index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+    const int block_align = 256;
+    const int samples_per_block = (block_align - 4) * 2 + 1;
+
+    size_t block_count = (samples.size() + samples_per_block - 1) / samples_per_block;
+    uint32_t data_size = static_cast<uint32_t>(block_count * block_align);
+
+    image.clear();
+    image.reserve(60 + data_size);
+    append_text(image, "RIFF");
+    append_le(image, 52 + data_size, 4);
+    append_text(image, "WAVEfmt ");
+    append_le(image, 20, 4);                 // Format chunk size
+    append_le(image, 0x11, 2);               // IMA ADPCM
+    append_le(image, 1, 2);                  // Mono
+    append_le(image, sample_rate, 4);
+    append_le(image, static_cast<uint32_t>(static_cast<uint64_t>(sample_rate) * block_align / samples_per_block), 4);
+    append_le(image, block_align, 2);
+    append_le(image, 4, 2);                  // Bits per sample
+    append_le(image, 2, 2);                  // Extra format bytes
+    append_le(image, samples_per_block, 2);
+    append_text(image, "fact");
+    append_le(image, 4, 4);
+    append_le(image, static_cast<uint32_t>(samples.size()), 4);
+    append_text(image, "data");
+    append_le(image, data_size, 4);
+
+    int index = 0;
+    for (size_t block = 0; block < block_count; block++) {
+        size_t position = block * samples_per_block;
+        int predictor = samples[position];
+        append_le(image, static_cast<uint16_t>(predictor), 2);
+        image.push_back(static_cast<char>(index));
+        image.push_back(0);
+
+        // Past the end of the samples the last block is padded with silence
+        unsigned char packed = 0;
+        for (int i = 0; i < samples_per_block - 1; i++) {
+            size_t sample_position = position + 1 + i;
+            int sample = sample_position < samples.size() ? samples[sample_position] : 0;
+
+            int step = step_table[index];
+            int difference = sample - predictor;
+            int nibble = 0;
+            if (difference < 0) {
+                nibble = 8;
+                difference = -difference;
+            }
+            int delta = step >> 3;
+            if (difference >= step) { nibble |= 4; difference -= step; delta += step; }
+            step >>= 1;
+            if (difference >= step) { nibble |= 2; difference -= step; delta += step; }
+            step >>= 1;
+            if (difference >= step) { nibble |= 1; delta += step; }
+
+            predictor = max(-32768, min(32767, predictor + ((nibble & 8) ? -delta : delta)));
+            index = max(0, min(88, index + index_table[nibble]));
+
+            if (i & 1) {
+                image.push_back(static_cast<char>(packed | (nibble << 4)));
+            }
+            else {
+                packed = static_cast<unsigned char>(nibble);
+            }
+        }
+    }
+}
+
+int run_render_songs(int argc, char* argv[]) {
+    if (argc < 5) {
+        cout << "   usage:  " << argv[0] << "   --render-songs patfile outdir soundfile [soundfile ...]\n";
+        cout << "           (soundfiles are SCI0 SOUND resources such as SOUND.001, each is written to outdir as a WAV file)\n";
+        return 1;
+    }
+
+    vector<char> data1, data2;
+    string error;
+    if (!load_patch_file(argv[2], data1, data2, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    string output_directory = argv[3];
+    error_code directory_error;
+    filesystem::create_directories(output_directory, directory_error);
+
+    // Every song is independent, so each one gets its own synth and its own core
+    vector<string> sound_files(argv + 4, argv + argc);
+    vector<string> messages(sound_files.size());
+    atomic<int> failed{ 0 };
+    auto start_time = chrono::steady_clock::now();
+    parallel_for(static_cast<int>(sound_files.size()), [&](int i) {
+        vector<char> resource;
+        Sci0Song song;
+        string song_error;
+        if (!load_file(sound_files[i], resource)) {
+            messages[i] = "Error: file " + sound_files[i] + " not found";
+            failed++;
+            return;
+        }
+        if (!parse_sci0_sound(resource.data(), resource.size(), song, song_error)) {
+            messages[i] = "Error: " + sound_files[i] + ": " + song_error;
+            failed++;
+            return;
+        }
+
+        const int sample_rate = 44100;
+        vector<int16_t> samples;
+        vector<char> image;
+        render_song(song, data1, data2, sample_rate, samples);
+        build_wav_image(samples, sample_rate, image);
+
+        string output_filename = output_directory + "/" + filesystem::path(sound_files[i]).filename().string() + ".wav";
+        ofstream out_file(output_filename, ios::binary);
+        out_file.write(image.data(), image.size());
+        if (!out_file) {
+            messages[i] = "Error: could not write " + output_filename;
+            failed++;
+            return;
+        }
+        ostringstream message;
+        message << fixed << setprecision(1) << sound_files[i] << "  ->  " << output_filename << " ("
+                << static_cast<double>(samples.size()) / sample_rate << " seconds)";
+        messages[i] = message.str();
+    });
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    for (const string& message : messages) {
+        cout << message << endl;
+    }
+    cout << endl << sound_files.size() - failed << " songs rendered, " << failed << " failed (" << elapsed.count() << " seconds)" << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+bool parse_sci0_sound(const char* data, size_t size, Sci0Song& song, string& error) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+    // Resource files start with the resource type; resources taken out of a volume don't
+    if (size >= 2 && bytes[0] == 0x84 && bytes[1] == 0x00) {
+        bytes += 2;
+        size -= 2;
+    }
+    if (size < 33) {
+        error = "too short to be an SCI0 sound resource";
+        return false;
+    }
+    for (int channel = 0; channel < 16; channel++) {
+        song.channel_voices[channel] = bytes[1 + channel * 2];
+        song.channel_flags[channel] = bytes[2 + channel * 2];
+    }
+
+    song.events.clear();
+    size_t pos = 33;
+    uint32_t tick = 0;
+    unsigned char running_status = 0;
+    while (pos < size) {
+        // Delta time
+        unsigned char delta = bytes[pos++];
+        while (delta == 0xF8) {
+            tick += 240;
+            if (pos >= size) break;
+            delta = bytes[pos++];
+        }
+        tick += delta;
+        if (pos >= size) break;
+
+        unsigned char status = bytes[pos];
+        if (status & 0x80) {
+            pos++;
+            if (status == 0xFC) {
+                // End of song
+                return true;
+            }
+            if (status == 0xF0) {
+                // Sysex: skip to its end
+                while (pos < size && bytes[pos++] != 0xF7) {}
+                continue;
+            }
+            running_status = status;
+        }
+        else if (!running_status) {
+            error = "event data without a status byte";
+            return false;
+        }
+        status = running_status;
+
+        // Program change and channel pressure have one data byte, every other channel event two
+        int data_length = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+        if (pos + data_length > size) break;
+        SongEvent event = { tick, status, bytes[pos], data_length == 2 ? bytes[pos + 1] : static_cast<unsigned char>(0) };
+        song.events.push_back(event);
+        pos += data_length;
+    }
+
+    // Some songs just stop without an end marker
+    return true;
+}
+
+void render_song(const Sci0Song& song, const vector<char>& data1, const vector<char>& data2, int sample_rate, vector<int16_t>& samples) {
+    // Notes are handed out to the synth's eight channels as they come in, stealing the channel
+    // that has been playing longest when all are busy, the way SCI's FB-01 driver shares out
+    // the instrument's voices
+    Fb01Synth synth(sample_rate);
+    int program[16] = { 0 };
+    int volume[16];
+    int playing_channel[Fb01Synth::channels];
+    int playing_note[Fb01Synth::channels];
+    uint64_t started[Fb01Synth::channels] = { 0 };
+    uint64_t note_count = 0;
+    for (int i = 0; i < 16; i++) volume[i] = 127;
+    for (int i = 0; i < Fb01Synth::channels; i++) playing_channel[i] = playing_note[i] = -1;
+
+    samples.clear();
+    uint32_t rendered_ticks = 0;
+    auto render_until = [&](uint32_t tick) {
+        size_t end = static_cast<size_t>(static_cast<uint64_t>(tick) * sample_rate / sci0_ticks_per_second);
+        if (end > samples.size()) {
+            size_t start = samples.size();
+            samples.resize(end);
+            synth.render(samples.data() + start, static_cast<int>(end - start));
+        }
+        rendered_ticks = tick;
+    };
+
+    // Songs are capped at ten minutes in case the event stream is broken
+    const uint32_t tick_limit = 10 * 60 * sci0_ticks_per_second;
+    for (const SongEvent& event : song.events) {
+        if (event.tick > tick_limit) break;
+        int channel = event.status & 0x0F;
+        if (channel == 15 || !(song.channel_flags[channel] & sci0_fb01_play_mask)) {
+            continue;
+        }
+        render_until(event.tick);
+
+        int type = event.status & 0xF0;
+        if (type == 0x90 && event.data2 > 0) {
+            int slot = 0;
+            for (int i = 0; i < Fb01Synth::channels; i++) {
+                if (playing_note[i] < 0 && !synth.is_active(i)) {
+                    slot = i;
+                    break;
+                }
+                if (started[i] < started[slot]) slot = i;
+            }
+            int voice = program[channel] % 96;
+            synth.set_voice(slot, (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64);
+            synth.note_on(slot, event.data1, event.data2 * volume[channel] / 127);
+            playing_channel[slot] = channel;
+            playing_note[slot] = event.data1;
+            started[slot] = ++note_count;
+        }
+        else if (type == 0x80 || type == 0x90) {
+            for (int i = 0; i < Fb01Synth::channels; i++) {
+                if (playing_channel[i] == channel && playing_note[i] == event.data1) {
+                    synth.note_off(i);
+                    playing_note[i] = -1;
+                }
+            }
+        }
+        else if (type == 0xC0) {
+            program[channel] = event.data1;
+        }
+        else if (type == 0xB0 && event.data1 == 7) {
+            volume[channel] = event.data2;
+        }
+        else if (type == 0xB0 && event.data1 == 123) {
+            // All notes off
+            for (int i = 0; i < Fb01Synth::channels; i++) {
+                if (playing_channel[i] == channel && playing_note[i] >= 0) {
+                    synth.note_off(i);
+                    playing_note[i] = -1;
+                }
+            }
+        }
+    }
+
+    // Release whatever is still held and let it ring out for two seconds
+    for (int i = 0; i < Fb01Synth::channels; i++) {
+        synth.note_off(i);
+    }
+    render_until(rendered_ticks + 2 * sci0_ticks_per_second);
+}
+
+bool MappedFile::open(const string& filename) {
+    close();
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            view = static_cast<const char*>(address);
+            length = static_cast<size_t>(info.st_size);
+            mapped = true;
+            ::close(fd);
+            return true;
+        }
+    }
+    ::close(fd);
+#endif
+    // Empty files can't be mapped, and not every platform can map them at all
+    if (!load_file(filename, contents)) {
+        return false;
+    }
+    view = contents.data();
+    length = contents.size();
+    return true;
+}
+
+void MappedFile::close() {
+#ifndef _WIN32
+    if (mapped) {
+        munmap(const_cast<char*>(view), length);
+    }
+#endif
+    mapped = false;
+    view = nullptr;
+    length = 0;
+    contents.clear();
+}
+
+int run_used_voices(int argc, char* argv[]) {
+    int first_sound = 3;
+    string pack_filename;
+    if (argc >= 5 && strcmp(argv[3], "--pack") == 0) {
+        pack_filename = argv[4];
+        first_sound = 5;
+    }
+    if (argc <= first_sound) {
+        cout << "   usage:  " << argv[0] << "   --used-voices patfile [--pack outpatfile] soundfile [soundfile ...]\n";
+        cout << "           (lists the voices the game's SOUND resources play on the FB-01; --pack writes a patch with the\n";
+        cout << "            used voices moved to the front and a .remap table of old to new program numbers)\n";
+        return 1;
+    }
+
+    vector<char> data1, data2;
+    string error;
+    if (!load_patch_file(argv[2], data1, data2, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+
+    // Every sound file is mapped and scanned once, in parallel, into its own usage bitmap
+    vector<string> sound_files(argv + first_sound, argv + argc);
+    vector<VoiceUsage> song_usage(sound_files.size());
+    vector<string> errors(sound_files.size());
+    parallel_for(static_cast<int>(sound_files.size()), [&](int i) {
+        MappedFile file;
+        Sci0Song song;
+        memset(&song_usage[i], 0, sizeof(VoiceUsage));
+        if (!file.open(sound_files[i])) {
+            errors[i] = "file " + sound_files[i] + " not found";
+            return;
+        }
+        if (!parse_sci0_sound(file.data(), file.size(), song, errors[i])) {
+            errors[i] = sound_files[i] + ": " + errors[i];
+            return;
+        }
+        scan_used_voices(song, song_usage[i]);
+    });
+
+    VoiceUsage usage;
+    memset(&usage, 0, sizeof(usage));
+    int slot_songs[96] = { 0 };
+    int scanned = 0;
+    for (size_t i = 0; i < sound_files.size(); i++) {
+        if (!errors[i].empty()) {
+            cout << "Error: " << errors[i] << endl;
+            continue;
+        }
+        scanned++;
+        bool slot_used[96] = { false };
+        for (int channel = 0; channel < 16; channel++) {
+            for (int program = 0; program < 128; program++) {
+                if (song_usage[i].programs[channel][program / 64] >> (program % 64) & 1) {
+                    slot_used[program % 96] = true;
+                }
+            }
+            usage.programs[channel][0] |= song_usage[i].programs[channel][0];
+            usage.programs[channel][1] |= song_usage[i].programs[channel][1];
+        }
+        for (int slot = 0; slot < 96; slot++) {
+            slot_songs[slot] += slot_used[slot];
+        }
+    }
+    cout << scanned << " of " << sound_files.size() << " sound resources scanned" << endl << endl;
+
+    cout << "Programs played per channel:" << endl;
+    for (int channel = 0; channel < 16; channel++) {
+        string programs;
+        for (int program = 0; program < 128; program++) {
+            if (usage.programs[channel][program / 64] >> (program % 64) & 1) {
+                programs += " " + to_string(program);
+            }
+        }
+        if (!programs.empty()) {
+            cout << "  channel " << setw(2) << channel + 1 << ":" << programs << endl;
+        }
+    }
+
+    cout << endl << "Voices used:" << endl;
+    vector<int> used_slots, unused_slots;
+    for (int slot = 0; slot < 96; slot++) {
+        const char* record = (slot < 48 ? data1.data() : data2.data()) + (slot % 48) * 64;
+        if (slot_songs[slot] > 0) {
+            cout << "  " << setw(2) << slot << "  " << left << setw(8) << get_voice_name(record) << right << "  in " << slot_songs[slot] << " songs" << endl;
+            used_slots.push_back(slot);
+        }
+        else {
+            unused_slots.push_back(slot);
+        }
+    }
+    cout << endl << unused_slots.size() << " of 96 slots unused:";
+    for (int slot : unused_slots) {
+        cout << " " << slot;
+    }
+    cout << endl;
+
+    if (pack_filename.empty()) {
+        return 0;
+    }
+
+    // Used voices go first, in their original order, followed by the unused ones, so slots
+    // from used_slots.size() onwards are free for new voices
+    vector<int> order(used_slots);
+    order.insert(order.end(), unused_slots.begin(), unused_slots.end());
+    vector<char> packed1(48 * 64), packed2(48 * 64);
+    ostringstream remap;
+    for (int slot = 0; slot < 96; slot++) {
+        int source = order[slot];
+        const char* record = (source < 48 ? data1.data() : data2.data()) + (source % 48) * 64;
+        memcpy((slot < 48 ? packed1.data() : packed2.data()) + (slot % 48) * 64, record, 64);
+        if (slot < static_cast<int>(used_slots.size())) {
+            remap << source << " " << slot << "\n";
+        }
+    }
+    string remap_filename = strip_extension(pack_filename) + ".remap";
+    string remap_text = remap.str();
+    Result result = write_to_file(packed1, packed2, pack_filename.c_str());
+    result.merge(output_committer.write(remap_filename, vector<char>(remap_text.begin(), remap_text.end())));
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    cout << endl << "Packed patch written to " << pack_filename << ", program remap table to " << remap_filename << endl;
+    cout << "Slots " << used_slots.size() << " to 95 are free for new voices." << endl;
+    return 0;
+}
+
+void scan_used_voices(const Sci0Song& song, VoiceUsage& usage) {
+    // A program only counts once a note is played with it on a channel the FB-01 plays, so
+    // program changes that are overridden before any note don't keep a voice alive
+    int program[16] = { 0 };
+    for (const SongEvent& event : song.events) {
+        int channel = event.status & 0x0F;
+        if (channel == 15 || !(song.channel_flags[channel] & sci0_fb01_play_mask)) {
+            continue;
+        }
+        int type = event.status & 0xF0;
+        if (type == 0xC0) {
+            program[channel] = event.data1 & 0x7F;
+        }
+        else if (type == 0x90 && event.data2 > 0) {
+            usage.programs[channel][program[channel] / 64] |= 1ULL << (program[channel] % 64);
+        }
+    }
+}
+
+void normalize_voices(vector<char>& data1, vector<char>& data2, bool parallel) {
+    // Only the carriers' total levels change, so the timbre set by the modulators stays as it
+    // is. The synth's output is only roughly linear in carrier level (feedback, envelopes and
+    // carriers already at full volume get in the way), so the level is measured again after
+    // each adjustment. A single conversion spreads the voices over all cores; the batch, archive
+    // and watch workers pass parallel = false, since they already keep the cores busy with pairs.
+    auto normalize = [&](int voice) {
+        char* record = (voice < 48 ? data1.data() : data2.data()) + (voice % 48) * 64;
+        int carriers = algorithm_carriers[get_parameter(record, voice_parameters[VOICE_ALGORITHM])];
+        for (int pass = 0; pass < 3; pass++) {
+            double loudness = measure_loudness(record);
+            if (std::isinf(loudness)) {
+                return;   // Silent voices are left alone
+            }
+            int steps = static_cast<int>(lround((loudness - normalize_target) / total_level_step));
+            if (steps == 0) {
+                return;
+            }
+            for (int op = 0; op < 4; op++) {
+                if (carriers & (1 << op)) {
+                    int level = get_parameter(record + operator_offsets[op], operator_parameters[OP_TOTAL_LEVEL]) + steps;
+                    set_parameter(record + operator_offsets[op], operator_parameters[OP_TOTAL_LEVEL], max(0, min(127, level)));
+                }
+            }
+        }
+    };
+    if (parallel) {
+        parallel_for(96, normalize);
+    }
+    else {
+        for (int voice = 0; voice < 96; voice++) {
+            normalize(voice);
+        }
+    }
+}
+
+double measure_loudness(const char* record) {
+    // RMS level of a half second middle C while the key is held, in dBFS
+    const int sample_rate = 22050;
+    const int held = sample_rate / 2;
+    vector<int16_t> samples;
+    render_note(record, 60, 0.5, sample_rate, samples);
+    double sum = 0.0;
+    for (int i = 0; i < held; i++) {
+        sum += static_cast<double>(samples[i]) * samples[i];
+    }
+    if (sum == 0.0) {
+        return -HUGE_VAL;
+    }
+    return 10.0 * log10(sum / held / (32768.0 * 32768.0));
+}
+
+int run_import(int argc, char* argv[], const VoiceImporter& importer, const char* dump_types) {
+    if (argc < 4) {
+        cout << "   usage:  " << argv[0] << "   " << argv[1] << " patfile dumpfile [dumpfile ...]\n";
+        cout << "           (dumpfiles are " << dump_types << ";\n";
+        cout << "            their voices fill the patch's 96 slots in order)\n";
+        return 1;
+    }
+
+    vector<char> records;
+    int failed = 0;
+    for (int i = 3; i < argc; i++) {
+        vector<char> raw;
+        string error;
+        size_t before = records.size();
+        if (!load_file(argv[i], raw)) {
+            cout << "Error: file " << argv[i] << " not found" << endl;
+            failed++;
+        }
+        else if (!importer(raw, argv[i], records, error)) {
+            cout << "Error: " << error << endl;
+            failed++;
+        }
+        else {
+            cout << argv[i] << ": " << (records.size() - before) / 64 << " voices" << endl;
+        }
+    }
+
+    int voice_count = static_cast<int>(records.size() / 64);
+    if (voice_count > 96) {
+        cout << "Only the first 96 of " << voice_count << " voices fit in the patch." << endl;
+        voice_count = 96;
+    }
+
+    // Slots left over get the TX81Z family's initial voice: a plain sine on OP1
+    if (voice_count < 96) {
+        vector<unsigned char> init(vced_size, 0);
+        for (int block = 0; block < 4; block++) {
+            unsigned char* op = &init[block * vced_operator_size];
+            op[0] = 31;                                     // AR
+            op[1] = 31;                                     // D1R
+            op[3] = 15;                                     // RR
+            op[4] = 15;                                     // D1L
+            op[10] = four_op_operator_order[block] == 0 ? 90 : 0;   // OUT
+            op[11] = 4;                                     // CRS: ratio 1.00
+            op[12] = 3;                                     // DET: none
+        }
+        init[54] = 35;                                      // LFS
+        init[62] = 24;                                      // TRPS: none
+        init[64] = 4;                                       // PBR
+        memcpy(&init[vced_name], "INIT VOICE", 10);
+        vector<char> init_record(64);
+        convert_4op_voices(init, 1, init_record.data());
+        records.resize(voice_count * 64);
+        for (int slot = voice_count; slot < 96; slot++) {
+            records.insert(records.end(), init_record.begin(), init_record.end());
+        }
+    }
+
+    vector<char> data1(records.begin(), records.begin() + 48 * 64);
+    vector<char> data2(records.begin() + 48 * 64, records.begin() + 96 * 64);
+    if (normalize_levels) {
+        normalize_voices(data1, data2, true);
+    }
+    Result result = write_to_file(data1, data2, argv[2]);
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    cout << endl << "SCI FB-01 Patch created with " << voice_count << " imported voices"
+         << (failed ? ", some dumps could not be read." : ".") << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+bool read_4op_voices(const vector<char>& raw, const string& filename, vector<char>& records, string& error) {
+    // A dump file may hold several sysex messages (the TX81Z sends its extra ACED parameters
+    // before each VCED voice); messages other than VMEM and VCED are skipped
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(raw.data());
+    size_t size = raw.size();
+    int found = 0;
+    for (size_t pos = 0; pos < size; pos++) {
+        if (bytes[pos] != 0xF0) continue;
+        size_t end = pos + 1;
+        while (end < size && bytes[end] != 0xF7) end++;
+        if (end >= size) break;
+
+        const unsigned char* message = bytes + pos;
+        size_t length = end - pos + 1;
+        if (length >= 8 && message[1] == 0x43 && (message[2] & 0xF0) == 0x00) {
+            int format = message[3];
+            size_t data_size = (static_cast<size_t>(message[4]) << 7) | message[5];
+            bool vmem = format == 0x04 && data_size == 32 * vmem_voice_size;
+            bool vced = format == 0x03 && data_size == vced_size;
+            if ((vmem || vced) && length == data_size + 8) {
+                int sum = 0;
+                for (size_t i = 0; i <= data_size; i++) {
+                    sum += message[6 + i];
+                }
+                if (sum & 0x7F) {
+                    error = filename + ": checksum error in a " + (vmem ? "VMEM" : "VCED") + " dump";
+                    return false;
+                }
+
+                int count = vmem ? 32 : 1;
+                vector<unsigned char> columns;
+                if (vmem) {
+                    unpack_vmem_voices(message + 6, count, columns);
+                }
+                else {
+                    columns.assign(message + 6, message + 6 + vced_size);
+                }
+                size_t first = records.size();
+                records.resize(first + count * 64);
+                convert_4op_voices(columns, count, records.data() + first);
+                found++;
+            }
+        }
+        pos = end;
+    }
+
+    if (!found) {
+        error = filename + " holds no TX81Z / DX21 / DX27 / DX100 VMEM or VCED dump";
+        return false;
+    }
+    return true;
+}
+
+void unpack_vmem_voices(const unsigned char* packed, int count, vector<unsigned char>& vced) {
+    // Unpacks into VCED layout, one column per parameter: vced[parameter * count + voice]
+    vced.assign(vced_size * count, 0);
+    auto unpack = [&](const PackedField& field, int vced_base, int packed_base) {
+        unsigned char* column = &vced[(vced_base + field.vced) * count];
+        for (int voice = 0; voice < count; voice++) {
+            column[voice] = (packed[voice * vmem_voice_size + packed_base + field.offset] >> field.shift) & ((1 << field.bits) - 1);
+        }
+    };
+    for (int block = 0; block < 4; block++) {
+        for (const PackedField& field : vmem_operator_fields) {
+            unpack(field, block * vced_operator_size, block * 10);
+        }
+    }
+    for (const PackedField& field : vmem_voice_fields) {
+        unpack(field, 0, 0);
+    }
+    for (int i = 0; i < 10; i++) {
+        unpack(PackedField{ vced_name + i, 57 + i, 0, 7 }, 0, 0);
+    }
+}
+
+// Multiple and inharmonic (DT2) setting of each 4-op frequency ratio. The 64 ratios are
+// every multiple (0.5, 1 to 15) times each inharmonic factor (1, 1.41, 1.57, 1.73), in order.
+static const array<pair<int, int>, 64>& four_op_frequencies() {
+    static const array<pair<int, int>, 64> table = []() {
+        const double factors[4] = { 1.0, 1.41, 1.57, 1.73 };
+        vector<pair<double, pair<int, int>>> ratios;
+        for (int multiple = 0; multiple < 16; multiple++) {
+            for (int inharmonic = 0; inharmonic < 4; inharmonic++) {
+                ratios.push_back({ (multiple ? multiple : 0.5) * factors[inharmonic], { multiple, inharmonic } });
+            }
+        }
+        sort(ratios.begin(), ratios.end());
+        array<pair<int, int>, 64> entries;
+        for (int i = 0; i < 64; i++) {
+            entries[i] = ratios[i].second;
+        }
+        return entries;
+    }();
+    return table;
+}
+
+void convert_4op_voices(const vector<unsigned char>& vced, int count, char* records) {
+    // One pass over the whole bank per table entry: each parameter is converted for every
+    // voice at once, then stored into the records
+    const auto& frequencies = four_op_frequencies();
+    vector<int> values(count);
+
+    auto convert = [&](const FourOpMapping& mapping, const VoiceParameter& target, int source_base, int operator_offset) {
+        const unsigned char* column = &vced[(source_base + mapping.source) * count];
+        int limit = (1 << target.bits) - 1;
+        for (int voice = 0; voice < count; voice++) {
+            int value = min(static_cast<int>(column[voice]), mapping.range);
+            switch (mapping.conversion) {
+            case FOUR_OP_COPY:         break;
+            case FOUR_OP_SCALE:        value = (value * limit + mapping.range / 2) / mapping.range; break;
+            case FOUR_OP_INVERT:       value = mapping.range - value; break;
+            case FOUR_OP_OUTPUT_LEVEL: value = output_level_attenuation(value); break;
+            case FOUR_OP_MULTIPLE:     value = frequencies[value].first; break;
+            case FOUR_OP_INHARMONIC:   value = frequencies[value].second; break;
+            case FOUR_OP_DETUNE:       value = value >= 3 ? value - 3 : 7 - value; break;
+            case FOUR_OP_TRANSPOSE:    value -= 24; break;
+            }
+            values[voice] = value;
+        }
+        for (int voice = 0; voice < count; voice++) {
+            set_parameter(records + voice * 64 + operator_offset, target, values[voice]);
+        }
+    };
+
+    memset(records, 0, count * 64);
+    for (int voice = 0; voice < count; voice++) {
+        char* record = records + voice * 64;
+        for (int i = 0; i < 7; i++) {
+            unsigned char c = vced[(vced_name + i) * count + voice];
+            record[i] = c >= 0x20 && c <= 0x7E ? static_cast<char>(c) : ' ';
+        }
+        set_parameter(record, voice_parameters[VOICE_OPERATOR_ENABLE], 0xF);
+    }
+    for (const FourOpMapping& mapping : four_op_voice_mappings) {
+        convert(mapping, voice_parameters[mapping.target], 0, 0);
+    }
+    for (int block = 0; block < 4; block++) {
+        for (const FourOpMapping& mapping : four_op_operator_mappings) {
+            convert(mapping, operator_parameters[mapping.target], block * vced_operator_size, operator_offsets[four_op_operator_order[block]]);
+        }
+    }
+}
+
+int output_level_attenuation(int level) {
+    // Yamaha's 0-99 output and envelope levels to attenuation in 0.75dB steps (total level
+    // units). The scale is linear in dB from 20 up; below that it falls away faster.
+    static const int low_levels[20] = { 127, 122, 118, 114, 110, 107, 104, 102, 100, 98, 96, 94, 92, 90, 88, 86, 85, 84, 82, 81 };
+    level = max(0, min(99, level));
+    return level >= 20 ? 99 - level : low_levels[level];
+}
+
+bool read_dx7_voices(const vector<char>& raw, const string& filename, vector<char>& records, string& error) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(raw.data());
+    size_t size = raw.size();
+    int found = 0;
+    for (size_t pos = 0; pos + 4104 <= size; pos++) {
+        const unsigned char* message = bytes + pos;
+        if (message[0] != 0xF0 || message[1] != 0x43 || (message[2] & 0xF0) != 0x00 || message[3] != 0x09 ||
+            message[4] != 0x20 || message[5] != 0x00 || message[4103] != 0xF7) {
+            continue;
+        }
+        int sum = 0;
+        for (int i = 0; i <= 32 * dx7_voice_size; i++) {
+            sum += message[6 + i];
+        }
+        if (sum & 0x7F) {
+            error = filename + ": checksum error in a DX7 bank dump";
+            return false;
+        }
+
+        // Each voice's search is independent and takes a few dozen renders, so they all run at once
+        size_t first = records.size();
+        records.resize(first + 32 * 64);
+        parallel_for(32, [&](int i) {
+            Dx7Voice voice;
+            unpack_dx7_voice(message + 6 + i * dx7_voice_size, voice);
+            reduce_dx7_voice(voice, records.data() + first + i * 64);
+        });
+        found++;
+        pos += 4103;
+    }
+
+    if (!found) {
+        error = filename + " holds no DX7 32-voice bank dump";
+        return false;
+    }
+    return true;
+}
+
+void unpack_dx7_voice(const unsigned char* packed, Dx7Voice& voice) {
+    for (int block = 0; block < 6; block++) {
+        const unsigned char* data = packed + block * 17;
+        Dx7Operator& op = voice.operators[5 - block];
+        for (int i = 0; i < 4; i++) {
+            op.rates[i] = min(99, data[i] & 0x7F);
+            op.levels[i] = min(99, data[4 + i] & 0x7F);
+        }
+        op.level_scaling_depth = min(99, max(data[9] & 0x7F, data[10] & 0x7F));
+        op.rate_scaling = data[12] & 0x07;
+        op.detune = min(14, (data[12] >> 3) & 0x0F);
+        op.am_sensitivity = data[13] & 0x03;
+        op.velocity_sensitivity = (data[13] >> 2) & 0x07;
+        op.output_level = min(99, data[14] & 0x7F);
+        op.fixed_frequency = data[15] & 0x01;
+        op.coarse = (data[15] >> 1) & 0x1F;
+        op.fine = min(99, data[16] & 0x7F);
+    }
+    voice.algorithm = packed[110] & 0x1F;
+    voice.feedback = packed[111] & 0x07;
+    voice.lfo_speed = min(99, packed[112] & 0x7F);
+    voice.pmd = min(99, packed[114] & 0x7F);
+    voice.amd = min(99, packed[115] & 0x7F);
+    voice.lfo_sync = packed[116] & 0x01;
+    voice.lfo_waveform = min(5, (packed[116] >> 1) & 0x07);
+    voice.pms = (packed[116] >> 4) & 0x07;
+    voice.transpose = min(48, packed[117] & 0x7F);
+    memcpy(voice.name, packed + 118, 10);
+}
+
+// Attenuation of a DX7 operator at the end of its attack, in 0.75dB steps
+static int dx7_peak_attenuation(const Dx7Operator& op) {
+    return min(127, output_level_attenuation(op.output_level) + output_level_attenuation(op.levels[0]));
+}
+
+// Frequency of a DX7 operator relative to the played note; fixed frequencies are taken relative to middle C
+static double dx7_frequency_ratio(const Dx7Operator& op) {
+    if (op.fixed_frequency) {
+        return pow(10.0, (op.coarse & 3) + op.fine / 100.0) / 261.63;
+    }
+    return (op.coarse ? op.coarse : 0.5) * (1.0 + op.fine / 100.0);
+}
+
+void reduce_dx7_voice(const Dx7Voice& voice, char* record) {
+    const Dx7Algorithm& dx7 = dx7_algorithms[voice.algorithm];
+    double amplitude[6];
+    for (int op = 0; op < 6; op++) {
+        amplitude[op] = pow(10.0, -dx7_peak_attenuation(voice.operators[op]) * total_level_step / 20.0);
+    }
+
+    // Structural search over every set of four operators, every order and every FB-01
+    // algorithm. Dropped operators cost their level; a dropped operator's modulators are
+    // passed on to the operators it modulated. Every modulation or carrier that the FB-01
+    // algorithm adds or loses costs the level of the operator concerned.
+    vector<Dx7Reduction> candidates;
+    for (int mask = 0; mask < 64; mask++) {
+        int kept_count = 0;
+        for (int op = 0; op < 6; op++) kept_count += (mask >> op) & 1;
+        if (kept_count != 4) continue;
+
+        int modulators[6];
+        double dropped = 0.0;
+        for (int op = 0; op < 6; op++) {
+            int sources = dx7.modulators[op];
+            while (sources & ~mask) {
+                int removed = sources & ~mask;
+                sources &= mask;
+                for (int r = 0; r < 6; r++) {
+                    if (removed & (1 << r)) sources |= dx7.modulators[r];
+                }
+            }
+            modulators[op] = sources;
+            if (!(mask & (1 << op))) dropped += amplitude[op];
+        }
+
+        Dx7Reduction reduction;
+        for (int op = 0, f = 0; op < 6; op++) {
+            if (mask & (1 << op)) reduction.kept[f++] = op;
+        }
+        do {
+            for (int algorithm = 0; algorithm < 8; algorithm++) {
+                double cost = dropped;
+                for (int f = 0; f < 4; f++) {
+                    int target = reduction.kept[f];
+                    if (((dx7.carriers >> target) & 1) != ((algorithm_carriers[algorithm] >> f) & 1)) {
+                        cost += amplitude[target];
+                    }
+                    for (int g = 0; g < 4; g++) {
+                        int source = reduction.kept[g];
+                        if (g != f && ((modulators[target] >> source) & 1) != ((algorithm_modulators[algorithm][f] >> g) & 1)) {
+                            cost += amplitude[source];
+                        }
+                    }
+                }
+                // Only OP4 has feedback on the FB-01
+                if (voice.feedback && (mask & (1 << dx7.feedback)) && reduction.kept[3] != dx7.feedback) {
+                    cost += amplitude[dx7.feedback] * voice.feedback / 7.0;
+                }
+                reduction.algorithm = algorithm;
+                reduction.cost = cost;
+                candidates.push_back(reduction);
+            }
+        } while (next_permutation(reduction.kept, reduction.kept + 4));
+    }
+    int count = min(dx7_reduction_candidates, static_cast<int>(candidates.size()));
+    partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+                 [](const Dx7Reduction& a, const Dx7Reduction& b) { return a.cost < b.cost; });
+
+    // Render the best fits with their envelopes held at the peak and compare their spectra
+    // with the DX7 voice's at the same point
+    const int sample_rate = 22050;
+    const int window_start = 2048;
+    const int window_size = 4096;
+    const int note = 60;
+    vector<double> reference, reference_spectrum;
+    render_dx7_reference(voice, note, sample_rate, window_start + window_size, reference);
+    reference.erase(reference.begin(), reference.begin() + window_start);
+    compute_spectrum(reference, reference_spectrum);
+
+    int best = 0;
+    double best_distance = HUGE_VAL;
+    for (int i = 0; i < count; i++) {
+        char candidate[64];
+        vector<int16_t> rendered;
+        build_dx7_record(voice, candidates[i], true, candidate);
+        render_note(candidate, note, static_cast<double>(window_start + window_size) / sample_rate, sample_rate, rendered);
+        vector<double> window(rendered.begin() + window_start, rendered.begin() + window_start + window_size);
+        vector<double> spectrum;
+        compute_spectrum(window, spectrum);
+
+        double similarity = 0.0;
+        for (size_t bin = 0; bin < spectrum.size(); bin++) {
+            similarity += spectrum[bin] * reference_spectrum[bin];
+        }
+        double distance = 1.0 - similarity;
+        if (distance < best_distance - 1e-9) {
+            best_distance = distance;
+            best = i;
+        }
+    }
+    build_dx7_record(voice, candidates[best], false, record);
+}
+
+void build_dx7_record(const Dx7Voice& voice, const Dx7Reduction& reduction, bool held, char* record) {
+    // held: every operator stays at its peak level, for comparing timbres
+    static const int lfo_waveforms[6] = { 2, 0, 0, 1, 2, 3 };   // Triangle, saw down, saw up, square, sine, S/H
+    static const double inharmonic_ratio[4] = { 1.0, 1.41, 1.57, 1.73 };
+    auto scale = [](int value, int range, int limit) { return (value * limit + range / 2) / range; };
+
+    memset(record, 0, 64);
+    for (int i = 0; i < 7; i++) {
+        char c = voice.name[i];
+        record[i] = c >= 0x20 && c <= 0x7E ? c : ' ';
+    }
+    int ams = 0;
+    for (int f = 0; f < 4; f++) {
+        ams = max(ams, voice.operators[reduction.kept[f]].am_sensitivity);
+    }
+    set_parameter(record, voice_parameters[VOICE_OPERATOR_ENABLE], 0xF);
+    set_parameter(record, voice_parameters[VOICE_ALGORITHM], reduction.algorithm);
+    set_parameter(record, voice_parameters[VOICE_FEEDBACK], reduction.kept[3] == dx7_algorithms[voice.algorithm].feedback ? voice.feedback : 0);
+    set_parameter(record, voice_parameters[VOICE_LFO_SPEED], scale(voice.lfo_speed, 99, 255));
+    set_parameter(record, voice_parameters[VOICE_PMD], scale(voice.pmd, 99, 127));
+    set_parameter(record, voice_parameters[VOICE_AMD], scale(voice.amd, 99, 127));
+    set_parameter(record, voice_parameters[VOICE_LFO_SYNC], voice.lfo_sync);
+    set_parameter(record, voice_parameters[VOICE_LFO_WAVEFORM], lfo_waveforms[voice.lfo_waveform]);
+    set_parameter(record, voice_parameters[VOICE_PMS], voice.pms);
+    set_parameter(record, voice_parameters[VOICE_AMS], ams);
+    set_parameter(record, voice_parameters[VOICE_TRANSPOSE], voice.transpose - 24);
+    set_parameter(record, voice_parameters[VOICE_PITCHBEND_RANGE], 2);
+
+    for (int f = 0; f < 4; f++) {
+        const Dx7Operator& op = voice.operators[reduction.kept[f]];
+        char* block = record + operator_offsets[f];
+
+        // Nearest of the FB-01's 64 multiple and inharmonic combinations
+        double ratio = dx7_frequency_ratio(op);
+        int best_multiple = 1, best_inharmonic = 0;
+        double best_error = HUGE_VAL;
+        for (int multiple = 0; multiple < 16; multiple++) {
+            for (int inharmonic = 0; inharmonic < 4; inharmonic++) {
+                double error = fabs(log((multiple ? multiple : 0.5) * inharmonic_ratio[inharmonic] / ratio));
+                if (error < best_error) {
+                    best_error = error;
+                    best_multiple = multiple;
+                    best_inharmonic = inharmonic;
+                }
+            }
+        }
+        set_parameter(block, operator_parameters[OP_MULTIPLE], best_multiple);
+        set_parameter(block, operator_parameters[OP_INHARMONIC], best_inharmonic);
+        int detune = op.detune - 7;
+        int magnitude = (abs(detune) * 3 + 3) / 7;
+        set_parameter(block, operator_parameters[OP_DETUNE], detune >= 0 || !magnitude ? magnitude : 4 + magnitude);
+
+        int peak = dx7_peak_attenuation(op);
+        set_parameter(block, operator_parameters[OP_TOTAL_LEVEL], peak);
+        set_parameter(block, operator_parameters[OP_AM_ENABLE], op.am_sensitivity > 0);
+        if (held) {
+            set_parameter(block, operator_parameters[OP_ATTACK_RATE], 31);
+            set_parameter(block, operator_parameters[OP_RELEASE_RATE], 15);
+            continue;
+        }
+
+        // The DX7 envelope rises to L1, moves to L2 and then L3, where it sustains. The FB-01
+        // one decays from its peak to the sustain level at D1R; that decay takes R2, or R3
+        // if L2 is no different from L1.
+        int sustain = min(127, output_level_attenuation(op.output_level) + output_level_attenuation(op.levels[2])) - peak;
+        set_parameter(block, operator_parameters[OP_ATTACK_RATE], scale(op.rates[0], 99, 31));
+        set_parameter(block, operator_parameters[OP_DECAY1_RATE], scale(op.levels[1] != op.levels[0] ? op.rates[1] : op.rates[2], 99, 31));
+        set_parameter(block, operator_parameters[OP_SUSTAIN_LEVEL], op.levels[2] == 0 ? 15 : min(14, (max(0, sustain) + 2) / 4));
+        set_parameter(block, operator_parameters[OP_RELEASE_RATE], scale(op.rates[3], 99, 15));
+        set_parameter(block, operator_parameters[OP_VELOCITY_SENSITIVITY], op.velocity_sensitivity);
+        set_parameter(block, operator_parameters[OP_RATE_SCALING], op.rate_scaling / 2);
+        set_parameter(block, operator_parameters[OP_LEVEL_SCALING_DEPTH], scale(op.level_scaling_depth, 99, 15));
+    }
+}
+
+void render_dx7_reference(const Dx7Voice& voice, int note, int sample_rate, int count, vector<double>& samples) {
+    // A plain six operator phase modulation render with every operator held at its peak level.
+    // Modulation and feedback depths match the FB-01 engine's, so the two can be compared.
+    const Dx7Algorithm& dx7 = dx7_algorithms[voice.algorithm];
+    const double pi = 3.14159265358979323846;
+    double frequency = 440.0 * pow(2.0, (note + voice.transpose - 24 - 69) / 12.0);
+    double phase[6] = { 0 }, increment[6], amplitude[6], output[6] = { 0 };
+    for (int op = 0; op < 6; op++) {
+        const Dx7Operator& dx7_op = voice.operators[op];
+        double ratio = dx7_frequency_ratio(dx7_op);
+        increment[op] = (dx7_op.fixed_frequency ? ratio * 261.63 : frequency * ratio) / sample_rate;
+        amplitude[op] = pow(10.0, -dx7_peak_attenuation(dx7_op) * total_level_step / 20.0);
+    }
+
+    double history[2] = { 0, 0 };
+    samples.assign(count, 0.0);
+    for (int n = 0; n < count; n++) {
+        double mix = 0.0;
+        for (int op = 5; op >= 0; op--) {
+            double modulation = 0.0;
+            for (int source = op + 1; source < 6; source++) {
+                if (dx7.modulators[op] & (1 << source)) modulation += output[source];
+            }
+            modulation *= 4.0 * pi;
+            if (op == dx7.feedback && voice.feedback) {
+                modulation = 2.0 * pi * (history[0] + history[1]) * pow(2.0, voice.feedback - 7);
+            }
+            output[op] = amplitude[op] * sin(2.0 * pi * phase[op] + modulation);
+            phase[op] = fmod(phase[op] + increment[op], 1.0);
+            if (dx7.carriers & (1 << op)) mix += output[op];
+        }
+        history[1] = history[0];
+        history[0] = output[dx7.feedback];
+        samples[n] = mix;
+    }
+}
+
+void compute_spectrum(const vector<double>& samples, vector<double>& magnitudes) {
+    // Hann windowed FFT (samples.size() must be a power of two). The magnitudes are square
+    // rooted so weak partials still count, and scaled to unit length for cosine similarity.
+    size_t size = samples.size();
+    vector<complex<double>> bins(size);
+    const double pi = 3.14159265358979323846;
+    for (size_t i = 0; i < size; i++) {
+        bins[i] = samples[i] * (0.5 - 0.5 * cos(2.0 * pi * i / size));
+    }
+    for (size_t i = 1, j = 0; i < size; i++) {
+        size_t bit = size >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) swap(bins[i], bins[j]);
+    }
+    for (size_t length = 2; length <= size; length <<= 1) {
+        complex<double> step = polar(1.0, -2.0 * pi / length);
+        for (size_t start = 0; start < size; start += length) {
+            complex<double> twiddle = 1.0;
+            for (size_t k = 0; k < length / 2; k++) {
+                complex<double> even = bins[start + k];
+                complex<double> odd = bins[start + k + length / 2] * twiddle;
+                bins[start + k] = even + odd;
+                bins[start + k + length / 2] = even - odd;
+                twiddle *= step;
+            }
+        }
+    }
+
+    magnitudes.resize(size / 2);
+    double total = 0.0;
+    for (size_t i = 0; i < size / 2; i++) {
+        magnitudes[i] = sqrt(abs(bins[i]));
+        total += magnitudes[i] * magnitudes[i];
+    }
+    if (total > 0.0) {
+        for (double& magnitude : magnitudes) magnitude /= sqrt(total);
+    }
+}
+
+int stream_descriptor(const string& name, int standard) {
+    // "-" stands for the standard stream in the direction it's used in; "fd:N" names an already open descriptor. Anything else is a file (-1)
+    if (name == "-") {
+        return standard;
+    }
+    if (name.size() > 3 && name.compare(0, 3, "fd:") == 0 && name.find_first_not_of("0123456789", 3) == string::npos) {
+        return atoi(name.c_str() + 3);
+    }
+    return -1;
+}
+
+bool is_stream_name(const string& name) {
+    return stream_descriptor(name, 0) >= 0;
+}
+
+bool read_stream(const string& name, vector<char>& raw) {
+    // Read until end of stream; pipes deliver in pieces and can't be sized or rewound
+    int fd = stream_descriptor(name, 0);
+    char buffer[65536];
+    raw.clear();
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);
+#endif
+    for (;;) {
+#ifdef _WIN32
+        int count = _read(fd, buffer, sizeof(buffer));
+#else
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (count < 0) {
+            cout << "Error: could not read from " << name << endl;
+            return false;
+        }
+        if (count == 0) {
+            return true;
+        }
+        raw.insert(raw.end(), buffer, buffer + count);
+    }
+}
+
+bool read_bank_streams(const string& name1, const string& name2, vector<char>& data1, vector<char>& data2) {
+    // Either bank may come from a file, stdin or a numbered descriptor. Given "-" for both, stdin holds Bank A then Bank B back to back.
+    vector<char> raw1, raw2;
+    if (name1 == "-" && name2 == "-") {
+        if (!read_stream(name1, raw1)) {
+            return false;
+        }
+        if (raw1.size() != static_cast<size_t>(Fb01BankALayout::file_size + Fb01BankBLayout::file_size)) {
+            cout << "Error: stdin is not the expected size (" << Fb01BankALayout::file_size + Fb01BankBLayout::file_size
+                 << " bytes, Bank A followed by Bank B). Actual size: " << raw1.size() << endl;
+            return false;
+        }
+        raw2.assign(raw1.begin() + Fb01BankALayout::file_size, raw1.end());
+        raw1.resize(Fb01BankALayout::file_size);
+    }
+    else {
+        auto read_input = [](const string& name, vector<char>& raw) {
+            if (is_stream_name(name)) {
+                return read_stream(name, raw);
+            }
+            if (!load_file(name, raw)) {
+                cout << "Error: file " << name << " not found" << endl;
+                return false;
+            }
+            return true;
+        };
+        if (!read_input(name1, raw1) || !read_input(name2, raw2)) {
+            return false;
+        }
+    }
+
+    Result result = validate_bank_data(raw1, name1 == "-" ? "stdin" : name1, 0);
+    result.merge(validate_bank_data(raw2, name2 == "-" ? "stdin" : name2, 1));
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return false;
+    }
+    extract_packets(raw1, data1);
+    extract_packets(raw2, data2);
+    return true;
+}
+
+Result write_stream(const string& name, const vector<char>& image) {
+    // Write the whole image to stdout or a numbered descriptor, carrying on after short writes into a pipe
+    int fd = stream_descriptor(name, 1);
+    Result result;
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);
+#endif
+    size_t written = 0;
+    while (written < image.size()) {
+#ifdef _WIN32
+        int count = _write(fd, image.data() + written, static_cast<unsigned int>(image.size() - written));
+#else
+        ssize_t count = write(fd, image.data() + written, image.size() - written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (count <= 0) {
+            result.fail(STEP_WRITE, "could not write to " + name);
+            return result;
+        }
+        written += count;
+    }
+    return result;
+}
+
+int run_watch(int argc, char* argv[]) {
+    vector<string> paths;
+    unsigned int formats = FORMAT_PATCH;
+    // A save should be heard straight away, so outputs are only renamed into place, not synced,
+    // unless --sync asks for it
+    output_committer.batch_size = 0;
+    for (int i = 2; i < argc; i++) {
+        if (is_output_option(argv[i])) {
+            if (i + 1 >= argc || !parse_output_option(argv[i], argv[i + 1], formats)) {
+                cout << "Error: missing or bad value for option " << argv[i] << endl;
+                return 1;
+            }
+            i++;
+        }
+        else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    bool directory_mode = paths.size() == 2 && filesystem::is_directory(paths[0]);
+    if (!directory_mode && paths.size() != 3) {
+        cout << "   usage:  " << argv[0] << "   --watch bankfile1 bankfile2 patfile [--formats list] [--opl-select s]\n";
+        cout << "           " << argv[0] << "   --watch bankdir outdir [--formats list] [--opl-select s]\n";
+        cout << "           (outputs are not synced to disk unless --sync n is given)\n";
+        cout << "           (every bank pair found in bankdir is converted into outdir, named after its Bank A file)\n";
+        return 1;
+    }
+
+    vector<unique_ptr<WatchedPair>> pairs;
+    DirectoryWatcher watcher;
+    bool watching;
+    if (directory_mode) {
+        error_code ec;
+        filesystem::create_directories(paths[1], ec);
+        find_watched_pairs(paths[0], paths[1], pairs);
+        watching = watcher.add(paths[0]);
+    }
+    else {
+        pairs.emplace_back(new WatchedPair());
+        pairs.back()->bank1 = watch_key(paths[0]);
+        pairs.back()->bank2 = watch_key(paths[1]);
+        pairs.back()->output = paths[2];
+        watching = watcher.add(filesystem::path(pairs.back()->bank1).parent_path().string()) &&
+                   watcher.add(filesystem::path(pairs.back()->bank2).parent_path().string());
+    }
+    if (!watching) {
+        cout << "Error: could not watch the bank directories" << endl;
+        return 1;
+    }
+
+    for (auto& watched : pairs) {
+        convert_watched_pair(*watched, formats);
+    }
+    cout << endl << "Watching " << pairs.size() << " bank pair(s) for changes (Ctrl+C to stop)" << endl;
+
+    for (;;) {
+        set<string> changed;
+        watcher.wait(changed);
+
+        bool unknown_file = false;
+        for (const string& path : changed) {
+            bool known = false;
+            for (auto& watched : pairs) {
+                known = known || path == watched->bank1 || path == watched->bank2;
+            }
+            unknown_file = unknown_file || !known;
+        }
+
+        for (auto& watched : pairs) {
+            if (changed.count(watched->bank1) || changed.count(watched->bank2)) {
+                convert_watched_pair(*watched, formats);
+            }
+        }
+
+        // A new bank in a watched directory may complete a pair: pair the directory up again, keeping
+        // (and not reconverting) the pairs that were already there
+        if (directory_mode && unknown_file) {
+            vector<unique_ptr<WatchedPair>> found;
+            find_watched_pairs(paths[0], paths[1], found);
+            for (auto& watched : found) {
+                auto existing = find_if(pairs.begin(), pairs.end(), [&](const unique_ptr<WatchedPair>& old) {
+                    return old && old->bank1 == watched->bank1 && old->bank2 == watched->bank2;
+                });
+                if (existing != pairs.end()) {
+                    watched = std::move(*existing);
+                }
+                else {
+                    convert_watched_pair(*watched, formats);
+                }
+            }
+            pairs = std::move(found);
+        }
+    }
+}
+
+string watch_key(const string& path) {
+    // Paths are compared as the watcher reports them: directory plus name, without "./" and the like
+    return filesystem::path(path).lexically_normal().string();
+}
+
+void find_watched_pairs(const string& directory, const string& output_directory, vector<unique_ptr<WatchedPair>>& pairs) {
+    // Pair the banks by sysex header like archive mode does, in name order so the pairing stays put between scans
+    vector<string> names;
+    error_code ec;
+    for (const auto& entry : filesystem::directory_iterator(directory, ec)) {
+        if (entry.is_regular_file(ec) && entry.file_size(ec) == static_cast<uintmax_t>(Fb01BankALayout::file_size)) {
+            names.push_back(watch_key(entry.path().string()));
+        }
+    }
+    sort(names.begin(), names.end());
+
+    BankPairer pairer([&](const string& name1, vector<char>& raw1, const string& name2, vector<char>& raw2) {
+        pairs.emplace_back(new WatchedPair());
+        WatchedPair& watched = *pairs.back();
+        watched.bank1 = name1;
+        watched.bank2 = name2;
+        watched.output = (filesystem::path(output_directory) / (filesystem::path(name1).stem().string() + ".002")).string();
+        watched.raw1 = std::move(raw1);
+        watched.raw2 = std::move(raw2);
+    });
+    for (const string& name : names) {
+        vector<char> raw;
+        if (load_file(name, raw)) {
+            pairer.add(directory, name, raw);
+        }
+    }
+}
+
+Result convert_watched_pair(WatchedPair& pair, unsigned int formats) {
+    // The same read/denibble/write chain as a single conversion, into the pair's own buffers. Outputs
+    // are replaced in one step, so the game never loads a half written patch.
+    auto start = chrono::steady_clock::now();
+    Result result;
+    if (!load_file(pair.bank1, pair.raw1) || !load_file(pair.bank2, pair.raw2)) {
+        result.fail(STEP_READ, "could not read " + pair.bank1 + " or " + pair.bank2);
+    }
+    else {
+        result.merge(validate_bank_data(pair.raw1, pair.bank1, 0));
+        result.merge(validate_bank_data(pair.raw2, pair.bank2, 1));
+    }
+    if (result.ok()) {
+        extract_packets(pair.raw1, pair.data1);
+        extract_packets(pair.raw2, pair.data2);
+        result.merge(reorganize_data(pair.data1, pair.data2));
+    }
+    if (result.ok()) {
+        if (normalize_levels) {
+            normalize_voices(pair.data1, pair.data2, false);
+        }
+        pair.outputs.clear();
+        render_outputs(formats, pair.data1, pair.data2, pair.output, pair.outputs);
+        for (const auto& output : pair.outputs) {
+            result.merge(output_committer.write(output.first, output.second));
+        }
+        result.merge(output_committer.flush());
+    }
+
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (result.ok()) {
+        cout << pair.bank1 << " + " << pair.bank2 << "  ->  " << pair.output << "  (" << elapsed << " ms)" << endl;
+    }
+    else {
+        // Usually a save still in progress; the next change event brings the rest
+        cout << "Error: " << pair.bank1 << " + " << pair.bank2 << " not converted, keeping the previous output" << endl << result.describe("    ");
+    }
+    return result;
+}
+
+#ifdef __linux__
+
+DirectoryWatcher::DirectoryWatcher() {
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (inotify_fd >= 0) {
+        ::close(inotify_fd);
+    }
+}
+
+bool DirectoryWatcher::add(const string& directory) {
+    string path = directory.empty() ? "." : directory;
+    if (find(directories.begin(), directories.end(), path) != directories.end()) {
+        return true;
+    }
+    // A finished write, a rename into the directory, or (for editors that keep the file open) any write at all
+    int wd = inotify_fd < 0 ? -1 : inotify_add_watch(inotify_fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE);
+    if (wd < 0) {
+        return false;
+    }
+    watches[wd] = path;
+    directories.push_back(path);
+    return true;
+}
+
+void DirectoryWatcher::wait(set<string>& changed) {
+    alignas(inotify_event) char buffer[16384];
+    int timeout = -1;
+    for (;;) {
+        pollfd descriptor = { inotify_fd, POLLIN, 0 };
+        int ready = poll(&descriptor, 1, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            if (!changed.empty()) {
+                return;
+            }
+            timeout = -1;
+            continue;
+        }
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        for (ssize_t offset = 0; offset < length; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            auto directory = watches.find(event->wd);
+            if (event->len > 0 && directory != watches.end()) {
+                changed.insert(watch_key(directory->second + "/" + event->name));
+            }
+            offset += sizeof(inotify_event) + event->len;
+        }
+        // Collect whatever else arrives before the directories go quiet
+        timeout = watch_settle_ms;
+    }
+}
+
+#else
+
+DirectoryWatcher::DirectoryWatcher() {}
+
+DirectoryWatcher::~DirectoryWatcher() {}
+
+bool DirectoryWatcher::add(const string& directory) {
+    string path = directory.empty() ? "." : directory;
+    if (find(directories.begin(), directories.end(), path) != directories.end()) {
+        return true;
+    }
+    if (!filesystem::is_directory(path)) {
+        return false;
+    }
+    directories.push_back(path);
+    scan(nullptr);
+    return true;
+}
+
+void DirectoryWatcher::scan(set<string>* changed) {
+    for (const string& directory : directories) {
+        error_code ec;
+        for (const auto& entry : filesystem::directory_iterator(directory, ec)) {
+            if (!entry.is_regular_file(ec)) {
+                continue;
+            }
+            pair<filesystem::file_time_type, uintmax_t> stamp(entry.last_write_time(ec), entry.file_size(ec));
+            string key = watch_key(entry.path().string());
+            auto known = stamps.find(key);
+            if (known == stamps.end() || known->second != stamp) {
+                stamps[key] = stamp;
+                if (changed) {
+                    changed->insert(key);
+                }
+            }
+        }
+    }
+}
+
+void DirectoryWatcher::wait(set<string>& changed) {
+    // A file counts as saved once a listing finds it changed and the next one finds it unchanged
+    for (;;) {
+        this_thread::sleep_for(chrono::milliseconds(watch_poll_ms));
+        set<string> latest;
+        scan(&latest);
+        for (const string& key : settling) {
+            if (!latest.count(key)) {
+                changed.insert(key);
+            }
+        }
+        settling = latest;
+        if (!changed.empty()) {
+            return;
+        }
+    }
+}
+
+#endif
+
+Result OutputCommitter::write(const string& filename, const vector<char>& data) {
+    Result result;
+    string temporary = filename + ".tmp";
+    ofstream out_file(temporary, ios::binary | ios::trunc);
+    out_file.write(data.data(), data.size());
+    out_file.close();
+    if (!out_file) {
+        error_code ec;
+        filesystem::remove(temporary, ec);
+        result.fail(STEP_WRITE, "could not write " + filename);
+        return result;
+    }
+    return stage(filename);
+}
+
+Result OutputCommitter::stage(const string& filename) {
+    Result result;
+
+    // Whoever fills the group commits it, outside the lock so the other writers carry on staging
+    vector<string> targets;
+    {
+        lock_guard<mutex> guard(lock);
+        staged.push_back(filename);
+        if (static_cast<int>(staged.size()) >= batch_size) {
+            targets.swap(staged);
+        }
+    }
+    if (!targets.empty()) {
+        result.merge(commit(targets));
+    }
+    return result;
+}
+
+Result OutputCommitter::flush() {
+    vector<string> targets;
+    {
+        lock_guard<mutex> guard(lock);
+        targets.swap(staged);
+    }
+    return commit(targets);
+}
+
+Result OutputCommitter::commit(vector<string>& targets) {
+    Result result;
+    if (targets.empty()) {
+        return result;
+    }
+    vector<pair<string, Result>> problems;   // Each target that didn't make it, and why
+    auto report = [&]() {
+        for (const auto& problem : problems) {
+            if (failed) {
+                failed(problem.first, problem.second);
+            }
+            else {
+                result.merge(problem.second);
+            }
+        }
+        return result;
+    };
+    set<string> directories;
+    for (const string& target : targets) {
+        string directory = filesystem::path(target).parent_path().string();
+        directories.insert(directory.empty() ? "." : directory);
+    }
+
+    // Data first: a rename that reaches the disk before the file's contents would leave an empty
+    // patch. If the data can't be synced, none of the group is renamed: the old outputs stay as
+    // they are and the new ones are left in their .tmp files.
+    if (batch_size > 0 && !sync_staged_files(targets, directories)) {
+        for (const string& target : targets) {
+            problems.emplace_back(target, Result());
+            problems.back().second.fail(STEP_WRITE, "could not sync " + target + ".tmp to disk, the old " + target + " was kept");
+        }
+        return report();
+    }
+    vector<string> renamed;
+    for (const string& target : targets) {
+        error_code ec;
+        filesystem::rename(target + ".tmp", target, ec);
+        if (ec) {
+            filesystem::remove(target + ".tmp", ec);
+            problems.emplace_back(target, Result());
+            problems.back().second.fail(STEP_WRITE, "could not replace " + target);
+        }
+        else {
+            renamed.push_back(target);
+        }
+    }
+    set<string> unsynced;
+    if (batch_size > 0) {
+        for (const string& directory : directories) {
+            if (!sync_directory(directory)) {
+                unsynced.insert(directory);
+            }
+        }
+    }
+
+    // Report every output that did make it, so one failure doesn't send the rest of the group
+    // through --resume again; a rename is only safe once its directory is synced
+    vector<string> done;
+    for (const string& target : renamed) {
+        string directory = filesystem::path(target).parent_path().string();
+        if (directory.empty()) {
+            directory = ".";
+        }
+        if (!unsynced.count(directory)) {
+            done.push_back(target);
+        }
+        else {
+            problems.emplace_back(target, Result());
+            problems.back().second.fail(STEP_WRITE, "could not sync directory " + directory + " after replacing " + target);
+        }
+    }
+    if (committed && !done.empty()) {
+        committed(done);
+    }
+    return report();
+}
+
+bool sync_staged_files(const vector<string>& targets, const set<string>& directories) {
+    bool ok = true;
+#if defined(__linux__)
+    // One syncfs flushes every staged file on a filesystem at once
+    (void)targets;
+    set<dev_t> devices;
+    for (const string& directory : directories) {
+        int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            ok = false;
+        }
+        else if (devices.insert(info.st_dev).second && syncfs(fd) != 0) {
+            ok = false;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+#elif !defined(_WIN32)
+    (void)directories;
+    for (const string& target : targets) {
+        int fd = open((target + ".tmp").c_str(), O_RDONLY);
+        if (fd < 0 || fsync(fd) != 0) {
+            ok = false;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+#else
+    // Windows has no cheap way to flush a group of files; the renames still keep outputs whole
+    (void)targets;
+    (void)directories;
+#endif
+    return ok;
+}
+
+bool sync_directory(const string& directory) {
+#ifndef _WIN32
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#else
+    (void)directory;
+    return true;
+#endif
+}
+
+bool take_line(string& buffer, string& line) {
+    // Split the next complete line off the front of the received bytes
+    size_t end = buffer.find('\n');
+    if (end == string::npos) {
+        return false;
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    return true;
+}
+
+#ifndef _WIN32
+
+int run_coordinator(int argc, char* argv[]) {
+    size_t range_size = coordinator_range_size;
+    if (argc == 6 && strcmp(argv[4], "--range") == 0 && atoi(argv[5]) >= 1) {
+        range_size = atoi(argv[5]);
+    }
+    else if (argc != 4) {
+        cout << "   usage:  " << argv[0] << "   --coordinate joblist address [--range n]\n";
+        cout << "           (address is unix:/path/to/socket or host:port; workers run --batch joblist --coordinator address)\n";
+        return 1;
+    }
+
+    vector<unique_ptr<ConversionJob>> jobs;
+    if (!load_job_list(argv[2], jobs)) {
+        return 1;
+    }
+    deque<pair<size_t, size_t>> ranges;
+    for (size_t begin = 0; begin < jobs.size(); begin += range_size) {
+        ranges.emplace_back(begin, min(begin + range_size, jobs.size()));
+    }
+
+    string address = argv[3];
+    string error;
+    int listener = open_socket(address, true, error);
+    if (listener < 0) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    cout << "Handing out " << jobs.size() << " bank pairs in " << ranges.size() << " ranges on " << address << endl << endl;
+
+    // A worker's failures only count once it has sent its totals. If it goes away before that, every
+    // range it took is handed out again; outputs are replaced whole, so redoing part of one is harmless.
+    // A worker only sends its totals after being told DONE, so once anyone has been told DONE, ranges
+    // handed back can only go to workers still asking or ones that connect later. When the last
+    // worker leaves with ranges still unfinished, they are listed so they can be run again.
+    struct Worker {
+        int fd;
+        int id;
+        string buffer;
+        vector<pair<size_t, size_t>> taken;
+        map<size_t, vector<string>> problems;
+    };
+    vector<Worker> workers;
+    map<size_t, vector<string>> problems;
+    int next_id = 1;
+    long long converted = 0, failed = 0;
+    bool draining = false;   // Someone has been told DONE
+    auto start_time = chrono::steady_clock::now();
+
+    while ((!ranges.empty() && !draining) || !workers.empty()) {
+        vector<pollfd> descriptors(1, pollfd{ listener, POLLIN, 0 });
+        for (const Worker& worker : workers) {
+            descriptors.push_back(pollfd{ worker.fd, POLLIN, 0 });
+        }
+        if (poll(descriptors.data(), descriptors.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cout << "Error: lost the coordinator socket" << endl;
+            break;
+        }
+
+        for (size_t k = descriptors.size() - 1; k >= 1; k--) {
+            if (!(descriptors[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            Worker& worker = workers[k - 1];
+            char chunk[4096];
+            ssize_t count = read(worker.fd, chunk, sizeof(chunk));
+            if (count > 0) {
+                worker.buffer.append(chunk, count);
+            }
+
+            bool finished = false;
+            string line;
+            while (take_line(worker.buffer, line)) {
+                istringstream message(line);
+                string command;
+                message >> command;
+                if (command == "NEXT") {
+                    if (ranges.empty()) {
+                        send_line(worker.fd, "DONE");
+                        draining = true;
+                        continue;
+                    }
+                    worker.taken.push_back(ranges.front());
+                    ranges.pop_front();
+                    send_line(worker.fd, "RANGE " + to_string(worker.taken.back().first) + " " + to_string(worker.taken.back().second));
+                }
+                else if (command == "FAILED") {
+                    size_t index;
+                    string problem;
+                    if (message >> index && getline(message >> ws, problem) && index < jobs.size()) {
+                        worker.problems[index].push_back(problem);
+                    }
+                }
+                else if (command == "STATS") {
+                    long long worker_converted = 0, worker_failed = 0;
+                    message >> worker_converted >> worker_failed;
+                    converted += worker_converted;
+                    failed += worker_failed;
+                    for (auto& job : worker.problems) {
+                        problems[job.first] = std::move(job.second);
+                    }
+                    worker.taken.clear();
+                    finished = true;
+                    cout << "Worker " << worker.id << " finished: " << worker_converted << " converted, " << worker_failed << " failed" << endl;
+                }
+            }
+
+            if (count <= 0 && !(count < 0 && errno == EINTR)) {
+                if (!finished && !worker.taken.empty()) {
+                    cout << "Warning: worker " << worker.id << " went away, handing out its " << worker.taken.size() << " range(s) again" << endl;
+                    ranges.insert(ranges.begin(), worker.taken.begin(), worker.taken.end());
+                }
+                close(worker.fd);
+                workers.erase(workers.begin() + (k - 1));
+            }
+        }
+
+        if (descriptors[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                workers.push_back(Worker{ fd, next_id++, string(), {}, {} });
+                cout << "Worker " << workers.back().id << " connected" << endl;
+            }
+        }
+    }
+
+    close(listener);
+    if (address.compare(0, 5, "unix:") == 0) {
+        unlink(address.c_str() + 5);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    // Same report as a single batch run, gathered from every worker
+    if (!problems.empty()) {
+        cout << endl << "Failed jobs:" << endl;
+        for (const auto& job : problems) {
+            cout << "  " << jobs[job.first]->input_filename1 << " " << jobs[job.first]->input_filename2 << " " << jobs[job.first]->output_filename << endl;
+            for (const string& problem : job.second) {
+                cout << "      " << problem << endl;
+            }
+        }
+    }
+    size_t unfinished = 0;
+    if (!ranges.empty()) {
+        sort(ranges.begin(), ranges.end());
+        cout << endl << "Error: the workers that took these bank pairs went away after the others were told to stop, run them again:" << endl;
+        for (const auto& range : ranges) {
+            for (size_t i = range.first; i < range.second; i++) {
+                cout << "  " << jobs[i]->input_filename1 << " " << jobs[i]->input_filename2 << " " << jobs[i]->output_filename << endl;
+            }
+            unfinished += range.second - range.first;
+        }
+    }
+    cout << endl << converted << " SCI FB-01 patches created, " << failed << " failed, " << unfinished << " unfinished ("
+         << elapsed.count() << " seconds, " << next_id - 1 << " workers)" << endl;
+    return failed > 0 || unfinished > 0 ? 1 : 0;
+}
+
+int open_socket(const string& address, bool listening, string& error) {
+    // unix:/path is a Unix domain socket; anything else is host:port over TCP (an empty host listens
+    // on every interface, or connects to this machine)
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un location = {};
+        location.sun_family = AF_UNIX;
+        string path = address.substr(5);
+        if (path.empty() || path.size() >= sizeof(location.sun_path)) {
+            error = "bad Unix socket path in " + address;
+            return -1;
+        }
+        memcpy(location.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listening) {
+            unlink(path.c_str());
+        }
+        if (fd >= 0 && (listening ? bind(fd, reinterpret_cast<sockaddr*>(&location), sizeof(location)) == 0 && listen(fd, 64) == 0
+                                  : connect(fd, reinterpret_cast<sockaddr*>(&location), sizeof(location)) == 0)) {
+            return fd;
+        }
+        error = string(listening ? "could not listen on " : "could not connect to ") + address + ": " + strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    size_t colon = address.find_last_of(':');
+    if (colon == string::npos) {
+        error = "address " + address + " must be unix:/path or host:port";
+        return -1;
+    }
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* results = nullptr;
+    int status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results);
+    if (status != 0) {
+        error = "could not resolve " + address + ": " + gai_strerror(status);
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* candidate = results; candidate && fd < 0; candidate = candidate->ai_next) {
+        fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int reuse = 1;
+        bool ok = listening ? setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == 0 &&
+                              bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && listen(fd, 64) == 0
+                            : connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0;
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    if (fd < 0) {
+        error = string(listening ? "could not listen on " : "could not connect to ") + address + ": " + strerror(errno);
+    }
+    return fd;
+}
+
+bool send_line(int fd, const string& line) {
+    string message = line + "\n";
+    for (size_t sent = 0; sent < message.size(); ) {
+        ssize_t count = write(fd, message.data() + sent, message.size() - sent);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+CoordinatorClient::~CoordinatorClient() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool CoordinatorClient::connect(const string& address) {
+    string error;
+    fd = open_socket(address, false, error);
+    if (fd < 0) {
+        cout << "Error: " << error << endl;
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+}
+
+bool CoordinatorClient::next_range(size_t& begin, size_t& end) {
+    string line;
+    if (fd < 0 || !send_line(fd, "NEXT")) {
+        return false;
+    }
+    while (!take_line(buffer, line)) {
+        char chunk[256];
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            cout << "Warning: lost the connection to the coordinator" << endl;
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        buffer.append(chunk, count);
+    }
+    istringstream message(line);
+    string command;
+    return message >> command && command == "RANGE" && message >> begin >> end && begin < end;
+}
+
+void CoordinatorClient::report(int converted, const vector<unique_ptr<ConversionJob>>& failures) {
+    if (fd < 0) {
+        return;
+    }
+    for (const unique_ptr<ConversionJob>& job : failures) {
+        istringstream problems(job->result.describe());
+        for (string problem; getline(problems, problem); ) {
+            send_line(fd, "FAILED " + to_string(job->index) + " " + problem);
+        }
+    }
+    send_line(fd, "STATS " + to_string(converted) + " " + to_string(failures.size()));
+}
+
+#else
+
+// Sockets are only wired up for POSIX systems; --shard works everywhere
+int run_coordinator(int, char*[]) {
+    cout << "Error: --coordinate is not supported on this platform, use --shard i/N instead" << endl;
+    return 1;
+}
+
+int open_socket(const string&, bool, string& error) {
+    error = "sockets are not supported on this platform";
+    return -1;
+}
+
+bool send_line(int, const string&) {
+    return false;
+}
+
+CoordinatorClient::~CoordinatorClient() {}
+
+bool CoordinatorClient::connect(const string&) {
+    cout << "Error: --coordinator is not supported on this platform, use --shard i/N instead" << endl;
+    return false;
+}
+
+bool CoordinatorClient::next_range(size_t&, size_t&) {
+    return false;
+}
+
+void CoordinatorClient::report(int, const vector<unique_ptr<ConversionJob>>&) {}
+
+#endif
+
+int run_name_index(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "   usage:  " << argv[0] << "   --name-index indexfile source [source ...]\n";
+        cout << "           (sources are patch files or tar/zip archives of bank files)\n";
+        return 1;
+    }
+    auto start_time = chrono::steady_clock::now();
+
+    // Every voice is indexed, duplicates included, so a search finds every bank a sound turns up in
+    vector<string> sources;
+    unordered_map<string, uint32_t> source_numbers;
+    vector<char> voice_table;
+    vector<uint64_t> entries;   // Trigram in the high 32 bits, voice number in the low 32
+    vector<uint32_t> trigrams;
+    uint32_t voice_count = 0;
+    int failed = 0;
+    for (int i = 3; i < argc; i++) {
+        string error;
+        bool ok = read_voices_from_source(argv[i], [&](const string& origin, int voice, const char* record) {
+            auto source = source_numbers.emplace(origin, static_cast<uint32_t>(sources.size()));
+            if (source.second) {
+                sources.push_back(origin);
+            }
+            string name = get_voice_name(record);
+            name.resize(7, ' ');
+            append_le(voice_table, source.first->second, 4);
+            voice_table.push_back(static_cast<char>(voice));
+            voice_table.insert(voice_table.end(), name.begin(), name.end());
+            name_trigrams(name, trigrams);
+            for (uint32_t trigram : trigrams) {
+                entries.push_back(static_cast<uint64_t>(trigram) << 32 | voice_count);
+            }
+            voice_count++;
+        }, error);
+        if (!ok) {
+            cout << "Error: " << error << endl;
+            failed++;
+        }
+    }
+
+    // Voices were numbered in order, so sorting by trigram leaves each posting list ascending
+    sort(entries.begin(), entries.end());
+    vector<char> trigram_table, posting_data;
+    for (size_t i = 0; i < entries.size(); ) {
+        uint32_t trigram = static_cast<uint32_t>(entries[i] >> 32);
+        size_t start = posting_data.size(), count = 0;
+        uint32_t previous = 0;
+        for (; i < entries.size() && static_cast<uint32_t>(entries[i] >> 32) == trigram; i++, count++) {
+            uint32_t id = static_cast<uint32_t>(entries[i]);
+            for (uint32_t delta = id - previous; ; delta >>= 7) {
+                if (delta < 0x80) {
+                    posting_data.push_back(static_cast<char>(delta));
+                    break;
+                }
+                posting_data.push_back(static_cast<char>((delta & 0x7F) | 0x80));
+            }
+            previous = id;
+        }
+        append_le(trigram_table, trigram, 4);
+        append_le(trigram_table, static_cast<uint32_t>(start), 4);
+        append_le(trigram_table, static_cast<uint32_t>(count), 4);
+    }
+
+    vector<char> source_table;
+    uint32_t name_offset = static_cast<uint32_t>(sources.size() * 8);
+    for (const string& source : sources) {
+        append_le(source_table, name_offset, 4);
+        append_le(source_table, static_cast<uint32_t>(source.size()), 4);
+        name_offset += static_cast<uint32_t>(source.size());
+    }
+    for (const string& source : sources) {
+        source_table.insert(source_table.end(), source.begin(), source.end());
+    }
+
+    vector<char> image;
+    append_text(image, "FBNI");
+    append_le(image, name_index_version, 4);
+    append_le(image, voice_count, 4);
+    append_le(image, static_cast<uint32_t>(sources.size()), 4);
+    append_le(image, static_cast<uint32_t>(trigram_table.size() / name_index_trigram_size), 4);
+    uint32_t offset = name_index_header_size;
+    for (const vector<char>* section : { &source_table, &voice_table, &trigram_table, &posting_data }) {
+        append_le(image, offset, 4);
+        offset += static_cast<uint32_t>(section->size());
+    }
+    for (const vector<char>* section : { &source_table, &voice_table, &trigram_table, &posting_data }) {
+        image.insert(image.end(), section->begin(), section->end());
+    }
+
+    Result result = output_committer.write(argv[2], image);
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    cout << voice_count << " voice names from " << sources.size() << " sources indexed, " << trigram_table.size() / name_index_trigram_size
+         << " trigrams, " << image.size() << " bytes (" << elapsed.count() << " seconds)" << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+int run_find_name(int argc, char* argv[]) {
+    int max_edits = 0;
+    if (argc == 6 && strcmp(argv[4], "--fuzzy") == 0 && atoi(argv[5]) >= 0) {
+        max_edits = atoi(argv[5]);
+    }
+    else if (argc != 4) {
+        cout << "   usage:  " << argv[0] << "   --find-name indexfile text [--fuzzy n]\n";
+        cout << "           (finds names containing text, or with --fuzzy, text with up to n characters changed, added or left out)\n";
+        return 1;
+    }
+    NameIndex index;
+    string error;
+    if (!index.open(argv[2], error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    auto start_time = chrono::steady_clock::now();
+
+    string query = argv[3];
+    for (char& c : query) {
+        c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+    }
+
+    // Narrow down to candidates with the trigram postings, then check each candidate's name. An exact
+    // match contains every trigram of the text. With n edits a match still shares all but 3n of them
+    // (an edit touches at most three), so voices are counted and kept when they reach that many.
+    vector<uint32_t> query_trigrams;
+    name_trigrams(query, query_trigrams);
+    int needed = static_cast<int>(query_trigrams.size()) - 3 * max_edits;
+    vector<uint32_t> candidates;
+    bool scan_all = needed < 1;
+    if (!scan_all && max_edits == 0) {
+        vector<vector<uint32_t>> lists(query_trigrams.size());
+        for (size_t i = 0; i < query_trigrams.size(); i++) {
+            index.postings(query_trigrams[i], lists[i]);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<uint32_t>& a, const vector<uint32_t>& b) { return a.size() < b.size(); });
+        candidates = lists[0];
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+            vector<uint32_t> common;
+            set_intersection(candidates.begin(), candidates.end(), lists[i].begin(), lists[i].end(), back_inserter(common));
+            candidates.swap(common);
+        }
+    }
+    else if (!scan_all) {
+        vector<unsigned char> hits(index.voice_count(), 0);
+        vector<uint32_t> ids;
+        for (uint32_t trigram : query_trigrams) {
+            index.postings(trigram, ids);
+            for (uint32_t id : ids) {
+                if (++hits[id] == needed) {
+                    candidates.push_back(id);
+                }
+            }
+        }
+        sort(candidates.begin(), candidates.end());
+    }
+    // Too short a text to narrow anything down: every name is checked, straight from the voice table
+    if (scan_all) {
+        candidates.resize(index.voice_count());
+        for (uint32_t id = 0; id < index.voice_count(); id++) {
+            candidates[id] = id;
+        }
+    }
+
+    vector<int> distances(candidates.size());
+    parallel_for(static_cast<int>((candidates.size() + 4095) / 4096), [&](int chunk) {
+        size_t end = min(candidates.size(), static_cast<size_t>(chunk + 1) * 4096);
+        for (size_t i = static_cast<size_t>(chunk) * 4096; i < end; i++) {
+            string name = index.name(candidates[i]);
+            for (char& c : name) {
+                c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+            }
+            distances[i] = max_edits == 0 ? (name.find(query) == string::npos ? 1 : 0) : substring_edit_distance(query, name);
+        }
+    });
+    vector<pair<int, uint32_t>> matches;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (distances[i] <= max_edits) {
+            matches.emplace_back(distances[i], candidates[i]);
+        }
+    }
+    sort(matches.begin(), matches.end());
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start_time;
+
+    for (size_t i = 0; i < matches.size() && i < name_search_limit; i++) {
+        uint32_t id = matches[i].second;
+        cout << "  " << left << setw(8) << index.name(id) << right << setw(4) << index.slot(id) + 1 << "  " << index.source(id);
+        if (max_edits > 0) {
+            cout << "  (" << matches[i].first << " edit" << (matches[i].first == 1 ? "" : "s") << ")";
+        }
+        cout << endl;
+    }
+    if (matches.size() > name_search_limit) {
+        cout << "  ..." << endl;
+    }
+    cout << endl << matches.size() << " of " << index.voice_count() << " voices match, " << candidates.size() << " names checked ("
+         << elapsed.count() << " ms)" << endl;
+    return matches.empty() ? 1 : 0;
+}
+
+void name_trigrams(const string& name, vector<uint32_t>& trigrams) {
+    // Distinct upper-cased three-character runs. Trailing padding is left out; spaces inside a name count.
+    string text = name;
+    while (!text.empty() && text.back() == ' ') text.pop_back();
+    trigrams.clear();
+    for (size_t i = 0; i + 3 <= text.size(); i++) {
+        uint32_t trigram = 0;
+        for (size_t j = 0; j < 3; j++) {
+            trigram = trigram << 8 | static_cast<unsigned char>(toupper(static_cast<unsigned char>(text[i + j])));
+        }
+        trigrams.push_back(trigram);
+    }
+    sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+}
+
+int substring_edit_distance(const string& pattern, const string& text) {
+    // Fewest edits turning the pattern into some part of the text (Sellers' algorithm: the match
+    // may start anywhere, so the top row stays zero). The text is a voice name, at most 7 characters,
+    // so the rows fit on the stack.
+    int rows[2][8] = {};
+    size_t length = min(text.size(), static_cast<size_t>(7));
+    int* previous = rows[0];
+    int* current = rows[1];
+    for (size_t i = 1; i <= pattern.size(); i++) {
+        current[0] = static_cast<int>(i);
+        for (size_t j = 1; j <= length; j++) {
+            int substitution = previous[j - 1] + (pattern[i - 1] == text[j - 1] ? 0 : 1);
+            current[j] = min(substitution, min(previous[j], current[j - 1]) + 1);
+        }
+        swap(previous, current);
+    }
+    return *min_element(previous, previous + length + 1);
+}
+
+bool NameIndex::open(const string& filename, string& error) {
+    if (!file.open(filename)) {
+        error = "file " + filename + " not found";
+        return false;
+    }
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(file.data());
+    if (file.size() < static_cast<size_t>(name_index_header_size) || memcmp(header, "FBNI", 4) != 0 || read_le(header + 4, 4) != name_index_version) {
+        error = filename + " is not a voice name index";
+        return false;
+    }
+    voices = read_le(header + 8, 4);
+    sources = read_le(header + 12, 4);
+    trigrams = read_le(header + 16, 4);
+    uint32_t offsets[4];
+    for (int i = 0; i < 4; i++) {
+        offsets[i] = read_le(header + 20 + i * 4, 4);
+    }
+    if (offsets[0] + static_cast<uint64_t>(sources) * 8 > file.size() ||
+        offsets[1] + static_cast<uint64_t>(voices) * name_index_voice_size > file.size() ||
+        offsets[2] + static_cast<uint64_t>(trigrams) * name_index_trigram_size > file.size() || offsets[3] > file.size()) {
+        error = filename + " is truncated";
+        return false;
+    }
+    source_table = file.data() + offsets[0];
+    voice_table = file.data() + offsets[1];
+    trigram_table = file.data() + offsets[2];
+    posting_data = file.data() + offsets[3];
+    posting_size = file.size() - offsets[3];
+    return true;
+}
+
+string NameIndex::source(uint32_t voice) const {
+    uint32_t number = read_le(reinterpret_cast<const unsigned char*>(voice_table + voice * name_index_voice_size), 4);
+    if (number >= sources) {
+        return "?";
+    }
+    const unsigned char* entry = reinterpret_cast<const unsigned char*>(source_table + number * 8);
+    uint64_t start = static_cast<uint64_t>(source_table - file.data()) + read_le(entry, 4);
+    uint32_t length = read_le(entry + 4, 4);
+    if (start + length > file.size()) {
+        return "?";
+    }
+    return string(file.data() + start, length);
+}
+
+bool NameIndex::postings(uint32_t trigram, vector<uint32_t>& ids) const {
+    // Binary search of the sorted trigram table, straight out of the map
+    ids.clear();
+    uint32_t low = 0, high = trigrams;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint32_t key = read_le(reinterpret_cast<const unsigned char*>(trigram_table + middle * name_index_trigram_size), 4);
+        if (key < trigram) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    const unsigned char* entry = reinterpret_cast<const unsigned char*>(trigram_table + low * name_index_trigram_size);
+    if (low >= trigrams || read_le(entry, 4) != trigram) {
+        return false;
+    }
+
+    // Every posting takes at least a byte, so a list that can't fit before the end of the map, runs
+    // off it, or names a voice the index doesn't have is damaged and nothing of it is used
+    uint32_t offset = read_le(entry + 4, 4);
+    uint32_t count = read_le(entry + 8, 4);
+    if (offset > posting_size || count > posting_size - offset) {
+        return false;
+    }
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(posting_data) + offset;
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(posting_data) + posting_size;
+    ids.reserve(count);
+    uint64_t id = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t delta = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (data == end || shift > 28) {
+                ids.clear();
+                return false;
+            }
+            unsigned char byte = *data++;
+            delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        id += delta;
+        if (id >= voices) {
+            ids.clear();
+            return false;
+        }
+        ids.push_back(static_cast<uint32_t>(id));
+    }
+    return true;
+}
+
+vector<string> store_column_names() {
+    // One column per decoded parameter, in the order of the CSV output
+    vector<string> names;
+    for (const VoiceParameter& parameter : voice_parameters) {
+        names.push_back(parameter.name);
+    }
+    for (int op = 0; op < 4; op++) {
+        for (const VoiceParameter& parameter : operator_parameters) {
+            names.push_back("op" + to_string(op + 1) + "_" + parameter.name);
+        }
+    }
+    return names;
+}
+
+size_t store_voice_count(const string& directory) {
+    // The shortest file decides, so voices half appended when a run was killed don't count
+    error_code ec;
+    filesystem::path path(directory);
+    size_t count = filesystem::file_size(path / "slot.col", ec);
+    if (ec) {
+        return 0;
+    }
+    count = min(count, static_cast<size_t>(filesystem::file_size(path / "source.col", ec) / 4));
+    count = ec ? 0 : min(count, static_cast<size_t>(filesystem::file_size(path / "records.bin", ec) / 64));
+    for (const string& name : store_column_names()) {
+        count = ec ? 0 : min(count, static_cast<size_t>(filesystem::file_size(path / (name + ".col"), ec)));
+    }
+    return ec ? 0 : count;
+}
+
+int run_store_add(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "   usage:  " << argv[0] << "   --store-add storedir source [source ...]\n";
+        cout << "           (sources are patch files or tar/zip archives of bank files)\n";
+        return 1;
+    }
+    filesystem::path directory(argv[2]);
+    error_code ec;
+    filesystem::create_directories(directory, ec);
+    vector<string> column_names = store_column_names();
+
+    // Cut every file back to the voices that made it into all of them before appending. A store
+    // missing one of its files is left alone: the count would come out as 0 and cut the rest to nothing.
+    vector<pair<filesystem::path, size_t>> files = { { directory / "slot.col", 1 }, { directory / "source.col", 4 },
+                                                      { directory / "records.bin", 64 } };
+    for (const string& name : column_names) {
+        files.emplace_back(directory / (name + ".col"), 1);
+    }
+    size_t present = 0;
+    for (const auto& file : files) {
+        present += filesystem::exists(file.first, ec) ? 1 : 0;
+    }
+    if (present > 0 && present < files.size()) {
+        for (const auto& file : files) {
+            if (!filesystem::exists(file.first, ec)) {
+                cout << "Error: " << file.first.string() << " is missing from the store, nothing was added" << endl;
+                return 1;
+            }
+        }
+    }
+    size_t existing = store_voice_count(argv[2]);
+    if (filesystem::exists(directory / "cluster.col", ec)) {
+        files.emplace_back(directory / "cluster.col", 1);
+    }
+    for (const auto& file : files) {
+        uintmax_t size = filesystem::file_size(file.first, ec);
+        if (!ec && size > existing * file.second) {
+            filesystem::resize_file(file.first, existing * file.second, ec);
+        }
+        if (ec && present > 0) {
+            cout << "Error: could not cut " << file.first.string() << " back to " << existing << " voices ("
+                 << ec.message() << "), nothing was added" << endl;
+            return 1;
+        }
+    }
+
+    vector<string> sources;
+    unordered_map<string, uint32_t> source_numbers;
+    ifstream source_list(directory / "sources.txt");
+    for (string line; getline(source_list, line); ) {
+        source_numbers.emplace(line, static_cast<uint32_t>(sources.size()));
+        sources.push_back(line);
+    }
+    size_t known_sources = sources.size();
+
+    // Bring the hash index and the filter up to date with the store if a crash left them behind
+    MappedFile stored_records, index_file;
+    vector<char> rebuilt_index;
+    const char* index = nullptr;
+    if (existing > 0) {
+        stored_records.open((directory / "records.bin").string());
+        if (index_file.open((directory / "hashes.idx").string()) && index_file.size() == existing * store_index_entry_size) {
+            index = index_file.data();
+        }
+        else {
+            rebuilt_index = build_store_index(stored_records.data(), existing);
+            index = rebuilt_index.data();
+        }
+    }
+    // The filter is sized for the store plus the voices about to arrive, guessed from the size of
+    // the sources (64 bytes or more a voice). If a run still overfills it, it is rebuilt twice as big.
+    VoiceFilter filter;
+    string filter_filename = (directory / "voices.bloom").string();
+    vector<pair<uint64_t, uint32_t>> new_entries;
+    auto rebuild_filter = [&](size_t capacity) {
+        if (!filter.create(filter_filename, max<size_t>(capacity, 65536))) {
+            return false;
+        }
+        for (size_t i = 0; i < existing; i++) {
+            filter.add(static_cast<uint64_t>(read_le(reinterpret_cast<const unsigned char*>(index) + i * store_index_entry_size, 4)) |
+                       static_cast<uint64_t>(read_le(reinterpret_cast<const unsigned char*>(index) + i * store_index_entry_size + 4, 4)) << 32);
+        }
+        for (const auto& entry : new_entries) {
+            filter.add(entry.first);
+        }
+        return true;
+    };
+    size_t incoming = 0;
+    for (int i = 3; i < argc; i++) {
+        incoming += static_cast<size_t>(filesystem::file_size(argv[i], ec) / 64);
+    }
+    if ((!filter.open(filter_filename, existing) || filter.capacity() < existing + incoming) && !rebuild_filter((existing + incoming) * 2)) {
+        cout << "Error: could not create " << filter_filename << endl;
+        return 1;
+    }
+
+    // Decode the new voices into columns in memory, then append each column in one write. A voice
+    // the filter has never seen is new for sure; only filter hits are looked up in the hash index.
+    vector<vector<char>> columns(column_names.size());
+    vector<char> records, slots, source_column;
+    unordered_multimap<uint64_t, size_t> added;   // Hash of each voice added in this run, and its position in records
+    bool filter_ok = true;
+    size_t duplicates = 0, false_hits = 0;
+    int failed = 0;
+    for (int i = 3; i < argc; i++) {
+        string error;
+        bool ok = read_voices_from_source(argv[i], [&](const string& origin, int voice, const char* record) {
+            if (!filter_ok) {
+                return;
+            }
+            uint64_t hash = hash_voice(record);
+            if (filter.maybe_contains(hash)) {
+                bool found = find_in_store_index(index, existing, stored_records.data(), hash, record);
+                auto range = added.equal_range(hash);
+                for (auto it = range.first; it != range.second && !found; ++it) {
+                    found = memcmp(records.data() + it->second * 64, record, 64) == 0;
+                }
+                if (found) {
+                    duplicates++;
+                    return;
+                }
+                false_hits++;
+            }
+            added.emplace(hash, slots.size());
+            new_entries.emplace_back(hash, static_cast<uint32_t>(existing + slots.size()));
+            if (existing + new_entries.size() > filter.capacity()) {
+                filter_ok = filter_ok && rebuild_filter(filter.capacity() * 2);
+            }
+            else {
+                filter.add(hash);
+            }
+
+            auto source = source_numbers.emplace(origin, static_cast<uint32_t>(sources.size()));
+            if (source.second) {
+                sources.push_back(origin);
+            }
+            append_le(source_column, source.first->second, 4);
+            slots.push_back(static_cast<char>(voice));
+            records.insert(records.end(), record, record + 64);
+            size_t column = 0;
+            for (const VoiceParameter& parameter : voice_parameters) {
+                columns[column++].push_back(static_cast<char>(get_parameter(record, parameter)));
+            }
+            for (int op = 0; op < 4; op++) {
+                for (const VoiceParameter& parameter : operator_parameters) {
+                    columns[column++].push_back(static_cast<char>(get_parameter(record + operator_offsets[op], parameter)));
+                }
+            }
+        }, error);
+        if (!ok) {
+            cout << "Error: " << error << endl;
+            failed++;
+        }
+    }
+
+    if (!filter_ok) {
+        cout << "Error: could not grow " << filter_filename << endl;
+        return 1;
+    }
+
+    bool written = true;
+    auto append = [&](const filesystem::path& path, const vector<char>& data) {
+        ofstream out(path, ios::binary | ios::app);
+        out.write(data.data(), data.size());
+        written = written && out.good();
+    };
+    for (size_t column = 0; column < columns.size(); column++) {
+        append(directory / (column_names[column] + ".col"), columns[column]);
+    }
+    append(directory / "records.bin", records);
+    append(directory / "source.col", source_column);
+    append(directory / "slot.col", slots);
+
+    // Once the store has been clustered, new voices join the family with the nearest centre
+    vector<float> centroids;
+    if (!slots.empty() && load_centroids((directory / "clusters.txt").string(), centroids)) {
+        if (filesystem::file_size(directory / "cluster.col", ec) == existing && !ec) {
+            vector<float> features;
+            extract_store_features(records.data(), slots.size(), features);
+            vector<char> clusters(slots.size());
+            parallel_for(static_cast<int>(slots.size()), [&](int voice) {
+                clusters[voice] = static_cast<char>(nearest_centroid(features.data() + voice * FEATURE_COUNT, centroids));
+            });
+            append(directory / "cluster.col", clusters);
+        }
+        else {
+            cout << "Warning: the clusters of " << argv[2] << " are out of step with its voices, run --cluster again" << endl;
+        }
+    }
+
+    ofstream source_file(directory / "sources.txt", ios::app);
+    for (size_t i = known_sources; i < sources.size(); i++) {
+        source_file << sources[i] << "\n";
+    }
+    source_file.close();
+    if (!written || source_file.fail()) {
+        cout << "Error: could not write to the store in " << argv[2] << endl;
+        return 1;
+    }
+
+    // Merge the new voices into the sorted hash index, then record that the filter covers them
+    sort(new_entries.begin(), new_entries.end());
+    vector<char> merged;
+    merged.reserve((existing + new_entries.size()) * store_index_entry_size);
+    size_t next_entry = 0;
+    for (size_t i = 0; i <= existing; i++) {
+        const unsigned char* entry = reinterpret_cast<const unsigned char*>(index) + i * store_index_entry_size;
+        uint64_t hash = i < existing ? static_cast<uint64_t>(read_le(entry, 4)) | static_cast<uint64_t>(read_le(entry + 4, 4)) << 32 : 0;
+        for (; next_entry < new_entries.size() && (i == existing || new_entries[next_entry].first < hash); next_entry++) {
+            append_le(merged, static_cast<uint32_t>(new_entries[next_entry].first), 4);
+            append_le(merged, static_cast<uint32_t>(new_entries[next_entry].first >> 32), 4);
+            append_le(merged, new_entries[next_entry].second, 4);
+        }
+        if (i < existing) {
+            merged.insert(merged.end(), reinterpret_cast<const char*>(entry), reinterpret_cast<const char*>(entry) + store_index_entry_size);
+        }
+    }
+    index_file.close();
+    Result result = output_committer.write((directory / "hashes.idx").string(), merged);
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    filter.voices = existing + slots.size();
+    if (!filter.close()) {
+        cout << "Error: could not write " << filter_filename << endl;
+        return 1;
+    }
+
+    cout << slots.size() << " voices added from " << sources.size() - known_sources << " sources, " << duplicates
+         << " already in the store skipped (" << false_hits << " false filter hits), the store now holds "
+         << existing + slots.size() << " voices" << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+int run_query(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "   usage:  " << argv[0] << "   --query storedir expression\n";
+        cout << "           (e.g. \"algorithm = 4 and feedback >= 5 and op1.ratio = 2\"; parameters are named as in the\n";
+        cout << "            CSV output, opN.ratio is the frequency ratio, and tests combine with and, or, not and brackets)\n";
+        return 1;
+    }
+    string text;
+    for (int i = 3; i < argc; i++) {
+        text += (i > 3 ? " " : "") + string(argv[i]);
+    }
+    vector<QueryStep> program;
+    vector<string> column_names;
+    string error;
+    if (!compile_query(text, program, column_names, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+
+    // Map only the columns the query tests
+    filesystem::path directory(argv[2]);
+    size_t count = store_voice_count(argv[2]);
+    vector<unique_ptr<MappedFile>> files;
+    vector<const unsigned char*> columns;
+    for (const string& name : column_names) {
+        files.emplace_back(new MappedFile());
+        if (count > 0 && (!files.back()->open((directory / (name + ".col")).string()) || files.back()->size() < count)) {
+            cout << "Error: could not open column " << name << " in " << argv[2] << endl;
+            return 1;
+        }
+        columns.push_back(reinterpret_cast<const unsigned char*>(files.back()->data()));
+    }
+
+    // The last block is run over zero-padded copies, so the kernels never need a length check
+    size_t blocks = (count + query_block_size - 1) / query_block_size;
+    size_t tail = count % query_block_size;
+    vector<vector<unsigned char>> padded;
+    vector<const unsigned char*> tail_columns;
+    if (tail > 0) {
+        for (const unsigned char* column : columns) {
+            padded.emplace_back(query_block_size, 0);
+            memcpy(padded.back().data(), column + (blocks - 1) * query_block_size, tail);
+            tail_columns.push_back(padded.back().data() - (blocks - 1) * query_block_size);
+        }
+    }
+
+    auto start_time = chrono::steady_clock::now();
+    vector<vector<uint32_t>> found(blocks);
+    parallel_for(static_cast<int>(blocks), [&](int block) {
+        unsigned char matches[query_block_size];
+        size_t begin = static_cast<size_t>(block) * query_block_size;
+        bool last = tail > 0 && static_cast<size_t>(block) == blocks - 1;
+        run_query_block(program, last ? tail_columns : columns, begin, matches);
+        size_t end = last ? tail : query_block_size;
+        for (size_t i = 0; i < end; i++) {
+            if (matches[i]) {
+                found[block].push_back(static_cast<uint32_t>(begin + i));
+            }
+        }
+    });
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start_time;
+
+    size_t match_count = 0;
+    for (const auto& block : found) {
+        match_count += block.size();
+    }
+    if (match_count > 0) {
+        MappedFile records, sources, slots;
+        records.open((directory / "records.bin").string());
+        sources.open((directory / "source.col").string());
+        slots.open((directory / "slot.col").string());
+        vector<string> source_names;
+        ifstream source_list(directory / "sources.txt");
+        for (string line; getline(source_list, line); ) {
+            source_names.push_back(line);
+        }
+        size_t listed = 0;
+        for (const auto& block : found) {
+            for (size_t i = 0; i < block.size() && listed < name_search_limit; i++, listed++) {
+                uint32_t id = block[i];
+                uint32_t source = read_le(reinterpret_cast<const unsigned char*>(sources.data()) + id * 4, 4);
+                cout << "  " << setw(9) << id << "  " << left << setw(8) << get_voice_name(records.data() + id * 64) << right
+                     << setw(4) << static_cast<unsigned char>(slots.data()[id]) + 1 << "  " << (source < source_names.size() ? source_names[source] : "?") << endl;
+            }
+        }
+        if (match_count > name_search_limit) {
+            cout << "  ..." << endl;
+        }
+    }
+    cout << endl << match_count << " of " << count << " voices match (" << elapsed.count() << " ms, "
+         << (elapsed.count() > 0 ? count / elapsed.count() / 1000.0 : 0.0) << " million voices per second)" << endl;
+    return match_count > 0 ? 0 : 1;
+}
+
+bool compile_query(const string& text, vector<QueryStep>& program, vector<string>& columns, string& error) {
+    // Split into words, numbers, comparison operators, brackets and commas (a comma means "and")
+    vector<string> tokens;
+    for (size_t i = 0; i < text.size(); ) {
+        unsigned char c = text[i];
+        if (isspace(c)) {
+            i++;
+        }
+        else if (isalpha(c)) {
+            size_t start = i;
+            while (i < text.size() && (isalnum(static_cast<unsigned char>(text[i])) || text[i] == '_' || text[i] == '.')) i++;
+            string word = text.substr(start, i - start);
+            for (char& w : word) {
+                w = static_cast<char>(tolower(static_cast<unsigned char>(w)));
+                if (w == '.') w = '_';
+            }
+            tokens.push_back(word);
+        }
+        else if (isdigit(c) || ((c == '-' || c == '.') && i + 1 < text.size() && isdigit(static_cast<unsigned char>(text[i + 1])))) {
+            size_t start = i++;
+            while (i < text.size() && (isdigit(static_cast<unsigned char>(text[i])) || text[i] == '.')) i++;
+            tokens.push_back(text.substr(start, i - start));
+        }
+        else if (text.compare(i, 2, "<=") == 0 || text.compare(i, 2, ">=") == 0 || text.compare(i, 2, "!=") == 0 || text.compare(i, 2, "==") == 0) {
+            tokens.push_back(text.substr(i, 2));
+            i += 2;
+        }
+        else if (strchr("=<>(),", c)) {
+            tokens.push_back(string(1, static_cast<char>(c)));
+            i++;
+        }
+        else {
+            error = string("unexpected character '") + static_cast<char>(c) + "' in query";
+            return false;
+        }
+    }
+
+    // Recursive descent: or binds loosest, then and, then not. Output is postfix.
+    size_t position = 0;
+    auto peek = [&]() { return position < tokens.size() ? tokens[position] : string(); };
+    function<bool()> parse_or, parse_and, parse_unary;
+    auto parse_test = [&]() {
+        string field = peek();
+        if (field.empty() || !isalpha(static_cast<unsigned char>(field[0]))) {
+            error = field.empty() ? "query ends too early" : "expected a parameter name before " + field;
+            return false;
+        }
+        position++;
+
+        // A voice parameter, an operator parameter (opN_name), or an operator's frequency ratio (opN_ratio)
+        const VoiceParameter* parameter = nullptr;
+        string column = field;
+        bool ratio = false;
+        static const VoiceParameter cluster_parameter = { "cluster", 0, 0, 8, false };
+        for (const VoiceParameter& candidate : voice_parameters) {
+            if (field == candidate.name) parameter = &candidate;
+        }
+        if (field == "cluster") {
+            parameter = &cluster_parameter;
+        }
+        if (!parameter && field.size() > 4 && field.compare(0, 2, "op") == 0 && field[2] >= '1' && field[2] <= '4' && field[3] == '_') {
+            string name = field.substr(4);
+            ratio = name == "ratio";
+            if (ratio) {
+                name = "multiple";
+                column = field.substr(0, 4) + name;
+            }
+            for (const VoiceParameter& candidate : operator_parameters) {
+                if (name == candidate.name) parameter = &candidate;
+            }
+        }
+        if (!parameter) {
+            error = "unknown parameter " + field;
+            return false;
+        }
+
+        string comparison = "=";
+        if (peek() == "=" || peek() == "==" || peek() == "!=" || peek() == "<" || peek() == "<=" || peek() == ">" || peek() == ">=") {
+            comparison = peek();
+            position++;
+        }
+        char* end = nullptr;
+        string number = peek();
+        double value = strtod(number.c_str(), &end);
+        if (number.empty() || *end != '\0') {
+            error = "expected a number after " + field + " " + comparison;
+            return false;
+        }
+        position++;
+
+        // Work out which of the 256 possible column bytes pass the test
+        QueryStep step = {};
+        step.operation = QUERY_TEST;
+        auto existing = find(columns.begin(), columns.end(), column);
+        step.column = static_cast<int>(existing - columns.begin());
+        if (existing == columns.end()) {
+            columns.push_back(column);
+        }
+        int first = -1, last = -1;
+        bool contiguous = true;
+        for (int code = 0; code < 256; code++) {
+            bool valid = parameter->is_signed || code < (1 << parameter->bits);
+            double decoded = parameter->is_signed ? static_cast<signed char>(code) : code;
+            if (ratio) {
+                decoded = code == 0 ? 0.5 : code;
+            }
+            bool match = valid && (comparison == "<" ? decoded < value : comparison == "<=" ? decoded <= value : comparison == ">" ? decoded > value :
+                                   comparison == ">=" ? decoded >= value : comparison == "!=" ? decoded != value : decoded == value);
+            step.table[code] = match ? 1 : 0;
+            if (match) {
+                contiguous = contiguous && (first < 0 || last == code - 1);
+                first = first < 0 ? code : first;
+                last = code;
+            }
+        }
+        // Most tests come out as one range of codes, which compiles to a subtract and compare
+        step.use_table = first < 0 || !contiguous;
+        step.low = static_cast<unsigned char>(max(first, 0));
+        step.high = static_cast<unsigned char>(max(last, 0));
+        program.push_back(step);
+        return true;
+    };
+    parse_unary = [&]() {
+        if (peek() == "not") {
+            position++;
+            if (!parse_unary()) return false;
+            program.push_back(QueryStep{ QUERY_NOT, 0, false, 0, 0, {} });
+            return true;
+        }
+        if (peek() == "(") {
+            position++;
+            if (!parse_or()) return false;
+            if (peek() != ")") {
+                error = "missing )";
+                return false;
+            }
+            position++;
+            return true;
+        }
+        return parse_test();
+    };
+    parse_and = [&]() {
+        if (!parse_unary()) return false;
+        while (peek() == "and" || peek() == ",") {
+            position++;
+            if (!parse_unary()) return false;
+            program.push_back(QueryStep{ QUERY_AND, 0, false, 0, 0, {} });
+        }
+        return true;
+    };
+    parse_or = [&]() {
+        if (!parse_and()) return false;
+        while (peek() == "or") {
+            position++;
+            if (!parse_and()) return false;
+            program.push_back(QueryStep{ QUERY_OR, 0, false, 0, 0, {} });
+        }
+        return true;
+    };
+
+    if (!parse_or()) {
+        return false;
+    }
+    if (position < tokens.size()) {
+        error = "unexpected " + tokens[position] + " in query";
+        return false;
+    }
+    return true;
+}
+
+void run_query_block(const vector<QueryStep>& program, const vector<const unsigned char*>& columns, size_t begin, unsigned char* matches) {
+    // Every loop runs a fixed query_block_size times over plain byte arrays, with no branches
+    // inside, so the compiler turns them into vector instructions
+    thread_local vector<unsigned char> stack;
+    stack.resize(program.size() * query_block_size);
+    size_t depth = 0;
+    for (const QueryStep& step : program) {
+        unsigned char* top = stack.data() + depth * query_block_size;
+        if (step.operation == QUERY_TEST) {
+            const unsigned char* column = columns[step.column] + begin;
+            if (step.use_table) {
+                for (int i = 0; i < query_block_size; i++) {
+                    top[i] = step.table[column[i]];
+                }
+            }
+            else {
+                unsigned char low = step.low;
+                unsigned char span = static_cast<unsigned char>(step.high - step.low);
+                for (int i = 0; i < query_block_size; i++) {
+                    top[i] = static_cast<unsigned char>(column[i] - low) <= span;
+                }
+            }
+            depth++;
+        }
+        else if (step.operation == QUERY_NOT) {
+            unsigned char* operand = top - query_block_size;
+            for (int i = 0; i < query_block_size; i++) {
+                operand[i] ^= 1;
+            }
+        }
+        else {
+            unsigned char* left = top - 2 * query_block_size;
+            const unsigned char* right = top - query_block_size;
+            if (step.operation == QUERY_AND) {
+                for (int i = 0; i < query_block_size; i++) {
+                    left[i] &= right[i];
+                }
+            }
+            else {
+                for (int i = 0; i < query_block_size; i++) {
+                    left[i] |= right[i];
+                }
+            }
+            depth--;
+        }
+    }
+    memcpy(matches, stack.data(), query_block_size);
+}
+
+vector<char> build_store_index(const char* records, size_t count) {
+    vector<pair<uint64_t, uint32_t>> entries(count);
+    parallel_for(static_cast<int>(count), [&](int i) {
+        entries[i] = make_pair(hash_voice(records + static_cast<size_t>(i) * 64), static_cast<uint32_t>(i));
+    });
+    sort(entries.begin(), entries.end());
+    vector<char> index;
+    index.reserve(count * store_index_entry_size);
+    for (const auto& entry : entries) {
+        append_le(index, static_cast<uint32_t>(entry.first), 4);
+        append_le(index, static_cast<uint32_t>(entry.first >> 32), 4);
+        append_le(index, entry.second, 4);
+    }
+    return index;
+}
+
+bool find_in_store_index(const char* index, size_t entries, const char* records, uint64_t hash, const char* record) {
+    // Binary search for the first entry with the hash, then compare the records of every entry
+    // sharing it, in case two voices collide
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(index);
+    auto entry_hash = [&](size_t i) {
+        return static_cast<uint64_t>(read_le(base + i * store_index_entry_size, 4)) |
+               static_cast<uint64_t>(read_le(base + i * store_index_entry_size + 4, 4)) << 32;
+    };
+    size_t low = 0, high = entries;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entry_hash(middle) < hash) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    for (; low < entries && entry_hash(low) == hash; low++) {
+        uint32_t voice = read_le(base + low * store_index_entry_size + 8, 4);
+        if (memcmp(records + static_cast<size_t>(voice) * 64, record, 64) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VoiceFilter::open(const string& filename, size_t store_voices) {
+    close();
+    path = filename;
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > voice_filter_header_size) {
+        void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address != MAP_FAILED) {
+            view = static_cast<unsigned char*>(address);
+            length = static_cast<size_t>(info.st_size);
+            mapped = true;
+        }
+    }
+    ::close(fd);
+#endif
+    if (!mapped) {
+        if (!load_file(filename, contents)) {
+            return false;
+        }
+        view = reinterpret_cast<unsigned char*>(contents.data());
+        length = contents.size();
+    }
+
+    // A filter that covers more voices than the store (the store was cut back) only gives a few
+    // more false hits; one that covers fewer would let duplicates through
+    if (length < voice_filter_header_size || memcmp(view, "FBBF", 4) != 0 || read_le(view + 4, 4) != voice_filter_version) {
+        close();
+        return false;
+    }
+    blocks = read_le(view + 8, 4);
+    voices = read_le(view + 12, 4);
+    if (blocks == 0 || length != voice_filter_header_size + blocks * 64 || voices < store_voices) {
+        close();
+        return false;
+    }
+    voices = store_voices;
+    return true;
+}
+
+bool VoiceFilter::create(const string& filename, size_t capacity) {
+    close();
+    vector<char> image;
+    append_text(image, "FBBF");
+    append_le(image, voice_filter_version, 4);
+    append_le(image, static_cast<uint32_t>((capacity + voice_filter_voices_per_block - 1) / voice_filter_voices_per_block), 4);
+    append_le(image, 0, 4);
+    image.resize(voice_filter_header_size + (capacity + voice_filter_voices_per_block - 1) / voice_filter_voices_per_block * 64, 0);
+    ofstream out(filename, ios::binary | ios::trunc);
+    out.write(image.data(), image.size());
+    out.close();
+    return !out.fail() && open(filename, 0);
+}
+
+bool VoiceFilter::close() {
+    if (!view) {
+        return true;
+    }
+    bool ok = true;
+    view[12] = static_cast<unsigned char>(voices);
+    view[13] = static_cast<unsigned char>(voices >> 8);
+    view[14] = static_cast<unsigned char>(voices >> 16);
+    view[15] = static_cast<unsigned char>(voices >> 24);
+#ifndef _WIN32
+    if (mapped) {
+        munmap(view, length);
+    }
+#endif
+    if (!mapped) {
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(contents.data(), contents.size());
+        out.close();
+        ok = !out.fail();
+    }
+    view = nullptr;
+    length = 0;
+    blocks = 0;
+    mapped = false;
+    contents.clear();
+    return ok;
+}
+
+bool VoiceFilter::maybe_contains(uint64_t hash) const {
+    // The low half of the hash picks the block, the high half (remixed) the bits inside it
+    const unsigned char* block = view + voice_filter_header_size + ((hash & 0xFFFFFFFFull) * blocks >> 32) * 64;
+    uint64_t bits = (hash >> 32 | hash << 32) * 0x9E3779B97F4A7C15ull;
+    bool found = true;
+    for (int i = 0; i < voice_filter_probes; i++, bits >>= 9) {
+        found &= (block[(bits & 511) >> 3] >> (bits & 7) & 1) != 0;
+    }
+    return found;
+}
+
+void VoiceFilter::add(uint64_t hash) {
+    unsigned char* block = view + voice_filter_header_size + ((hash & 0xFFFFFFFFull) * blocks >> 32) * 64;
+    uint64_t bits = (hash >> 32 | hash << 32) * 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < voice_filter_probes; i++, bits >>= 9) {
+        block[(bits & 511) >> 3] |= static_cast<unsigned char>(1 << (bits & 7));
+    }
+}
+
+void deflate_data(const char* data, size_t size, const vector<char>& dictionary, vector<char>& out) {
+    // Greedy LZ77 over hash chains, in one block with the fixed Huffman codes. Voice blocks are
+    // small and mostly matches, so dynamic codes would gain little over their own header.
+    vector<char> window(dictionary);
+    window.insert(window.end(), data, data + size);
+    vector<int> head(1 << 15, -1);
+    vector<int> previous(window.size(), -1);
+    auto insert = [&](size_t position) {
+        if (position + 2 < window.size()) {
+            int hash = ((static_cast<unsigned char>(window[position]) << 10) ^ (static_cast<unsigned char>(window[position + 1]) << 5) ^
+                        static_cast<unsigned char>(window[position + 2])) & 0x7FFF;
+            previous[position] = head[hash];
+            head[hash] = static_cast<int>(position);
+        }
+    };
+    for (size_t position = 0; position < dictionary.size(); position++) {
+        insert(position);
+    }
+
+    BitWriter writer(out);
+    writer.bits(1, 1);   // Last block
+    writer.bits(1, 2);   // Fixed Huffman codes
+    auto literal = [&](int symbol) {
+        if (symbol < 144) writer.code(0x30 + symbol, 8);
+        else if (symbol < 256) writer.code(0x190 + symbol - 144, 9);
+        else if (symbol < 280) writer.code(symbol - 256, 7);
+        else writer.code(0xC0 + symbol - 280, 8);
+    };
+
+    size_t position = dictionary.size();
+    while (position < window.size()) {
+        size_t best_length = 0, best_distance = 0;
+        if (position + 2 < window.size()) {
+            int hash = ((static_cast<unsigned char>(window[position]) << 10) ^ (static_cast<unsigned char>(window[position + 1]) << 5) ^
+                        static_cast<unsigned char>(window[position + 2])) & 0x7FFF;
+            size_t limit = min<size_t>(258, window.size() - position);
+            int chain = 32;
+            for (int candidate = head[hash]; candidate >= 0 && chain-- > 0 && position - candidate <= 32768; candidate = previous[candidate]) {
+                size_t length = 0;
+                while (length < limit && window[candidate + length] == window[position + length]) length++;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = position - candidate;
+                    if (length == limit) break;
+                }
+            }
+        }
+        if (best_length >= 3) {
+            int symbol = 28;
+            while (static_cast<size_t>(deflate_length_base[symbol]) > best_length) symbol--;
+            literal(257 + symbol);
+            writer.bits(static_cast<uint32_t>(best_length - deflate_length_base[symbol]), deflate_length_extra[symbol]);
+            symbol = 29;
+            while (static_cast<size_t>(deflate_distance_base[symbol]) > best_distance) symbol--;
+            writer.code(symbol, 5);
+            writer.bits(static_cast<uint32_t>(best_distance - deflate_distance_base[symbol]), deflate_distance_extra[symbol]);
+            for (size_t i = 0; i < best_length; i++) {
+                insert(position++);
+            }
+        }
+        else {
+            literal(static_cast<unsigned char>(window[position]));
+            insert(position++);
+        }
+    }
+    literal(256);
+    writer.flush();
+}
+
+vector<char> train_dictionary(const char* records, size_t count, size_t size) {
+    // Count the 8-byte runs at each aligned offset of the records (a name, the voice settings,
+    // one operator each) over a sample of the store, and keep the commonest ones that occur
+    // more than once. The commonest go last, nearest the data, where their matches are cheapest.
+    size_t step = max<size_t>(1, count / 65536);
+    unordered_map<string, int> counts;
+    for (size_t voice = 0; voice < count; voice += step) {
+        for (int offset = 0; offset < 64; offset += 8) {
+            counts[string(records + voice * 64 + offset, 8)]++;
+        }
+    }
+    vector<pair<int, string>> runs;
+    for (const auto& run : counts) {
+        if (run.second > 1) {
+            runs.emplace_back(run.second, run.first);
+        }
+    }
+    sort(runs.begin(), runs.end(), [](const pair<int, string>& a, const pair<int, string>& b) { return a.first > b.first; });
+    runs.resize(min(runs.size(), size / 8));
+    vector<char> dictionary;
+    for (auto run = runs.rbegin(); run != runs.rend(); ++run) {
+        dictionary.insert(dictionary.end(), run->second.begin(), run->second.end());
+    }
+    return dictionary;
+}
+
+int run_store_pack(int argc, char* argv[]) {
+    size_t block_voices = voice_archive_block_voices;
+    size_t dictionary_size = voice_archive_dictionary_size;
+    bool usage = argc < 4;
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--block") == 0 && atoi(argv[i + 1]) >= 1) block_voices = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--dictionary") == 0 && atoi(argv[i + 1]) >= 0) dictionary_size = atoi(argv[i + 1]);
+        else usage = true;
+    }
+    // The dictionary and a whole block have to fit in deflate's 32KB window
+    if (usage || argc % 2 != 0 || dictionary_size + block_voices * 69 > 32768) {
+        cout << "   usage:  " << argv[0] << "   --store-pack storedir archive [--block n] [--dictionary bytes]\n";
+        cout << "           (packs the voices of a store into a compressed archive, n voices to a block (default "
+             << voice_archive_block_voices << "),\n";
+        cout << "            deflated with a preset dictionary trained on the store (default " << voice_archive_dictionary_size
+             << " bytes, 0 for none);\n";
+        cout << "            the dictionary plus 69 bytes a voice of a block must stay within 32768)\n";
+        return 1;
+    }
+
+    filesystem::path directory(argv[2]);
+    size_t count = store_voice_count(argv[2]);
+    MappedFile records, sources, slots;
+    if (count == 0 || !records.open((directory / "records.bin").string()) || !sources.open((directory / "source.col").string()) ||
+        !slots.open((directory / "slot.col").string())) {
+        cout << "Error: " << argv[2] << " is not a voice store, or holds no voices" << endl;
+        return 1;
+    }
+    vector<char> source_names;
+    load_file((directory / "sources.txt").string(), source_names);
+
+    auto start_time = chrono::steady_clock::now();
+    vector<char> dictionary = train_dictionary(records.data(), count, dictionary_size);
+
+    // Lay each block out column by column and deflate the blocks in parallel
+    size_t blocks = (count + block_voices - 1) / block_voices;
+    vector<vector<char>> packed(blocks);
+    vector<uint32_t> checksums(blocks);
+    parallel_for(static_cast<int>(blocks), [&](int block) {
+        size_t first = static_cast<size_t>(block) * block_voices;
+        size_t voices = min(block_voices, count - first);
+        vector<char> contents(records.data() + first * 64, records.data() + (first + voices) * 64);
+        contents.insert(contents.end(), sources.data() + first * 4, sources.data() + (first + voices) * 4);
+        contents.insert(contents.end(), slots.data() + first, slots.data() + first + voices);
+        checksums[block] = compute_crc32(contents.data(), contents.size());
+        deflate_data(contents.data(), contents.size(), dictionary, packed[block]);
+    });
+
+    vector<char> image;
+    append_text(image, "FBVA");
+    append_le(image, voice_archive_version, 4);
+    append_le(image, static_cast<uint32_t>(count), 4);
+    append_le(image, static_cast<uint32_t>(block_voices), 4);
+    append_le(image, static_cast<uint32_t>(blocks), 4);
+    append_le(image, static_cast<uint32_t>(dictionary.size()), 4);
+    append_le(image, static_cast<uint32_t>(source_names.size()), 4);
+    image.insert(image.end(), dictionary.begin(), dictionary.end());
+    image.insert(image.end(), source_names.begin(), source_names.end());
+    uint64_t offset = image.size() + blocks * voice_archive_index_entry_size;
+    for (size_t block = 0; block < blocks; block++) {
+        append_le(image, static_cast<uint32_t>(offset), 4);
+        append_le(image, static_cast<uint32_t>(offset >> 32), 4);
+        append_le(image, static_cast<uint32_t>(packed[block].size()), 4);
+        append_le(image, checksums[block], 4);
+        offset += packed[block].size();
+    }
+    for (const vector<char>& block : packed) {
+        image.insert(image.end(), block.begin(), block.end());
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    Result result = output_committer.write(argv[3], image);
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    size_t raw_size = count * 69 + source_names.size();
+    cout << count << " voices packed into " << blocks << " blocks, " << raw_size << " bytes down to " << image.size() << " ("
+         << fixed << setprecision(1) << 100.0 * image.size() / raw_size << "%) in " << setprecision(2) << elapsed.count() << "s" << endl;
+    return 0;
+}
+
+int run_store_fetch(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "   usage:  " << argv[0] << "   --store-fetch archive id [id ...]\n";
+        cout << "           (lists the voices with the given ids, as shown by --query, from a --store-pack archive)\n";
+        return 1;
+    }
+    VoiceArchive archive;
+    string error;
+    if (!archive.open(argv[2], error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+
+    // Consecutive ids in the same block share one inflate
+    size_t loaded = SIZE_MAX;
+    vector<char> contents;
+    int failed = 0;
+    for (int i = 3; i < argc; i++) {
+        char* end = nullptr;
+        unsigned long long id = strtoull(argv[i], &end, 10);
+        if (*end != '\0' || id >= archive.voice_count()) {
+            cout << "Error: there is no voice " << argv[i] << " in " << argv[2] << endl;
+            failed++;
+            continue;
+        }
+        size_t block = id / archive.voices_per_block();
+        if (block != loaded) {
+            loaded = SIZE_MAX;
+            if (!archive.read_block(block, contents)) {
+                cout << "Error: block " << block << " of " << argv[2] << " is damaged" << endl;
+                failed++;
+                continue;
+            }
+            loaded = block;
+        }
+        size_t voices = contents.size() / 69;
+        size_t position = id % archive.voices_per_block();
+        const char* record = contents.data() + position * 64;
+        uint32_t source = read_le(reinterpret_cast<const unsigned char*>(contents.data()) + voices * 64 + position * 4, 4);
+        int slot = static_cast<unsigned char>(contents[voices * 68 + position]);
+        cout << "  " << setw(9) << id << "  " << left << setw(8) << get_voice_name(record) << right << setw(4) << slot + 1 << "  "
+             << archive.source(source) << endl;
+        for (int byte = 0; byte < 64; byte++) {
+            cout << (byte % 16 == 0 ? "             " : " ") << hex << setw(2) << setfill('0')
+                 << static_cast<int>(static_cast<unsigned char>(record[byte])) << dec << setfill(' ') << (byte % 16 == 15 ? "\n" : "");
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+int run_store_scan(int argc, char* argv[]) {
+    if (argc != 3) {
+        cout << "   usage:  " << argv[0] << "   --store-scan archive\n";
+        cout << "           (inflates every block of a --store-pack archive in parallel and checks it)\n";
+        return 1;
+    }
+    VoiceArchive archive;
+    string error;
+    if (!archive.open(argv[2], error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+
+    auto start_time = chrono::steady_clock::now();
+    atomic<size_t> voices{ 0 }, bytes{ 0 }, damaged{ 0 };
+    parallel_for(static_cast<int>(archive.block_count()), [&](int block) {
+        vector<char> contents;
+        if (archive.read_block(block, contents)) {
+            voices += contents.size() / 69;
+            bytes += contents.size();
+        }
+        else {
+            cout << "Error: block " << block << " of " << argv[2] << " is damaged\n";
+            damaged++;
+        }
+    });
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    cout << voices << " voices in " << archive.block_count() << " blocks, " << archive.compressed_size() << " bytes inflated to "
+         << bytes << " in " << fixed << setprecision(3) << elapsed.count() << "s (" << setprecision(1)
+         << (elapsed.count() > 0 ? bytes / elapsed.count() / 1e6 : 0.0) << " MB/s)" << endl;
+    return damaged > 0 || voices != archive.voice_count() ? 1 : 0;
+}
+
+bool VoiceArchive::open(const string& filename, string& error) {
+    if (!file.open(filename)) {
+        error = "could not open " + filename;
+        return false;
+    }
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(file.data());
+    if (file.size() < voice_archive_header_size || memcmp(header, "FBVA", 4) != 0 || read_le(header + 4, 4) != voice_archive_version) {
+        error = filename + " is not a voice archive";
+        return false;
+    }
+    voices = read_le(header + 8, 4);
+    block_voices = read_le(header + 12, 4);
+    blocks = read_le(header + 16, 4);
+    size_t dictionary_size = read_le(header + 20, 4);
+    size_t names_size = read_le(header + 24, 4);
+    size_t index_offset = voice_archive_header_size + dictionary_size + names_size;
+    if (block_voices == 0 || blocks != (voices + block_voices - 1) / block_voices ||
+        index_offset + blocks * voice_archive_index_entry_size > file.size()) {
+        error = filename + " is damaged";
+        return false;
+    }
+    const char* data = file.data() + voice_archive_header_size;
+    dictionary.assign(data, data + dictionary_size);
+    istringstream names(string(data + dictionary_size, names_size));
+    for (string line; getline(names, line); ) {
+        sources.push_back(line);
+    }
+    index = header + index_offset;
+    return true;
+}
+
+const string& VoiceArchive::source(uint32_t number) const {
+    static const string unknown = "?";
+    return number < sources.size() ? sources[number] : unknown;
+}
+
+bool VoiceArchive::read_block(size_t block, vector<char>& contents) const {
+    if (block >= blocks) {
+        return false;
+    }
+    const unsigned char* entry = index + block * voice_archive_index_entry_size;
+    uint64_t offset = static_cast<uint64_t>(read_le(entry, 4)) | static_cast<uint64_t>(read_le(entry + 4, 4)) << 32;
+    size_t size = read_le(entry + 8, 4);
+    if (offset + size > file.size()) {
+        return false;
+    }
+    istringstream packed(string(file.data() + offset, size));
+    size_t block_size = min(block_voices, voices - block * block_voices) * 69;
+    return inflate_stream(packed, contents, dictionary) && contents.size() == block_size &&
+           compute_crc32(contents.data(), contents.size()) == read_le(entry + 12, 4);
+}
+
+void extract_store_features(const char* records, size_t count, vector<float>& features) {
+    // FEATURE_COUNT floats a voice, side by side, so a distance is one short fixed-length loop
+    features.resize(count * FEATURE_COUNT);
+    parallel_for(static_cast<int>(count), [&](int voice) {
+        extract_timbre_features(records + static_cast<size_t>(voice) * 64, features.data() + static_cast<size_t>(voice) * FEATURE_COUNT);
+    });
+}
+
+int nearest_centroid(const float* features, const vector<float>& centroids) {
+    int best = 0;
+    float best_distance = 0;
+    int count = static_cast<int>(centroids.size() / FEATURE_COUNT);
+    for (int c = 0; c < count; c++) {
+        const float* centroid = centroids.data() + c * FEATURE_COUNT;
+        float distance = 0;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            float difference = features[f] - centroid[f];
+            distance += difference * difference;
+        }
+        if (c == 0 || distance < best_distance) {
+            best = c;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+int kmeans_clusters(const vector<float>& features, int k, int iterations, vector<float>& centroids, vector<unsigned char>& assignments) {
+    size_t count = features.size() / FEATURE_COUNT;
+    auto distance = [&](size_t voice, const float* centroid) {
+        float total = 0;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            float difference = features[voice * FEATURE_COUNT + f] - centroid[f];
+            total += difference * difference;
+        }
+        return total;
+    };
+
+    // k-means++ seeding on a sample of the voices: each centre is picked with a probability
+    // growing with its squared distance from the centres already chosen
+    mt19937 random(1);
+    vector<size_t> sample;
+    for (size_t voice = 0; voice < count; voice += max<size_t>(1, count / 65536)) {
+        sample.push_back(voice);
+    }
+    vector<float> nearest(sample.size(), 0);
+    centroids.assign(static_cast<size_t>(k) * FEATURE_COUNT, 0);
+    size_t chosen = sample[random() % sample.size()];
+    for (int c = 0; c < k; c++) {
+        copy(features.begin() + chosen * FEATURE_COUNT, features.begin() + (chosen + 1) * FEATURE_COUNT, centroids.begin() + c * FEATURE_COUNT);
+        double total = 0;
+        for (size_t s = 0; s < sample.size(); s++) {
+            float d = distance(sample[s], centroids.data() + c * FEATURE_COUNT);
+            nearest[s] = c == 0 ? d : min(nearest[s], d);
+            total += nearest[s];
+        }
+        double target = uniform_real_distribution<double>(0, total)(random);
+        chosen = sample[random() % sample.size()];
+        for (size_t s = 0; s < sample.size() && total > 0; s++) {
+            target -= nearest[s];
+            if (target <= 0 && nearest[s] > 0) {
+                chosen = sample[s];
+                break;
+            }
+        }
+    }
+
+    // Lloyd iterations. The voices are split into one range per thread, and each thread sums up
+    // its own range's members per cluster, so the threads share nothing until the sums are added.
+    assignments.assign(count, 0);
+    int workers = max(1, min(static_cast<int>(thread::hardware_concurrency()), static_cast<int>(count / 1024) + 1));
+    int iteration = 0;
+    while (iteration < iterations) {
+        iteration++;
+        vector<vector<double>> sums(workers, vector<double>(static_cast<size_t>(k) * (FEATURE_COUNT + 1), 0));
+        atomic<size_t> changed{ 0 };
+        parallel_for(workers, [&](int worker) {
+            size_t begin = count * worker / workers, end = count * (worker + 1) / workers;
+            vector<double>& sum = sums[worker];
+            size_t moved = 0;
+            for (size_t voice = begin; voice < end; voice++) {
+                int cluster = nearest_centroid(features.data() + voice * FEATURE_COUNT, centroids);
+                moved += assignments[voice] != cluster;
+                assignments[voice] = static_cast<unsigned char>(cluster);
+                double* cluster_sum = sum.data() + cluster * (FEATURE_COUNT + 1);
+                for (int f = 0; f < FEATURE_COUNT; f++) {
+                    cluster_sum[f] += features[voice * FEATURE_COUNT + f];
+                }
+                cluster_sum[FEATURE_COUNT] += 1;
+            }
+            changed += moved;
+        });
+        for (int c = 0; c < k; c++) {
+            double members = 0;
+            for (int w = 0; w < workers; w++) {
+                members += sums[w][c * (FEATURE_COUNT + 1) + FEATURE_COUNT];
+            }
+            // A cluster that lost all its voices keeps its centre and may win some back
+            for (int f = 0; f < FEATURE_COUNT && members > 0; f++) {
+                double total = 0;
+                for (int w = 0; w < workers; w++) {
+                    total += sums[w][c * (FEATURE_COUNT + 1) + f];
+                }
+                centroids[c * FEATURE_COUNT + f] = static_cast<float>(total / members);
+            }
+        }
+        // Done once hardly any voice changes family (the first pass always "changes" them)
+        if (iteration > 1 && changed <= count / 1000) {
+            break;
+        }
+    }
+    // Voices follow the centres of the last pass
+    parallel_for(static_cast<int>(count), [&](int voice) {
+        assignments[voice] = static_cast<unsigned char>(nearest_centroid(features.data() + static_cast<size_t>(voice) * FEATURE_COUNT, centroids));
+    });
+    return iteration;
+}
+
+void agglomerative_clusters(const vector<float>& features, int k, vector<float>& centroids, vector<unsigned char>& assignments) {
+    // Ward's method: start with every voice on its own and keep merging the two clusters whose
+    // merge adds the least variance. The nearest neighbour chain finds merges without a distance
+    // matrix: follow nearest neighbours until two clusters are each other's nearest, and merge them.
+    int count = static_cast<int>(features.size() / FEATURE_COUNT);
+    vector<double> centres(features.begin(), features.end());
+    vector<double> sizes(count, 1);
+    vector<int> merged_into(count, -1);
+    vector<int> active(count);
+    for (int i = 0; i < count; i++) {
+        active[i] = i;
+    }
+    auto cost = [&](int a, int b) {
+        double distance = 0;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            double difference = centres[a * FEATURE_COUNT + f] - centres[b * FEATURE_COUNT + f];
+            distance += difference * difference;
+        }
+        return sizes[a] * sizes[b] / (sizes[a] + sizes[b]) * distance;
+    };
+
+    vector<int> chain;
+    while (static_cast<int>(active.size()) > k) {
+        if (chain.empty()) {
+            chain.push_back(active[0]);
+        }
+        int a = chain.back();
+        // Prefer the previous link on a tie, or duplicate voices could chase each other forever
+        int previous = chain.size() >= 2 ? chain[chain.size() - 2] : -1;
+        int best = previous;
+        double best_cost = previous >= 0 ? cost(a, previous) : 0;
+        for (int b : active) {
+            if (b != a && (best < 0 || cost(a, b) < best_cost)) {
+                best = b;
+                best_cost = cost(a, b);
+            }
+        }
+        if (best != previous) {
+            chain.push_back(best);
+            continue;
+        }
+        chain.pop_back();
+        chain.pop_back();
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            centres[a * FEATURE_COUNT + f] = (centres[a * FEATURE_COUNT + f] * sizes[a] + centres[best * FEATURE_COUNT + f] * sizes[best]) /
+                                             (sizes[a] + sizes[best]);
+        }
+        sizes[a] += sizes[best];
+        merged_into[best] = a;
+        active.erase(find(active.begin(), active.end(), best));
+    }
+
+    // Number the surviving clusters and point every voice at the one it ended up in
+    vector<int> number(count, -1);
+    centroids.clear();
+    for (int i = 0; i < static_cast<int>(active.size()); i++) {
+        number[active[i]] = i;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            centroids.push_back(static_cast<float>(centres[active[i] * FEATURE_COUNT + f]));
+        }
+    }
+    assignments.resize(count);
+    for (int voice = 0; voice < count; voice++) {
+        int root = voice;
+        while (merged_into[root] >= 0) {
+            root = merged_into[root];
+        }
+        assignments[voice] = static_cast<unsigned char>(number[root]);
+    }
+}
+
+bool load_centroids(const string& filename, vector<float>& centroids) {
+    // clusters.txt: a heading, then per cluster its number, voice count and centre
+    ifstream in(filename);
+    centroids.clear();
+    for (string line; getline(in, line); ) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        istringstream fields(line);
+        int number;
+        size_t voices;
+        fields >> number >> voices;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            float value;
+            fields >> value;
+            centroids.push_back(value);
+        }
+        if (!fields) {
+            return false;
+        }
+    }
+    return !centroids.empty() && centroids.size() <= static_cast<size_t>(cluster_limit) * FEATURE_COUNT;
+}
+
+int run_cluster(int argc, char* argv[]) {
+    int k = argc >= 4 ? atoi(argv[3]) : 0;
+    bool agglomerative = false;
+    int iterations = cluster_iterations;
+    bool usage = k < 1 || k > cluster_limit;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--agglomerative") == 0) agglomerative = true;
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 1) iterations = atoi(argv[++i]);
+        else usage = true;
+    }
+    if (usage) {
+        cout << "   usage:  " << argv[0] << "   --cluster storedir k [--agglomerative] [--iterations n]\n";
+        cout << "           (groups the voices of a store into k families (1-" << cluster_limit << ") by their timbre, with k-means,\n";
+        cout << "            or Ward's method for stores of up to " << agglomerative_limit << " voices; voices added later join the\n";
+        cout << "            nearest family, and --query can select a family with \"cluster = n\")\n";
+        return 1;
+    }
+
+    filesystem::path directory(argv[2]);
+    size_t count = store_voice_count(argv[2]);
+    MappedFile records;
+    if (count == 0 || !records.open((directory / "records.bin").string())) {
+        cout << "Error: " << argv[2] << " is not a voice store, or holds no voices" << endl;
+        return 1;
+    }
+    if (agglomerative && count > static_cast<size_t>(agglomerative_limit)) {
+        cout << "Error: " << argv[2] << " holds " << count << " voices, too many for --agglomerative (at most "
+             << agglomerative_limit << ")" << endl;
+        return 1;
+    }
+    k = static_cast<int>(min<size_t>(k, count));
+
+    auto start_time = chrono::steady_clock::now();
+    vector<float> features;
+    extract_store_features(records.data(), count, features);
+    vector<float> centroids;
+    vector<unsigned char> assignments;
+    int passes = 0;
+    if (agglomerative) {
+        agglomerative_clusters(features, k, centroids, assignments);
+    }
+    else {
+        passes = kmeans_clusters(features, k, iterations, centroids, assignments);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    // Each family is shown by the voice nearest its centre
+    vector<size_t> members(k, 0), example(k, 0);
+    vector<float> example_distance(k, -1);
+    for (size_t voice = 0; voice < count; voice++) {
+        int c = assignments[voice];
+        float distance = 0;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            float difference = features[voice * FEATURE_COUNT + f] - centroids[c * FEATURE_COUNT + f];
+            distance += difference * difference;
+        }
+        members[c]++;
+        if (example_distance[c] < 0 || distance < example_distance[c]) {
+            example[c] = voice;
+            example_distance[c] = distance;
+        }
+    }
+
+    ostringstream text;
+    text << "# cluster\tvoices\tcarriers\tbrightness\tattack\tdecay\tsustain\trelease\tpitch\tvibrato\n";
+    text << fixed << setprecision(4);
+    cout << " cluster   voices  example  carriers bright attack decay sustain release pitch vibrato" << endl;
+    cout << fixed << setprecision(2);
+    for (int c = 0; c < k; c++) {
+        text << c << "\t" << members[c];
+        cout << setw(8) << c << setw(9) << members[c] << "  " << left << setw(8)
+             << (members[c] ? get_voice_name(records.data() + example[c] * 64) : "") << right;
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            text << "\t" << centroids[c * FEATURE_COUNT + f];
+            cout << setw(f == 0 ? 9 : 7) << centroids[c * FEATURE_COUNT + f];
+        }
+        text << "\n";
+        cout << endl;
+    }
+
+    string centres = text.str();
+    Result result = output_committer.write((directory / "cluster.col").string(), vector<char>(assignments.begin(), assignments.end()));
+    result.merge(output_committer.write((directory / "clusters.txt").string(), vector<char>(centres.begin(), centres.end())));
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    cout << endl << count << " voices in " << k << " families";
+    if (!agglomerative) {
+        cout << " after " << passes << " k-means passes";
+    }
+    cout << " (" << setprecision(2) << elapsed.count() << "s)" << endl;
+    return 0;
+}
+
+void FlatBufferBuilder::prepend(const void* data, size_t size) {
+    const char* first = static_cast<const char*>(data);
+    bytes.insert(bytes.begin(), first, first + size);
+}
+
+void FlatBufferBuilder::align(size_t size, size_t alignment) {
+    // The finished buffer is a multiple of 8 bytes long, so an offset from the end that is
+    // aligned stays aligned from the start
+    while ((bytes.size() + size) % alignment != 0) {
+        bytes.push_front(0);
+    }
+}
+
+uint32_t FlatBufferBuilder::add_string(const string& text) {
+    // Length, the characters, then a terminating zero
+    align(text.size() + 5, 4);
+    bytes.push_front(0);
+    prepend(text.data(), text.size());
+    vector<char> length;
+    append_le(length, static_cast<uint32_t>(text.size()), 4);
+    prepend(length.data(), 4);
+    return static_cast<uint32_t>(bytes.size());
+}
+
+uint32_t FlatBufferBuilder::add_offset_vector(const vector<uint32_t>& objects) {
+    align(4 * (objects.size() + 1), 4);
+    for (size_t i = objects.size(); i-- > 0; ) {
+        vector<char> offset;
+        append_le(offset, static_cast<uint32_t>(bytes.size() + 4 - objects[i]), 4);
+        prepend(offset.data(), 4);
+    }
+    vector<char> length;
+    append_le(length, static_cast<uint32_t>(objects.size()), 4);
+    prepend(length.data(), 4);
+    return static_cast<uint32_t>(bytes.size());
+}
+
+uint32_t FlatBufferBuilder::add_struct_vector(const vector<char>& elements, size_t count) {
+    align(elements.size(), 8);
+    prepend(elements.data(), elements.size());
+    vector<char> length;
+    append_le(length, static_cast<uint32_t>(count), 4);
+    prepend(length.data(), 4);
+    return static_cast<uint32_t>(bytes.size());
+}
+
+void FlatBufferBuilder::start_table() {
+    table_start = bytes.size();
+    table_fields.clear();
+}
+
+void FlatBufferBuilder::add_scalar(int field, uint64_t value, int size) {
+    align(size, size);
+    char little_endian[8];
+    for (int i = 0; i < size; i++) {
+        little_endian[i] = static_cast<char>(value >> (8 * i));
+    }
+    prepend(little_endian, size);
+    table_fields.emplace_back(field, static_cast<uint32_t>(bytes.size()));
+}
+
+void FlatBufferBuilder::add_offset(int field, uint32_t object) {
+    align(4, 4);
+    vector<char> offset;
+    append_le(offset, static_cast<uint32_t>(bytes.size() + 4 - object), 4);
+    prepend(offset.data(), 4);
+    table_fields.emplace_back(field, static_cast<uint32_t>(bytes.size()));
+}
+
+uint32_t FlatBufferBuilder::end_table() {
+    // The table starts with the distance back to its vtable, which goes just before it: the
+    // vtable and table sizes, then where each field sits from the start of the table
+    align(4, 4);
+    bytes.insert(bytes.begin(), 4, 0);
+    uint32_t table = static_cast<uint32_t>(bytes.size());
+    int field_count = 0;
+    for (const auto& field : table_fields) {
+        field_count = max(field_count, field.first + 1);
+    }
+    vector<uint32_t> entries(2 + field_count, 0);
+    entries[0] = 2 * (2 + field_count);
+    entries[1] = static_cast<uint32_t>(table - table_start);
+    for (const auto& field : table_fields) {
+        entries[2 + field.first] = table - field.second;
+    }
+    vector<char> vtable;
+    for (uint32_t entry : entries) {
+        append_le(vtable, entry, 2);
+    }
+    prepend(vtable.data(), vtable.size());
+    uint32_t distance = static_cast<uint32_t>(bytes.size()) - table;
+    for (int i = 0; i < 4; i++) {
+        bytes[bytes.size() - table + i] = static_cast<char>(distance >> (8 * i));
+    }
+    return table;
+}
+
+vector<char> FlatBufferBuilder::finish(uint32_t root) {
+    align(4, 8);
+    vector<char> offset;
+    append_le(offset, static_cast<uint32_t>(bytes.size() + 4 - root), 4);
+    prepend(offset.data(), 4);
+    return vector<char>(bytes.begin(), bytes.end());
+}
+
+uint32_t add_arrow_schema(FlatBufferBuilder& builder, const vector<ArrowColumn>& columns) {
+    vector<uint32_t> fields;
+    for (const ArrowColumn& column : columns) {
+        uint32_t name = builder.add_string(column.name);
+        uint32_t children = builder.add_offset_vector({});
+        builder.start_table();
+        if (!column.is_string) {
+            builder.add_scalar(0, 8, 4);                  // bitWidth
+            builder.add_scalar(1, column.is_signed, 1);   // is_signed
+        }
+        uint32_t type = builder.end_table();
+        builder.start_table();
+        builder.add_offset(0, name);
+        builder.add_scalar(1, 0, 1);   // Not nullable
+        builder.add_scalar(2, column.is_string ? ARROW_TYPE_UTF8 : ARROW_TYPE_INT, 1);
+        builder.add_offset(3, type);
+        builder.add_offset(5, children);
+        fields.push_back(builder.end_table());
+    }
+    uint32_t field_list = builder.add_offset_vector(fields);
+    builder.start_table();
+    builder.add_scalar(0, 0, 2);   // Little-endian
+    builder.add_offset(1, field_list);
+    return builder.end_table();
+}
+
+vector<char> build_arrow_message(int type, uint64_t body_length, const function<uint32_t(FlatBufferBuilder&)>& header) {
+    FlatBufferBuilder builder;
+    uint32_t header_table = header(builder);
+    builder.start_table();
+    builder.add_scalar(3, body_length, 8);
+    builder.add_offset(2, header_table);
+    builder.add_scalar(0, arrow_metadata_version, 2);
+    builder.add_scalar(1, type, 1);
+    vector<char> metadata = builder.finish(builder.end_table());
+
+    vector<char> message;
+    append_le(message, 0xFFFFFFFF, 4);
+    append_le(message, static_cast<uint32_t>(metadata.size()), 4);
+    message.insert(message.end(), metadata.begin(), metadata.end());
+    return message;
+}
+
+int run_store_arrow(int argc, char* argv[]) {
+    size_t rows = arrow_batch_rows;
+    bool options_ok = argc >= 4 && argc % 2 == 0;
+    unsigned int formats = 0;
+    for (int i = 4; options_ok && i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--rows") == 0 && atoi(argv[i + 1]) >= 1) {
+            rows = atoi(argv[i + 1]);
+        }
+        else {
+            options_ok = strcmp(argv[i], "--sync") == 0 && parse_output_option(argv[i], argv[i + 1], formats);
+        }
+    }
+    if (!options_ok) {
+        cout << "   usage:  " << argv[0] << "   --store-arrow storedir arrowfile [--rows n] [--sync n|off]\n";
+        cout << "           (writes every column of a voice store to an Arrow IPC file, n voices to a record batch\n";
+        cout << "            (default " << arrow_batch_rows << "), for loading into dataframes)\n";
+        return 1;
+    }
+
+    filesystem::path directory(argv[2]);
+    size_t count = store_voice_count(argv[2]);
+    MappedFile records, sources, slots, clusters;
+    if (count == 0 || !records.open((directory / "records.bin").string()) || !sources.open((directory / "source.col").string()) ||
+        !slots.open((directory / "slot.col").string())) {
+        cout << "Error: " << argv[2] << " is not a voice store, or holds no voices" << endl;
+        return 1;
+    }
+    vector<string> source_names;
+    ifstream source_list(directory / "sources.txt");
+    for (string line; getline(source_list, line); ) {
+        source_names.push_back(line);
+    }
+
+    // The parameter columns are exported as they are mapped, in the order of store_column_names()
+    vector<string> column_names = store_column_names();
+    vector<unique_ptr<MappedFile>> files;
+    vector<ArrowColumn> columns;
+    for (size_t i = 0; i < column_names.size(); i++) {
+        const VoiceParameter& parameter = i < static_cast<size_t>(voice_parameter_count) ? voice_parameters[i] :
+                                          operator_parameters[(i - voice_parameter_count) % operator_parameter_count];
+        files.emplace_back(new MappedFile());
+        if (!files.back()->open((directory / (column_names[i] + ".col")).string()) || files.back()->size() < count) {
+            cout << "Error: could not open column " << column_names[i] << " in " << argv[2] << endl;
+            return 1;
+        }
+        columns.push_back(ArrowColumn{ column_names[i], false, parameter.is_signed, files.back()->data() });
+    }
+    columns.push_back(ArrowColumn{ "name", true, false, nullptr });
+    columns.push_back(ArrowColumn{ "source", true, false, nullptr });
+    columns.push_back(ArrowColumn{ "slot", false, false, slots.data() });
+    if (clusters.open((directory / "cluster.col").string()) && clusters.size() == count) {
+        columns.push_back(ArrowColumn{ "cluster", false, false, clusters.data() });
+    }
+
+    auto start_time = chrono::steady_clock::now();
+    string temporary = string(argv[3]) + ".tmp";
+    ofstream out(temporary, ios::binary | ios::trunc);
+    uint64_t position = 0;
+    auto write = [&](const char* data, size_t size) {
+        out.write(data, size);
+        position += size;
+    };
+    auto pad = [&]() {
+        static const char zeros[8] = {};
+        write(zeros, (8 - position % 8) % 8);
+    };
+    write("ARROW1\0\0", 8);
+    vector<char> schema = build_arrow_message(ARROW_MESSAGE_SCHEMA, 0, [&](FlatBufferBuilder& builder) {
+        return add_arrow_schema(builder, columns);
+    });
+    write(schema.data(), schema.size());
+
+    vector<char> blocks;   // Footer entries: offset, metadata size, body size
+    size_t batches = 0;
+    for (size_t first = 0; first < count; first += rows) {
+        size_t voices = min(rows, count - first);
+
+        // Strings are offsets then characters, so only they need building
+        vector<char> name_offsets, name_data, source_offsets, source_data;
+        append_le(name_offsets, 0, 4);
+        append_le(source_offsets, 0, 4);
+        for (size_t voice = first; voice < first + voices; voice++) {
+            string name = get_voice_name(records.data() + voice * 64);
+            name_data.insert(name_data.end(), name.begin(), name.end());
+            append_le(name_offsets, static_cast<uint32_t>(name_data.size()), 4);
+            uint32_t source = read_le(reinterpret_cast<const unsigned char*>(sources.data()) + voice * 4, 4);
+            const string& source_name = source < source_names.size() ? source_names[source] : string();
+            source_data.insert(source_data.end(), source_name.begin(), source_name.end());
+            append_le(source_offsets, static_cast<uint32_t>(source_data.size()), 4);
+        }
+
+        // Every column has a node, and a validity buffer (empty) before its data
+        vector<pair<const char*, size_t>> buffers;
+        for (const ArrowColumn& column : columns) {
+            buffers.emplace_back(nullptr, 0);
+            if (!column.is_string) {
+                buffers.emplace_back(column.data + first, voices);
+            }
+            else if (column.name == "name") {
+                buffers.emplace_back(name_offsets.data(), name_offsets.size());
+                buffers.emplace_back(name_data.data(), name_data.size());
+            }
+            else {
+                buffers.emplace_back(source_offsets.data(), source_offsets.size());
+                buffers.emplace_back(source_data.data(), source_data.size());
+            }
+        }
+        vector<char> nodes, layout;
+        for (size_t i = 0; i < columns.size(); i++) {
+            append_le(nodes, static_cast<uint32_t>(voices), 4);
+            append_le(nodes, static_cast<uint32_t>(static_cast<uint64_t>(voices) >> 32), 4);
+            append_le(nodes, 0, 4);   // No nulls
+            append_le(nodes, 0, 4);
+        }
+        uint64_t body_length = 0;
+        for (const auto& buffer : buffers) {
+            append_le(layout, static_cast<uint32_t>(body_length), 4);
+            append_le(layout, static_cast<uint32_t>(body_length >> 32), 4);
+            append_le(layout, static_cast<uint32_t>(buffer.second), 4);
+            append_le(layout, static_cast<uint32_t>(static_cast<uint64_t>(buffer.second) >> 32), 4);
+            body_length += (buffer.second + 7) / 8 * 8;
+        }
+
+        vector<char> message = build_arrow_message(ARROW_MESSAGE_RECORD_BATCH, body_length, [&](FlatBufferBuilder& builder) {
+            uint32_t node_list = builder.add_struct_vector(nodes, columns.size());
+            uint32_t buffer_list = builder.add_struct_vector(layout, buffers.size());
+            builder.start_table();
+            builder.add_scalar(0, voices, 8);
+            builder.add_offset(1, node_list);
+            builder.add_offset(2, buffer_list);
+            return builder.end_table();
+        });
+        append_le(blocks, static_cast<uint32_t>(position), 4);
+        append_le(blocks, static_cast<uint32_t>(position >> 32), 4);
+        append_le(blocks, static_cast<uint32_t>(message.size()), 4);
+        append_le(blocks, 0, 4);
+        append_le(blocks, static_cast<uint32_t>(body_length), 4);
+        append_le(blocks, static_cast<uint32_t>(body_length >> 32), 4);
+        write(message.data(), message.size());
+        for (const auto& buffer : buffers) {
+            write(buffer.first, buffer.second);
+            pad();
+        }
+        batches++;
+    }
+
+    FlatBufferBuilder builder;
+    uint32_t footer_schema = add_arrow_schema(builder, columns);
+    uint32_t dictionaries = builder.add_struct_vector(vector<char>(), 0);
+    uint32_t record_batches = builder.add_struct_vector(blocks, batches);
+    builder.start_table();
+    builder.add_scalar(0, arrow_metadata_version, 2);
+    builder.add_offset(1, footer_schema);
+    builder.add_offset(2, dictionaries);
+    builder.add_offset(3, record_batches);
+    vector<char> footer = builder.finish(builder.end_table());
+    append_le(footer, static_cast<uint32_t>(footer.size()), 4);
+    append_text(footer, "ARROW1");
+    write(footer.data(), footer.size());
+    out.close();
+
+    // The file was streamed into the committer's temporary name, so it is synced and renamed like any other output
+    error_code ec;
+    if (out.fail()) {
+        cout << "Error: could not write " << argv[3] << endl;
+        filesystem::remove(temporary, ec);
+        return 1;
+    }
+    Result result = output_committer.stage(argv[3]);
+    result.merge(output_committer.flush());
+    if (!result.ok()) {
+        cout << "Error: " << result.describe();
+        return 1;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    cout << count << " voices in " << columns.size() << " columns and " << batches << " record batches written to " << argv[3]
+         << " (" << position << " bytes, " << setprecision(2) << elapsed.count() << "s)" << endl;
+    return 0;
 }